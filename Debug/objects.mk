@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -lm -ldirectfb -ldirect
+LIBS := -lm -lpthread -ldirectfb -ldirect
 
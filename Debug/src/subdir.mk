@@ -4,25 +4,73 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../src/MD_MIDIArena.c \
+../src/MD_MIDICache.c \
+../src/MD_MIDIChase.c \
+../src/MD_MIDIEvents.c \
 ../src/MD_MIDIFile.c \
 ../src/MD_MIDIHelper.c \
+../src/MD_MIDILibrary.c \
+../src/MD_MIDIMute.c \
+../src/MD_MIDIPack.c \
+../src/MD_MIDIPattern.c \
+../src/MD_MIDIPreload.c \
+../src/MD_MIDIScan.c \
+../src/MD_MIDISeek.c \
+../src/MD_MIDISetlist.c \
+../src/MD_MIDIStream.c \
+../src/MD_MIDITempo.c \
+../src/MD_MIDIThin.c \
 ../src/MD_MIDITrack.c \
+../src/MD_MIDITranspose.c \
 ../src/main.c \
 ../src/midi.c \
 ../src/sounds.c 
 
 OBJS += \
+./src/MD_MIDIArena.o \
+./src/MD_MIDICache.o \
+./src/MD_MIDIChase.o \
+./src/MD_MIDIEvents.o \
 ./src/MD_MIDIFile.o \
 ./src/MD_MIDIHelper.o \
+./src/MD_MIDILibrary.o \
+./src/MD_MIDIMute.o \
+./src/MD_MIDIPack.o \
+./src/MD_MIDIPattern.o \
+./src/MD_MIDIPreload.o \
+./src/MD_MIDIScan.o \
+./src/MD_MIDISeek.o \
+./src/MD_MIDISetlist.o \
+./src/MD_MIDIStream.o \
+./src/MD_MIDITempo.o \
+./src/MD_MIDIThin.o \
 ./src/MD_MIDITrack.o \
+./src/MD_MIDITranspose.o \
 ./src/main.o \
 ./src/midi.o \
 ./src/sounds.o 
 
 C_DEPS += \
+./src/MD_MIDIArena.d \
+./src/MD_MIDICache.d \
+./src/MD_MIDIChase.d \
+./src/MD_MIDIEvents.d \
 ./src/MD_MIDIFile.d \
 ./src/MD_MIDIHelper.d \
+./src/MD_MIDILibrary.d \
+./src/MD_MIDIMute.d \
+./src/MD_MIDIPack.d \
+./src/MD_MIDIPattern.d \
+./src/MD_MIDIPreload.d \
+./src/MD_MIDIScan.d \
+./src/MD_MIDISeek.d \
+./src/MD_MIDISetlist.d \
+./src/MD_MIDIStream.d \
+./src/MD_MIDITempo.d \
+./src/MD_MIDIThin.d \
 ./src/MD_MIDITrack.d \
+./src/MD_MIDITranspose.d \
 ./src/main.d \
 ./src/midi.d \
 ./src/sounds.d 
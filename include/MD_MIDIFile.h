@@ -345,6 +345,8 @@ http://www.stephenhobley.com/blog/2011/03/14/the-last-darned-midi-interface-ill-
 
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "main.h"
 /**
  * \file
@@ -372,23 +374,110 @@ http://www.stephenhobley.com/blog/2011/03/14/the-last-darned-midi-interface-ill-
 #define SHOW_UNUSED_META  1
 
 /**
- \def MIDI_MAX_TRACKS
- Max number of MIDI tracks. This may be reduced or increased depending on memory requirements.
- 16 tracks is the maximum available to any MIDI device. Fewer tracks may not allow many MIDI
- files to be played, while a minority of SMF may require more tracks.
+ \def MIDI_BENCHMARK
+ Set to 1 to build benchmarkHelpers(), which times the buffer decoders against the 
+ FILE based ones and prints the results.
  */
-#define MIDI_MAX_TRACKS 16
+#define MIDI_BENCHMARK 0
+
+/**
+ \def MIDI_ARENA_BLOCK
+ Smallest block taken from the heap by the per-song arena that holds the track data. 
+ There is no limit on the number of tracks, the arena grows with the SMF and is released 
+ in one go by closeMIDIFile().
+ */
+#define MIDI_ARENA_BLOCK  4096
 
 /**
  \def TRACK_PRIORITY
- Events may be processed in 2 different ways. One way is to give priority to all 
- events on one track before moving on to the next track (TRACK_PRIORITY) or to process 
- one event from each track and cycling through all tracks round robin fashion until 
- no events are left to be processed (EVENT_PRIORITY). This macro definition enables
- the mode of operation implemented in getNextEvent().
+ Events due at the same tick may be processed in 2 different ways. One way is to give 
+ priority to all events on one track before moving on to the next track (TRACK_PRIORITY) 
+ or to process one event from each track and cycling through all tracks round robin fashion 
+ until no events are left to be processed (EVENT_PRIORITY). This macro definition sets
+ the tie break used by the scheduler heap in processEvents().
  */
 #define TRACK_PRIORITY  0
 
+/**
+ \def MIDI_SEEK_INTERVAL
+ Number of events between the seek checkpoints recorded for each track when a SMF is 
+ loaded with LOAD_MAPPED. A seek decodes at most this many events per track, and the 
+ checkpoints cost 12 bytes each. 
+ */
+#define MIDI_SEEK_INTERVAL  256
+
+/**
+ \def MIDI_CHASE_INTERVAL
+ Number of events between the copies of the controller chase state kept when a SMF is 
+ loaded. chaseMIDIFile() decodes at most this many events from the nearest copy, and 
+ each copy costs about 500 bytes.
+ */
+#define MIDI_CHASE_INTERVAL 4096
+
+/**
+ \def MIDI_STREAM_BUFFER
+ Bytes shared between the read ahead windows of all the tracks when a SMF is played 
+ with LOAD_STREAMED. Each track gets at least 256 bytes whatever this is set to.
+ */
+#define MIDI_STREAM_BUFFER  16384
+
+/**
+ \def MIDI_NAME_SIZE
+ Size of the buffer for the SMF name, including the terminating nul. Long names and 
+ paths can be used, names are no longer limited to 8.3.
+ */
+#define MIDI_NAME_SIZE  256
+
+/**
+ \def MIDI_THIN_INTERVAL
+ When controller thinning is on, a controller message that changes the value by no 
+ more than its tolerance is only removed if it comes less than this many milliseconds 
+ after the last one kept. See setThinning().
+ */
+#define MIDI_THIN_INTERVAL  20
+
+/**
+ \def MIDI_THIN_CC_TOL
+ Default thinning tolerance for the continuous controllers - modulation, breath, foot,
+ volume, pan and expression. Other controllers are never thinned unless set with 
+ setThinTolerance().
+ */
+#define MIDI_THIN_CC_TOL    1
+
+/**
+ \def MIDI_THIN_BEND_TOL
+ Default thinning tolerance for pitch bend, out of 16384. 32 is under a cent with the
+ usual bend range of 2 semitones.
+ */
+#define MIDI_THIN_BEND_TOL  32
+
+/**
+ \def MIDI_THIN_PRESSURE_TOL
+ Default thinning tolerance for channel and key aftertouch.
+ */
+#define MIDI_THIN_PRESSURE_TOL  1
+
+/**
+ \def MIDI_DRUM_CHANNEL
+ The drum channel, counted from 0 (channel 10 on the instrument). Notes on it, or 
+ remapped to it, are never transposed.
+ */
+#define MIDI_DRUM_CHANNEL   9
+
+/**
+ \def MIDI_SCAN_INTERVAL
+ Time in milliseconds between two moves of the song position while scanning, see 
+ setScan().
+ */
+#define MIDI_SCAN_INTERVAL  50
+
+/**
+ \def MIDI_SCAN_BANDWIDTH
+ MIDI bytes per second the controller updates sent while scanning may take. A MIDI 
+ serial link carries 3125, so this leaves room for the other messages sent meanwhile.
+ */
+#define MIDI_SCAN_BANDWIDTH 1500
+
 // ------------- Configuration Section - END
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
@@ -413,7 +502,7 @@ http://www.stephenhobley.com/blog/2011/03/14/the-last-darned-midi-interface-ill-
  */
 typedef struct
 {
-  uint8_t track;    ///< the track this was on
+  uint16_t track;   ///< the track this was on
   uint8_t channel;  ///< the midi channel
   uint8_t size;     ///< the number of data bytes
   uint8_t data[4];  ///< the data. Only 'size' bytes are valid
@@ -424,12 +513,18 @@ typedef struct
  *
  * Structure defining a SYSEX event and its related data.
  * A pointer to this structure type is passed the the related callback function.
+ * 
+ * The data is not copied, it points into the loaded SMF and is only valid during 
+ * the callback. The whole message is there whatever its length. The SMF does not 
+ * store the 0xF0 next to the rest of the message, so it is given as the type and 
+ * has to be sent ahead of the data.
  */
 typedef struct
 {
-  uint8_t track;    ///< the track this was on
-  uint16_t size;    ///< the number of data bytes
-  uint8_t data[50]; ///< the data. Only 'size' bytes are valid
+  uint16_t track;   ///< the track this was on
+  uint8_t  type;    ///< 0xF0 for a message (or its first packet), 0xF7 for a continuation packet or escaped bytes
+  uint32_t size;    ///< the number of data bytes
+  const uint8_t *data;  ///< the bytes after the type, ending with 0xF7 for a complete message. Only 'size' bytes are valid
 } sysex_event;
 
 /**
@@ -437,30 +532,192 @@ typedef struct
  *
  * Structure defining a META event and its related data.
  * A pointer to this structure type is passed the the related callback function.
+ * 
+ * The data is not copied, it points into the loaded SMF and is only valid during 
+ * the callback. Text events are not null terminated.
  */
 typedef struct
 {
-  uint8_t track;    ///< the track this was on
-  uint16_t size;    ///< the number of data bytes
+  uint16_t track;   ///< the track this was on
+  uint32_t size;    ///< the number of data bytes
   uint8_t type;     ///< meta event type
-  union 
-  {
-    uint8_t data[50]; ///< byte data. Only 'size' bytes are valid
-    char chars[50];   ///< string data. Only 'size' bytes are valid
-  };
+  const uint8_t *data;  ///< the event data. Only 'size' bytes are valid
+  char key[4];      ///< key signature (type 0x59) as a null terminated name, eg "C#m", or "Err"
 } meta_event;
 
+/**
+ * Song position definition structure
+ *
+ * Where playback is in the song, as published by the playing thread. See getPosition().
+ * All the members are 32 bit so that they are copied a word at a time.
+ */
+typedef struct
+{
+  uint32_t bar;       ///< bar, counted from 1
+  uint32_t beat;      ///< beat in the bar, counted from 1
+  uint32_t tick;      ///< tick in the beat, counted from 0
+  uint32_t songTick;  ///< ticks from the start of the song
+  uint32_t timeSig;   ///< time signature in force (numerator in the top byte and the denominator in the lower byte)
+  uint32_t tempo;     ///< tempo in beats per minute at the position, rounded, without the tempo adjustment
+  uint32_t elapsed;   ///< time from the start of the song in milliseconds
+  uint32_t remaining; ///< time to the end of the song in milliseconds
+} midi_position;
+
+/**
+ * Tempo map segment
+ *
+ * The tempo map is built by loadMIDIFile() from all the set tempo META events in the SMF. 
+ * Each segment holds the tempo from its starting tick up to the start of the next segment 
+ * and the time the segment starts, so any tick can be converted to time (and back) with 
+ * a binary search instead of replaying the file.
+ */
+struct MD_MFTempo{
+	uint32_t  tick;           ///< tick at which this tempo starts
+	uint32_t  usPerQN;        ///< microseconds per quarter note
+	uint64_t  micros;         ///< microseconds from the start of the song to tick
+};
+
+/**
+ * Time signature map entry
+ *
+ * Built by loadMIDIFile() alongside the tempo map from the time signature META events, 
+ * so that bars and beats can be turned into ticks for seekBar().
+ */
+struct MD_MFTimeSig{
+	uint32_t  tick;           ///< tick at which this time signature starts
+	uint32_t  bar;            ///< bar starting at tick, counted from 0
+	uint8_t   num;            ///< beats in a bar
+	uint8_t   den;            ///< beat note value, 4 for a quarter note
+};
+
+/**
+ * Track seek checkpoint
+ *
+ * The state of a track just before one of its events, recorded by loadMIDIFile() every 
+ * MIDI_SEEK_INTERVAL events so that seekTick() can start decoding from there.
+ */
+struct MD_MFCheckpoint{
+	uint32_t  tick;           ///< tick of the event before the checkpoint
+	uint32_t  offset;         ///< offset in the SMF image of the delta time of the next event
+	uint8_t   rs;             ///< running status in force at the checkpoint
+};
+
+#define CHASE_UNSET   0xff  ///< chase state value not set by the song so far
+#define CHASE_SLOTS   18    ///< values chased per channel - bank, program, 7 controllers, 3 RPNs, pitch bend
+
+/**
+ * Controller chase state
+ *
+ * The last value the song set on each channel for the program, bank select, the main 
+ * controllers (modulation, volume, pan, expression, sustain, reverb, chorus), RPN 0..2 
+ * and pitch bend. Worked out by chaseMIDIFile() so that playback can start part way 
+ * through a song with the instruments set up as if it had played from the start.
+ */
+struct MD_MFChase{
+	uint8_t   value[16][CHASE_SLOTS];   ///< chased values for each channel, CHASE_UNSET if not set
+	uint8_t   rpn[16][2];               ///< RPN selected by CC101/CC100 on each channel
+};
+
+/**
+ * Controller chase state copy
+ *
+ * The chase state at a point of the song, taken by loadMIDIFile() every 
+ * MIDI_CHASE_INTERVAL events.
+ */
+struct MD_MFChasePoint{
+	uint32_t  tick;           ///< the state holds every event before this tick
+	uint32_t  eventIdx;       ///< number of events in the state, the timeline index with LOAD_COMPILED
+	struct MD_MFChase state;  ///< chase state
+};
+
+/**
+ * Track position at a chase state copy
+ *
+ * Where a track was when a chase state copy was taken with LOAD_MAPPED or LOAD_STREAMED. 
+ * There is one of these per track for each copy, in the same block as the copies.
+ */
+struct MD_MFChaseTrack{
+	uint32_t  offset;         ///< image offset of the track next event, after its delta time. 0 at end of track
+	uint32_t  next;           ///< tick of the track next event
+	uint8_t   rs;             ///< running status of the track
+};
+
+/**
+ * Per-song arena block
+ *
+ * Memory for the track data is handed out from a chain of these blocks by arenaAlloc(), 
+ * so it is sized to the SMF without a malloc() per track and freed in one go.
+ */
+struct MD_MFArena{
+	struct MD_MFArena *next;  ///< block allocated before this one
+	uint32_t  size;           ///< bytes in the block after the header
+	uint32_t  used;           ///< bytes handed out so far
+};
+
+// setLoadMode() parameters
+#define LOAD_MAPPED   0   ///< setLoadMode() parameter - tracks are decoded from the mapped SMF as they play
+#define LOAD_COMPILED 1   ///< setLoadMode() parameter - all tracks are compiled into one event timeline at load
+#define LOAD_STREAMED 2   ///< setLoadMode() parameter - tracks are read through small windows, the SMF is not kept in memory
+
+// setEventMask() and setMetaMask() parameters
+#define EVENT_MIDI    0x01  ///< setEventMask() parameter - MIDI channel messages are passed to the MIDI callback
+#define EVENT_SYSEX   0x02  ///< setEventMask() parameter - SYSEX events are passed to the SYSEX callback
+#define EVENT_META    0x04  ///< setEventMask() parameter - META events are passed to the META callback
+#define EVENT_ALL     0x07  ///< setEventMask() parameter - every event is passed to its callback
+#define META_ALL      0x100 ///< setMetaMask() parameter - all META types at once
+
+#define NO_PATTERN    0xffff  ///< no pattern switch waiting (format 2)
+
+// setThinTolerance() parameters
+#define THIN_BEND     128     ///< setThinTolerance() parameter - pitch bend
+#define THIN_PRESSURE 129     ///< setThinTolerance() parameter - channel and key aftertouch
+#define THIN_CONTROLS 130     ///< number of thinning tolerances - the 128 controllers, pitch bend and aftertouch
+#define THIN_OFF      0xffff  ///< setThinTolerance() parameter - never thinned
+
+/**
+ * Compiled event timeline
+ *
+ * When the SMF is loaded with LOAD_COMPILED all the tracks are decoded and merged into 
+ * this structure of arrays, one entry per event in playing order. Running status is 
+ * resolved and delta times are turned into absolute ticks, so playback is a linear walk.
+ */
+struct MD_MFEvents{
+	uint32_t  count;          ///< number of events in the timeline
+	uint32_t *tick;           ///< absolute tick of the event
+	uint32_t *payload;        ///< SYSEX and META only - offset in the SMF image of the byte after the status
+	uint8_t  *status;         ///< full status byte, including the channel for MIDI messages
+	uint8_t  *data1;          ///< first data byte for MIDI messages, meta type for META
+	uint8_t  *data2;          ///< second data byte for MIDI messages
+	uint16_t *track;          ///< track the event came from
+};
+
 
 
 struct MD_MFTrack{
 	
 
-	uint8_t   _trackId;       ///< the id for this track
+	uint16_t  _trackId;       ///< the id for this track
 	uint32_t  _length;        ///< length of track in bytes
 	uint32_t  _startOffset;   ///< start of the track in bytes from start of file
-	uint32_t  _currOffset;    ///< offset from start of the track for the next read of SD data
+	const uint8_t *_data;     ///< start of the track data in the loaded SMF image
+	const uint8_t *_curr;     ///< cursor to the next byte to read from the SMF image
+	const uint8_t *_scan;     ///< cursor used by the load and chase scans, which decode ahead of _curr
+	uint32_t  _scanTick;      ///< tick of the event at _scan
+	uint8_t   _scanRs;        ///< running status for the load and chase scans
+	BOOL      _scanMore;      ///< true while the scan has events left on this track
 	BOOL      _endOfTrack;    ///< true when we have reached end of track or we have encountered an undefined event
-	uint32_t  _elapsedTicks;  ///< the total number of elapsed ticks since last event
+	uint32_t  _nextTick;      ///< song tick of the event at the cursor (its delta time has been read)
+	uint32_t  _ticks;         ///< length of the track in ticks, the tick of its last event
+	uint32_t  _firstEvent;    ///< first event of the track in the compiled timeline (format 2 LOAD_COMPILED only)
+	uint32_t  _endEvent;      ///< and the event after its last one
+	uint32_t  _seq;           ///< scheduler heap order for events due at the same tick (EVENT_PRIORITY)
+	struct MD_MFCheckpoint *_cp;  ///< seek checkpoints for this track (LOAD_MAPPED only)
+	uint32_t  _cpCount;       ///< number of seek checkpoints
+	uint8_t  *_win;           ///< read ahead window (LOAD_STREAMED only)
+	uint32_t  _winOffset;     ///< file offset of the start of the window
+	uint32_t  _winLen;        ///< bytes read into the window
+	uint32_t  _winSize;       ///< size of the window
+	int       _fd;            ///< file the window is read from
 	midi_event  _mev;         ///< data for MIDI callback function - persists between calls for run-on messages
 };
 
@@ -468,17 +725,25 @@ struct MD_MIDIFile{
 	void (*_midiHandler)(int fd,midi_event *pev);   ///< callback into user code to process MIDI stream
 	void (*_sysexHandler)(sysex_event *pev); ///< callback into user code to process SYSEX stream
 	void (*_metaHandler)(const meta_event *pev); ///< callback into user code to process META stream
+	uint8_t   _eventMask;       ///< EVENT_* classes passed to the callbacks
+	uint32_t  _metaMask[8];     ///< one bit per META type passed to the META callback
 	
-	FILE * _fd;
+	const uint8_t *_data;       ///< SMF image, mapped (or read) once by loadMIDIFile()
+	uint32_t _dataLen;          ///< size of the SMF image in bytes
+	BOOL    _dataMapped;        ///< true if _data is mmap()ed, false if it was read into the heap
 	int _uart;
-	char    _fileName[13];      ///< MIDI file name - should be 8.3 format
+	char    _fileName[MIDI_NAME_SIZE];  ///< MIDI file name, or the name of the song in the song pack
+	uint32_t _errorOffset;      ///< offset in the SMF of the corrupt event found by loadMIDIFile()
 
 	uint8_t _format;            ///< file format - 0: single track, 1: multiple track, 2: multiple song
-	uint8_t _trackCount;        ///< number of tracks in file
+	uint16_t _trackCount;       ///< number of tracks in file
 
 	uint16_t  _ticksPerQuarterNote; ///< time base of file
+	uint8_t   _smpteFps;            ///< SMPTE time base frames per second (29 is 29.97), 0 for a metrical time base
+	uint8_t   _smpteRes;            ///< SMPTE time base ticks per frame
 	uint32_t  _tickTime;            ///< calculated per tick based on other data for MIDI file
-	uint16_t  _lastTickError;       ///< error brought forward from last tick check
+	uint64_t  _playMicros;          ///< song time played so far, from which the tick clock works out the song tick
+	uint32_t  _playRemainder;       ///< fraction of a microsecond carried by the tick clock when the tempo is adjusted
 	uint32_t  _lastTickCheckTime;   ///< the last time (microsec) an tick check was performed
 
 	BOOL    _syncAtStart;           ///< sync up at the start of all tracks
@@ -492,11 +757,86 @@ struct MD_MIDIFile{
 
 	// file handling
 	BOOL   _fileOpen;          ///< SDFat select line
+	uint8_t _loadMode;         ///< one of LOAD_MAPPED, LOAD_COMPILED
+
+	struct MD_MFEvents _events;     ///< compiled event timeline (LOAD_COMPILED only)
+	uint32_t  _eventIdx;            ///< next event to play from the compiled timeline
+	uint32_t  _songTick;            ///< ticks played since the start of the song
+	uint32_t  _songTicks;           ///< length of the song in ticks (end of the longest track)
+
+	struct MD_MFTempo *_tempoMap;   ///< tempo changes in tick order, the first one is at tick 0
+	uint16_t  _tempoCount;          ///< number of segments in the tempo map
+	struct MD_MFTimeSig *_timeSigMap;   ///< time signature changes in tick order, the first one is at tick 0
+	uint16_t  _timeSigCount;        ///< number of entries in the time signature map
+	uint16_t  _posSig;              ///< time signature map entry in force at _posTick
+	uint32_t  _posBar;              ///< bar playing at _posTick, counted from 0
+	uint32_t  _posBarTick;          ///< song tick at which that bar starts
+	uint32_t  _posTick;             ///< song tick the position was last worked out for
+	uint64_t  _posEnd;              ///< time of the end of the song in microseconds
+	uint32_t  _posSeq;              ///< seqlock count for _position, odd while it is being written
+	midi_position _position;        ///< position published for other threads
+	struct MD_MFCheckpoint *_checkpoints;  ///< block holding the seek checkpoints of all tracks
+
+	BOOL      _chaseMode;           ///< if true the controller state is chased after a seek or pause
+	struct MD_MFChase _chase;       ///< controller chase state
+	int8_t    _scanRate;            ///< times real time the song is scanned at, negative to rewind, 0 when playing
+	struct MD_MFChase _scanSent;    ///< controller state the instrument has been sent while scanning
+	uint8_t   _scanChannel;         ///< first channel to update at the next scan step
+	struct MD_MFChasePoint *_chasePoints;  ///< chase state copies in song order
+	struct MD_MFChaseTrack *_chaseTracks;  ///< track positions at each copy, _trackCount per copy (not LOAD_COMPILED)
+	uint32_t  _chasePointCount;     ///< number of chase state copies
+
+	BOOL      _thinMode;            ///< if true redundant controller messages are removed when the SMF is compiled
+	uint16_t  _thinTol[THIN_CONTROLS];  ///< thinning tolerance for each controller, pitch bend and aftertouch
+	uint32_t  _thinBytes;           ///< MIDI bytes removed by thinning
+
+	int8_t    _transpose;           ///< semitones the notes are transposed by
+	uint8_t   _channelMap[16];      ///< channel each channel is played on
+	uint8_t  *_xformMem;            ///< block holding the note table and both transform buffers, NULL if not transforming
+	uint16_t *_xformSent;           ///< what each note on was sent as, so its note off matches (LOAD_COMPILED only)
+	uint8_t  *_xform;               ///< transform buffer playing - the channel map, then the status and data1 of every event
+	uint8_t  *volatile _xformNext;  ///< transform buffer rebuilt in the background, ready to swap in - changed atomically
+	uint8_t  *_xformPosted;         ///< transform buffer last handed to the playing thread, not used by it
+	BOOL      _xformThreadStarted;  ///< there is a transform thread to join
+	pthread_t _xformThread;         ///< thread rebuilding the transform buffer
+
+	uint16_t  _channelMute;         ///< one bit per SMF channel muted
+	uint16_t  _channelSolo;         ///< one bit per SMF channel soloed
+	uint32_t *_trackMute;           ///< one bit per track muted, in the arena
+	uint32_t *_trackSolo;           ///< one bit per track soloed, in the arena
+	uint16_t  _trackSolos;          ///< number of tracks soloed
+	uint32_t *_sounding;            ///< note sounding on each channel and note as sent - SOUNDING, SMF channel << 16 and track
+	BOOL      _muteChanged;         ///< a mask changed and the notes it silences are still to be turned off - changed atomically
+
+	char      _cacheDir[64];        ///< directory for the compiled song cache, empty if not used
+	uint8_t  *_cacheMap;            ///< mapped cache file the song was set up from, NULL if none
+	uint32_t  _cacheLen;            ///< size of the mapped cache file
+
+	uint8_t  *_packMap;             ///< mapped song pack, NULL if none is open
+	uint32_t  _packLen;             ///< size of the mapped song pack
+	BOOL      _fromPack;            ///< the song image (and compiled copy) belong to the song pack
+
+	int       _streamFd;            ///< SMF kept open for the track windows (LOAD_STREAMED only)
+	uint8_t  *_streamBuf;           ///< block holding the track windows
+	uint8_t  *_streamLong;          ///< SYSEX and META payloads bigger than a track window are read here
+	uint32_t  _streamLongSize;      ///< size of _streamLong
+
+	uint16_t  _pattern;             ///< track playing in a format 2 file
+	uint16_t  _nextPattern;         ///< track to play next in a format 2 file, NO_PATTERN if none
+	uint32_t  _patternBase;         ///< song tick at which the track playing started
+	uint32_t  _patternSwitch;       ///< song tick at which _nextPattern starts
+
+	uint16_t *_heap;                ///< scheduler min-heap of track numbers keyed on the track _nextTick
+	uint16_t  _heapCount;           ///< number of tracks in the scheduler heap (tracks with events left)
+	uint32_t  _heapSeq;             ///< running sequence number for the EVENT_PRIORITY tie break
 	
-	struct MD_MFTrack   _track[MIDI_MAX_TRACKS]; ///< the track data for this file
+	struct MD_MFArena  *_arena;     ///< newest block of the per-song arena
+	struct MD_MFTrack  *_track;     ///< the track data for this file, _trackCount of them in the arena
 };
 
 	void  parseEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t);  ///< process the event from the physical file
+	const uint8_t *parseSysex(struct MD_MIDIFile *mf,struct MD_MFTrack *t, uint8_t eType, const uint8_t *p);  ///< process a SYSEX event from the SMF image
+	const uint8_t *parseMeta(struct MD_MIDIFile *mf,struct MD_MFTrack *t, const uint8_t *p);  ///< process a META event from the SMF image
 	void resetTrack(struct MD_MFTrack *t);        ///< initialize class variables all in one place
   BOOL getEndOfTrack(struct MD_MFTrack *t);
  
@@ -528,25 +868,25 @@ struct MD_MIDIFile{
    * Get and process the next sequential MIDI or SYSEX event
    *
    * Each track is made up of a sequence of MIDI and SYSEX events that are processed 
-   * in sequential order using this method. An event will not be processed if the track
-   * is at end of track or insufficient time has elapsed for the next event to be 
-   * triggered. Once processed the track position is advanced to the next event to be 
-   * processed.
+   * in sequential order using this method. The scheduler in processEvents() calls it once 
+   * the track _nextTick is due. The event is processed and the delta time of the following 
+   * event is read ahead to work out the new _nextTick.
    * 
    * \param mf          pointer to the MIDI file object calling this track.
-   * \param tickCount   the number of ticks since this method was last called for this track.
-   * \return true if an event was found and processed.
+   * \return true if the track has more events, false at end of track.
    */
   BOOL getNextEvent(struct MD_MIDIFile *mf);
-  BOOL getNextTrackEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t, uint16_t tickCount);
+  BOOL getNextTrackEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t);
   /** 
    * Load the definition of a track
    *
    * Before it can be processed, each track must be initialise to its start conditions by 
-   * invoking this method.
+   * invoking this method. The track keeps a cursor into the SMF image held by the 
+   * MIDI file object, so no file access is made once the track is loaded.
    * 
-   * \param trackId the identifying number for the track [0..MIDI_MAX_TRACKS-1].
+   * \param trackId the identifying number for the track [0..getTrackCount()-1].
    * \param mf      pointer to the MIDI file object calling this track.
+   * \param offset  offset of the track chunk header from the start of the SMF image.
    * \return Error code with one of these values 
    * - -1 if successful 
    * - 0 if the track header is not in the correct format 
@@ -563,14 +903,6 @@ struct MD_MIDIFile{
    */
   void restart(struct MD_MIDIFile *m);
   void restartTrack(struct MD_MFTrack *t);
-  /** 
-   * Reset the start time for this track
-   *
-   * This is used to resynchronize a track when it has been paused.
-   *
-   * \return No return data.
-   */
-  void syncTime(struct MD_MFTrack *t);
   /** @} */
 
   //--------------------------------------------------------------
@@ -658,6 +990,22 @@ struct MD_MIDIFile{
    */
   inline uint16_t getTicksPerQuarterNote(struct MD_MIDIFile *m);
 
+  /** 
+   * Get the SMPTE frame rate
+   *
+   * A SMF with an SMPTE time division counts its ticks in fractions of a frame, so
+   * a tick is a fixed time and the tempo changes in the SMF do not change how fast 
+   * the song plays. getTicksPerQuarterNote() is then the number of ticks in a second
+   * (of 1.001 seconds at 29.97 frames per second), which is also what bars and beats
+   * are counted in as there is no quarter note in the time base.
+   * 
+   * The load() method must be invoked to read the SMF before this is available.
+   * 
+   * \return 24, 25, 29 (for 29.97 drop frame) or 30 frames per second, or 0 if the time 
+   * division is in ticks per quarter note.
+   */
+  uint8_t getFrameRate(struct MD_MIDIFile *m);
+
   /** 
    * Get the Time Signature
    *
@@ -771,8 +1119,9 @@ struct MD_MIDIFile{
   /** 
    * Set the name of the SMF
    *
-   * Copies the supplied name to the class file name buffer.
-   * The name is expected to be in 8.3 format.
+   * Copies the supplied name to the class file name buffer. The name is cut short
+   * to MIDI_NAME_SIZE-1 characters. When a song pack is open the name is looked up 
+   * in the pack first.
    * 
    * \param aname pointer to a string with the file name.
    * \return No return data.
@@ -785,20 +1134,39 @@ struct MD_MIDIFile{
    * Before it can be processed, a file must be opened, loaded and the MIDI playback 
    * initialized by invoking this method. The file name must be set using the 
    * setfilename() method before calling load().
+   *
+   * The whole file is mapped into memory (or read in one go if it cannot be mapped) and 
+   * each track keeps its own cursor into that image, so playback makes no file system calls.
    * 
    * \return Error code with one of these values
    * - -1 = no errors
    * - 0 = Blank file name
-   * - 2 = Can't open file specified
+   * - 2 = Can't open or map the file specified
    * - 3 = File is not MIDI format
    * - 4 = MIDI header size incorrect
-   * - 5 = File format type not 0 or 1
+   * - 5 = File format type not 0, 1 or 2
    * - 6 = File format 0 but more than 1 track
-   * - 7 = More than MIDI_MAX_TRACKS required
+   * - 7 = Metrical time division of 0 ticks per quarter note, or SMPTE time division with an unknown frame rate or no ticks per frame
+   * - 8 = Not enough memory for the tracks, the tempo map, the seek checkpoints, the chase state, the compiled tracks or the transpose
    * - n0 = Track n track chunk not found
    * - n1 = Track n chunk size past end of file
+   * - n2 = Track n has an event that cannot be played, or a set tempo of 0, found at getErrorOffset()
+   *
+   * Every event is checked when the file is loaded, so playback never meets a broken one.
    */
  
+  /** 
+   * Get where a SMF was found to be corrupt
+   *
+   * When loadMIDIFile() fails with a track error n2 this is the offset in the file 
+   * of the delta time of the event that could not be played. A delta time or event that 
+   * runs past the end of its track chunk, running status with no status before it, 
+   * a data byte with the top bit set or an undefined status byte all make a track corrupt.
+   * 
+   * \return the offset in bytes from the start of the file.
+   */
+  uint32_t getErrorOffset(struct MD_MIDIFile *m);
+
   /** @} */
 
   //--------------------------------------------------------------
@@ -823,14 +1191,243 @@ struct MD_MIDIFile{
   /** 
    * Get the number of tracks in the file
    *
-   * The SMF header specifies the number of MIDI tracks in the file. This must be
-   * between [0..MIDI_MAX_TRACKS-1] for the SMF to be successfully processed.
+   * The SMF header specifies the number of MIDI tracks in the file. The track data is
+   * allocated to fit, so there is no limit on the number of tracks.
    * 
    * The load() method must be invoked to read the SMF header information.
    * 
    * \return the number of tracks in the file
    */
-  inline uint8_t getTrackCount(struct MD_MIDIFile *m);
+  inline uint16_t getTrackCount(struct MD_MIDIFile *m);
+
+  /** 
+   * Get the length of the song in ticks
+   *
+   * The length is the tick of the last event of the longest track.
+   * 
+   * The load() method must be invoked to read the SMF before this is available.
+   * 
+   * \return the number of ticks in the song.
+   */
+  uint32_t getSongTicks(struct MD_MIDIFile *m);
+
+  /** 
+   * Get the playing time of the song
+   *
+   * Worked out from the tempo map, so all tempo changes in the SMF are taken into 
+   * account. The tempo adjustment set by setTempoAdjust() is not.
+   * 
+   * The load() method must be invoked to read the SMF before this is available.
+   * 
+   * \return the duration of the song in milliseconds.
+   */
+  uint32_t getSongDuration(struct MD_MIDIFile *m);
+  /** @} */
+
+  //--------------------------------------------------------------
+  /** \name Methods for the tempo map
+   * @{
+   */
+  /** 
+   * Convert a song tick to time
+   *
+   * Uses the tempo map built when the SMF was loaded, in O(log n) for n tempo changes.
+   * With an SMPTE time division the time comes straight from the frame rate.
+   * 
+   * \param tick the song tick to convert.
+   * \return the time of the tick from the start of the song in microseconds.
+   */
+  uint64_t tickToMicros(struct MD_MIDIFile *m, uint32_t tick);
+
+  /** 
+   * Convert a time to a song tick
+   *
+   * The inverse of tickToMicros(), also in O(log n).
+   * 
+   * \param us time from the start of the song in microseconds.
+   * \return the last song tick at or before the time.
+   */
+  uint32_t microsToTick(struct MD_MIDIFile *m, uint64_t us);
+
+  /** 
+   * Get the tempo in force at a song tick
+   *
+   * \param tick the song tick.
+   * \return the tempo in microseconds per quarter note.
+   */
+  uint32_t getTempoAt(struct MD_MIDIFile *m, uint32_t tick);
+
+  /** 
+   * Get the time signature in force at a song tick
+   *
+   * \param tick the song tick.
+   * \return the time signature (numerator in the top byte and the denominator in the lower byte).
+   */
+  uint16_t getTimeSignatureAt(struct MD_MIDIFile *m, uint32_t tick);
+
+  /** 
+   * Get the playing position
+   *
+   * The bar, beat and tick, and the time elapsed and remaining, are worked out by 
+   * getNextEvent() from the previous position as the song plays, following the time 
+   * signature and tempo maps, and after a seek or restart. The times are song time, as
+   * getSongDuration(), so the tempo adjustment set by setTempoAdjust() is not taken 
+   * into account.
+   *
+   * The position is published through a seqlock. It may be read from any thread, for
+   * example to show it on a display, without a lock and without holding up playback:
+   * the read is retried if the playing thread was writing the position meanwhile.
+   * 
+   * \param pos the structure the position is copied to.
+   * \return No return data
+   */
+  void getPosition(struct MD_MIDIFile *m, midi_position *pos);
+
+  /** 
+   * Convert a bar and beat to a song tick
+   *
+   * Uses the time signature map built when the SMF was loaded. A time signature change 
+   * part way through a bar starts a new bar.
+   * 
+   * \param bar  the bar, counted from 1.
+   * \param beat the beat in the bar, counted from 1.
+   * \return the song tick at the start of the beat.
+   */
+  uint32_t barToTick(struct MD_MIDIFile *m, uint32_t bar, uint8_t beat);
+  /** @} */
+
+  //--------------------------------------------------------------
+  /** \name Methods for random access
+   * @{
+   */
+  /** 
+   * Move playback to a song tick
+   *
+   * Playback continues from the first events at or after the tick. With LOAD_MAPPED each 
+   * track is decoded forward from its nearest checkpoint, with LOAD_COMPILED the timeline 
+   * is searched, so the cost does not depend on the length of the song. Tempo and time 
+   * signature are set as they would be at that point of the song. Events in the part of 
+   * the song that is skipped are not played, but the controller state is chased 
+   * (see chaseMIDIFile()). The notes sounding are turned off first, as their note offs 
+   * are skipped.
+   * 
+   * Not available for a format 2 file, see setPattern().
+   * 
+   * \param tick the song tick to play from.
+   * \return false if no SMF is loaded or it is format 2, true otherwise.
+   */
+  BOOL seekTick(struct MD_MIDIFile *m, uint32_t tick);
+
+  /** 
+   * Move playback to a time in the song
+   *
+   * As seekTick(), with the time converted through the tempo map.
+   * 
+   * \param ms time from the start of the song in milliseconds.
+   * \return false if no SMF is loaded, true otherwise.
+   */
+  BOOL seekMillis(struct MD_MIDIFile *m, uint32_t ms);
+
+  /** 
+   * Move playback to a bar and beat
+   *
+   * As seekTick(), with the position converted through the time signature map.
+   * 
+   * \param bar  the bar, counted from 1.
+   * \param beat the beat in the bar, counted from 1.
+   * \return false if no SMF is loaded, true otherwise.
+   */
+  BOOL seekBar(struct MD_MIDIFile *m, uint32_t bar, uint8_t beat);
+
+  /** 
+   * Send the controller state of the song at the current position
+   *
+   * Works out the last program, bank select, main controllers, RPN 0..2 and pitch bend 
+   * the song has set on each channel up to the current position and sends only the 
+   * messages needed to set them, through the MIDI callback. This is done automatically 
+   * after a seek and when playback is resumed from a pause, unless turned off with 
+   * setChase(). Looping does not need it as the song replays from the start. Nothing 
+   * is sent for a format 2 file, whose patterns have no common timeline.
+   * 
+   * \return the number of MIDI bytes sent.
+   */
+  uint16_t chaseMIDIFile(struct MD_MIDIFile *m);
+
+  /** 
+   * Turn the automatic controller chase on or off
+   *
+   * The default is on. See chaseMIDIFile().
+   * 
+   * \param bMode Set true to enable mode, false to disable.
+   * \return No return data.
+   */
+  void setChase(struct MD_MIDIFile *m, BOOL bMode);
+
+  /** 
+   * Fast forward or rewind through the song
+   *
+   * While scanning, getNextEvent() moves the song position on, or back, by rate times 
+   * the time passed every MIDI_SCAN_INTERVAL, instead of playing the events. Notes are 
+   * not played and the notes sounding are turned off when the scan starts. The program, 
+   * controllers and pitch bend are followed instead: at each move only the ones whose 
+   * value is not what the instrument was last sent are sent, as they are at the new 
+   * position, and no more than MIDI_SCAN_BANDWIDTH bytes a second of them. Channels that
+   * do not fit are sent at the next move. A fast forward stops at the end of the song,
+   * and a rewind at its start.
+   * 
+   * Setting the rate to 0 plays on from the position reached, after sending the changes
+   * still due, so the instrument is set up as if the song had played to there.
+   * 
+   * Closing the SMF stops the scan, the next song loaded plays.
+   * 
+   * Not available for a format 2 file, see setPattern().
+   * 
+   * \param rate times real time to fast forward (positive) or rewind (negative) at, 
+   * from 4 to 32 either way, a smaller or larger rate is taken as the nearest. 0 to play.
+   * \return false if no SMF is loaded or it is format 2, true otherwise.
+   */
+  BOOL setScan(struct MD_MIDIFile *m, int8_t rate);
+
+  /** 
+   * Get the scan rate
+   * 
+   * \return the rate set by setScan(), 0 when playing.
+   */
+  int8_t getScan(struct MD_MIDIFile *m);
+  /** @} */
+
+  //--------------------------------------------------------------
+  /** \name Methods for format 2 patterns
+   * @{
+   */
+  /** 
+   * Switch to a pattern
+   *
+   * Each track of a format 2 file is a pattern with its own timeline, and one of them
+   * plays at a time, track 0 to start with. The song clock runs on through a switch, 
+   * and the new pattern plays from its start either straight away or on the next bar 
+   * line of the song clock. A switch costs the same whatever the size of the file, as
+   * nothing is loaded or searched. With looping() set the pattern playing repeats, each
+   * time from the tick after its last event, until another is chosen. Otherwise the 
+   * file is at its end when the pattern is. Notes left sounding by the pattern 
+   * switched from are turned off at the switch, as their note offs are not played.
+   *
+   * The whole file plays at the tempo and time signature set at the start of track 0, 
+   * which is also where the bars are counted from. The tempo can be changed with 
+   * setTempoAdjust().
+   * 
+   * \param n    the pattern (track) number [0..getTrackCount()-1].
+   * \param bBar true to start the pattern on the next bar line, false to start it now.
+   * \return false if the SMF is not format 2 or there is no track n, true otherwise.
+   */
+  BOOL setPattern(struct MD_MIDIFile *m, uint16_t n, BOOL bBar);
+
+  /** 
+   * Get the pattern playing
+   *
+   * \return the track number of the pattern playing in a format 2 file.
+   */
+  uint16_t getPattern(struct MD_MIDIFile *m);
   /** @} */
 
   //--------------------------------------------------------------
@@ -844,7 +1441,7 @@ struct MD_MIDIFile{
    * For SMF file type 0 (1 track only) the single track is looped. 
    * For file type 1, all tracks except track 0 (the first) is looped. Track 0 contains
    * global setup information that does not need to be repeated and would delay the restart
-   * of the looped tracks.
+   * of the looped tracks. For file type 2, the pattern playing is looped (see setPattern()).
    * 
    * \param bMode Set true to enable mode, false to disable.
    * \return No return data.
@@ -899,7 +1496,10 @@ struct MD_MIDIFile{
    * calculations or other checks are performed, so this function is suitable to be called 
    * from user code that implements timer synchronization with an external MIDI clock.
    * 
-   * Events in the SMF are processed in sequential order in one of 2 different ways:
+   * Tracks are held in a min-heap keyed on the tick of their next event, so the work done
+   * depends on the number of events that are due and not on the number of tracks.
+   *
+   * Events due at the same tick are processed in one of 2 different ways:
    * - process all events on one track before moving on to the next track (TRACK_PRIORITY)
    * - process one event from each track and cycling through all tracks round robin fashion 
    * until no events are left to be processed (EVENT_PRIORITY).
@@ -962,6 +1562,323 @@ struct MD_MIDIFile{
    * \return No return data
    */
   void setMetaHandler(struct MD_MIDIFile *m,void (*mh)(const meta_event *mev));
+
+  /** 
+   * Set the classes of event passed to the callbacks
+   *
+   * Events of a class that is not in the mask are skipped at the parser with as little 
+   * work as possible - a SYSEX or META event is stepped over using its length, and its
+   * data is not read, decoded or handed to the callback. The library still acts on the 
+   * set tempo, time signature and end of track META events whatever the mask is.
+   *
+   * The default is EVENT_ALL. A class with no callback set is skipped in the same way.
+   * 
+   * \param mask any of EVENT_MIDI, EVENT_SYSEX, EVENT_META ORed together, or EVENT_ALL.
+   * 
+   * \return No return data.
+   */
+  void setEventMask(struct MD_MIDIFile *m,uint8_t mask);
+
+  /** 
+   * Choose the META types passed to the META callback
+   *
+   * Only the types turned on here are decoded and handed to the META callback. For example 
+   * an application only following tempo and markers would call setMetaMask(m, META_ALL, FALSE) 
+   * then turn on 0x51 and 0x06. Other META events are skipped as for setEventMask().
+   *
+   * All the types are turned on by default.
+   * 
+   * \param type the META type (0x00-0xff), or META_ALL for every type.
+   * \param bWanted true to pass the type to the callback, false to skip it.
+   * 
+   * \return No return data.
+   */
+  void setMetaMask(struct MD_MIDIFile *m,uint16_t type,BOOL bWanted);
+
+  /** 
+   * Open a song pack
+   *
+   * A song pack is a single file holding many SMF, with a directory of the songs sorted 
+   * by name. It is written by writeSongPack(). The whole pack is mapped once and stays 
+   * open until closeSongPack(), so loadMIDIFile() can open any song in it without 
+   * looking up, opening or reading a file. Songs that were compiled when the pack was 
+   * written are set up from their compiled copy when loaded with LOAD_COMPILED.
+   *
+   * Once the pack is open, loadMIDIFile() first looks for the setFilename() name in the 
+   * pack and only goes to the file system if it is not there. Songs from the pack are 
+   * played as with LOAD_MAPPED when LOAD_STREAMED is set, as the pack is mapped anyway.
+   * 
+   * \param path the song pack file.
+   * \return true if the pack was opened, false if it is not a song pack or cannot be mapped.
+   */
+  BOOL openSongPack(struct MD_MIDIFile *m, const char *path);
+
+  /** 
+   * Close the song pack
+   *
+   * The current song must be closed with closeMIDIFile() first if it came from the pack.
+   * 
+   * \return No return data
+   */
+  void closeSongPack(struct MD_MIDIFile *m);
+
+  /** 
+   * Get the number of songs in the song pack
+   * 
+   * \return the number of songs, 0 if no pack is open.
+   */
+  uint32_t getPackSize(struct MD_MIDIFile *m);
+
+  /** 
+   * Get the name of a song in the song pack
+   * 
+   * \param n the song number [0..getPackSize()-1], in name order.
+   * \return the song name, or NULL if there is no song n.
+   */
+  const char *getPackName(struct MD_MIDIFile *m, uint32_t n);
+
+  /** 
+   * Choose a song in the song pack by number
+   *
+   * Sets the file name to the name of song n, ready for loadMIDIFile().
+   * 
+   * \param n the song number [0..getPackSize()-1].
+   * \return true if there is a song n.
+   */
+  BOOL setPackSong(struct MD_MIDIFile *m, uint32_t n);
+
+  /** 
+   * Set the way the SMF is prepared for playback
+   *
+   * With LOAD_MAPPED (the default) each track is decoded from the mapped SMF as it plays.
+   * With LOAD_COMPILED loadMIDIFile() decodes every track once and merges them into a 
+   * single timeline of pre-decoded events, so playback does no decoding at all. This 
+   * costs 12 bytes of memory per event.
+   *
+   * With LOAD_STREAMED the SMF is only mapped while it is loaded, and for the time a seek 
+   * or chase takes. Each track plays from its own read ahead window, refilled from the 
+   * file ahead of the cursor with the kernel asked to read the next window in advance. 
+   * The windows share MIDI_STREAM_BUFFER bytes. A SYSEX or META event longer than the 
+   * window is skipped correctly, but only the part of it in the window can be seen by 
+   * the callback.
+   *
+   * Must be called before loadMIDIFile() to take effect.
+   * 
+   * \param mode one of LOAD_MAPPED, LOAD_COMPILED, LOAD_STREAMED.
+   * \return No return data
+   */
+  void setLoadMode(struct MD_MIDIFile *m,uint8_t mode);
+
+  /** 
+   * Set the directory for the compiled song cache
+   *
+   * With LOAD_COMPILED, loadMIDIFile() writes everything it has worked out for a song 
+   * (the SMF image, the compiled timeline, the tempo and time signature maps and the 
+   * chase state copies) to a cache file in this directory. The next time the same file 
+   * is loaded, and its size and modification time have not changed, the cache file is 
+   * mapped and used in place without parsing anything.
+   *
+   * The cache file is named after a hash of the SMF path and keyed on the full path, 
+   * so the same SMF loaded through different paths is cached twice. A stale cache file 
+   * is replaced when the SMF is next loaded.
+   * 
+   * \param dir the directory, which must exist. NULL or an empty string turns the cache off (the default).
+   * \return No return data
+   */
+  void setCacheDir(struct MD_MIDIFile *m, const char *dir);
+
+  /** 
+   * Turn controller thinning on or off
+   *
+   * Exported SMF often have pitch bend, aftertouch and controller streams with a message
+   * on every tick, which take up much of the 31250 baud serial link and delay the notes.
+   * With thinning on, loadMIDIFile() removes the messages in these streams that are not 
+   * needed when it compiles the SMF:
+   * - a message that repeats the value last sent on the channel.
+   * - a message that changes the value by no more than the tolerance for its controller 
+   * (see setThinTolerance()) and comes less than MIDI_THIN_INTERVAL ms after the last 
+   * one kept.
+   *
+   * The shape of the curve is kept. The message at each peak and dip of a stream is 
+   * kept, and so is the last message before the stream stops changing, so the value 
+   * always ends up where the SMF leaves it. A reset all controllers or a SYSEX starts 
+   * every stream afresh.
+   *
+   * The default is off. Thinning is only done with LOAD_COMPILED, and must be set before
+   * loadMIDIFile() to take effect. Songs in the cache or in a song pack that were compiled
+   * with other thinning settings are compiled again.
+   * 
+   * \param bMode Set true to enable mode, false to disable.
+   * \return No return data
+   */
+  void setThinning(struct MD_MIDIFile *m, BOOL bMode);
+
+  /** 
+   * Set the thinning tolerance for a controller
+   *
+   * The tolerance is how far the value may change before a message is always kept, 
+   * in the units of the message: 0..127 for a controller or aftertouch and 0..16383 
+   * for pitch bend. With 0 only repeated values are removed, and THIN_OFF leaves the 
+   * controller alone. The defaults are MIDI_THIN_CC_TOL for the continuous controllers 
+   * (1, 2, 4, 7, 10 and 11), MIDI_THIN_BEND_TOL and MIDI_THIN_PRESSURE_TOL, with the 
+   * other controllers left alone.
+   *
+   * Controllers that work as switches or are part of a sequence, such as the sustain 
+   * pedal or RPN and data entry, should be left alone.
+   * 
+   * \param ctl       the controller number (0..127), THIN_BEND or THIN_PRESSURE.
+   * \param tolerance the tolerance, or THIN_OFF.
+   * \return No return data
+   */
+  void setThinTolerance(struct MD_MIDIFile *m, uint8_t ctl, uint16_t tolerance);
+
+  /** 
+   * Get the MIDI traffic saved by thinning
+   *
+   * \return the MIDI bytes per second the song loaded sends less because of thinning, 
+   * on average over the song. 0 if thinning was off.
+   */
+  uint32_t getThinSaving(struct MD_MIDIFile *m);
+
+  /** 
+   * Transpose the song
+   *
+   * Every note, except on the drum channel (MIDI_DRUM_CHANNEL), is moved by the number
+   * of semitones. A note that would leave the MIDI range is moved by whole octaves to 
+   * stay in it.
+   *
+   * With LOAD_COMPILED the transpose and the channel map (see setChannelMap()) are
+   * applied once to the compiled timeline, and playback does no more work for them.
+   * Set before loadMIDIFile(), they are applied when the song is loaded. Changed while
+   * the song plays, the timeline is transformed again by a background thread and the
+   * new one takes over between two events, so the playing thread never waits. Notes
+   * already sounding are turned off as they were sent. The call waits for a change 
+   * still being applied, which takes a few milliseconds for a big song.
+   *
+   * With the other load modes the events are played as they are in the SMF.
+   * 
+   * \param semitones the transpose, from -127 to 127. 0 plays the song as written.
+   * \return No return data
+   */
+  void setTranspose(struct MD_MIDIFile *m, int8_t semitones);
+
+  /** 
+   * Get the transpose
+   * 
+   * \return the semitones set by setTranspose().
+   */
+  int8_t getTranspose(struct MD_MIDIFile *m);
+
+  /** 
+   * Play a channel on another channel
+   *
+   * All the messages on a channel, and the controller chase for it, are sent on another
+   * one instead, for example to play a part on a different Ketron part. Applied as the 
+   * transpose is, see setTranspose(). Several channels may be played on the same one.
+   * 
+   * \param from the channel in the SMF [0..15].
+   * \param to   the channel to play it on [0..15].
+   * \return No return data
+   */
+  void setChannelMap(struct MD_MIDIFile *m, uint8_t from, uint8_t to);
+
+  /** 
+   * Get the channel a channel is played on
+   * 
+   * \param ch the channel in the SMF [0..15].
+   * \return the channel set by setChannelMap(), ch if it has not been set.
+   */
+  uint8_t getChannelMap(struct MD_MIDIFile *m, uint8_t ch);
+
+  /** 
+   * Mute a track
+   *
+   * The notes of a muted track are not sent. Its other channel messages, such as 
+   * controllers and program changes, still are so the channel is set up when the track
+   * is unmuted. A track is also silent when other tracks are soloed and it is not, see 
+   * setTrackSolo(). The track and channel masks are checked before an event is sent, 
+   * and a track or channel silenced by either is not heard.
+   *
+   * When a track or channel is silenced the notes it has sounding are turned off, and 
+   * only those, by the next call to getNextEvent(). The masks may be changed by another
+   * thread while the song plays.
+   *
+   * The track masks belong to the song loaded, and are cleared when a song is loaded.
+   * 
+   * \param track  the track number [0..getTrackCount()-1].
+   * \param bMute  true to mute the track, false to play it.
+   * \return No return data
+   */
+  void setTrackMute(struct MD_MIDIFile *m, uint16_t track, BOOL bMute);
+
+  /** 
+   * Get the mute setting of a track
+   * 
+   * \param track the track number.
+   * \return true if the track is muted by setTrackMute().
+   */
+  BOOL getTrackMute(struct MD_MIDIFile *m, uint16_t track);
+
+  /** 
+   * Solo a track
+   *
+   * When any track is soloed, only the tracks soloed are heard. Applied as the track
+   * mute is, see setTrackMute().
+   * 
+   * \param track  the track number [0..getTrackCount()-1].
+   * \param bSolo  true to solo the track, false to clear its solo.
+   * \return No return data
+   */
+  void setTrackSolo(struct MD_MIDIFile *m, uint16_t track, BOOL bSolo);
+
+  /** 
+   * Get the solo setting of a track
+   * 
+   * \param track the track number.
+   * \return true if the track is soloed by setTrackSolo().
+   */
+  BOOL getTrackSolo(struct MD_MIDIFile *m, uint16_t track);
+
+  /** 
+   * Mute a channel
+   *
+   * The notes on a channel of the SMF are not sent, whatever track they are on. Applied
+   * as the track mute is, see setTrackMute(). The channel masks are kept from song to 
+   * song. The channel is the one in the SMF, before any setChannelMap().
+   * 
+   * \param ch     the channel in the SMF [0..15].
+   * \param bMute  true to mute the channel, false to play it.
+   * \return No return data
+   */
+  void setChannelMute(struct MD_MIDIFile *m, uint8_t ch, BOOL bMute);
+
+  /** 
+   * Get the mute setting of a channel
+   * 
+   * \param ch the channel in the SMF [0..15].
+   * \return true if the channel is muted by setChannelMute().
+   */
+  BOOL getChannelMute(struct MD_MIDIFile *m, uint8_t ch);
+
+  /** 
+   * Solo a channel
+   *
+   * When any channel is soloed, only the channels soloed are heard. Applied as the 
+   * channel mute is, see setChannelMute().
+   * 
+   * \param ch     the channel in the SMF [0..15].
+   * \param bSolo  true to solo the channel, false to clear its solo.
+   * \return No return data
+   */
+  void setChannelSolo(struct MD_MIDIFile *m, uint8_t ch, BOOL bSolo);
+
+  /** 
+   * Get the solo setting of a channel
+   * 
+   * \param ch the channel in the SMF [0..15].
+   * \return true if the channel is soloed by setChannelSolo().
+   */
+  BOOL getChannelSolo(struct MD_MIDIFile *m, uint8_t ch);
   /** @} */
 
   //--------------------------------------------------------------
@@ -982,10 +1899,79 @@ struct MD_MIDIFile{
   inline uint32_t getMicros();
   void    calcTickTime(struct MD_MIDIFile *m); ///< called internally to update the tick time when parameters change
   void    initialise(struct MD_MIDIFile *m,int fd);   ///< initialize class variables all in one place
+  void    copySettings(struct MD_MIDIFile *to, const struct MD_MIDIFile *from);  ///< copy the settings (not the song) of one object to another
   void    synchTracks(struct MD_MIDIFile *m);  ///< synchronize the start of all tracks
+  void    startPattern(struct MD_MIDIFile *m, uint16_t n, uint32_t tick);  ///< start playing track n of a format 2 file at a song tick
+  BOOL    patternEnded(struct MD_MIDIFile *m);  ///< the pattern playing has no events left
+  void    processPatternEvents(struct MD_MIDIFile *m, uint16_t ticks);  ///< processEvents() for a format 2 file
+  void    findPatterns(struct MD_MIDIFile *m);  ///< find each track of a format 2 file in the compiled timeline
+  void    dispatchEvent(struct MD_MIDIFile *m, uint32_t i);  ///< hand a compiled event to the callbacks
+  void    initThinning(struct MD_MIDIFile *m);  ///< set the default thinning tolerances
+  int     thinEvents(struct MD_MIDIFile *m);    ///< remove the redundant controller messages from the compiled timeline
+  int     initTransform(struct MD_MIDIFile *m); ///< apply the transpose and channel map to a newly loaded song
+  void    freeTransform(struct MD_MIDIFile *m); ///< release the transform buffers
+  void    swapTransform(struct MD_MIDIFile *m); ///< take over the transform buffer rebuilt in the background
+  int     allocMute(struct MD_MIDIFile *m, uint16_t count);  ///< set up the track masks and the sounding notes for a new song
+  BOOL    mutedEvent(struct MD_MIDIFile *m, const midi_event *mev, uint8_t ch);  ///< true if a channel message is silenced, keeps track of the notes sounding
+  void    applyMute(struct MD_MIDIFile *m);     ///< turn off the notes a mask change has silenced
   uint16_t tickClock(struct MD_MIDIFile *m);   ///< work out the number of ticks since the last event check
 
-  int loadTrack(struct MD_MFTrack *t,uint8_t trackId, struct MD_MIDIFile *mf);
+#define TRACK_STREAMING(t)  ((t)->_data == NULL && (t)->_win != NULL)  ///< track is playing from its read ahead window
+#define STREAM_WINDOWED(m)  ((m)->_streamFd >= 0 && (m)->_data == NULL)  ///< tracks are playing from their windows, the SMF image is not mapped
+#define NOTE_SENT  0x8000  ///< _xformSent entry is in use - the note on went out as channel << 8 | note
+#define SOUNDING  0x80000000  ///< _sounding entry is in use - the note on came from the SMF channel and track in the low bits
+#define IS_END_OF_TRACK(s, d1)  ((s) == 0xff && (d1) == 0x2f)  ///< decoded event is the end of track META
+#define IS_PLAYER_META(type)  ((type) == 0x2f || (type) == 0x51 || (type) == 0x58)  ///< META type the library acts on itself
+#define META_WANTED(m, type)  ((m)->_metaHandler != NULL && ((m)->_eventMask & EVENT_META) && \
+                               (((m)->_metaMask[(type) >> 5] >> ((type) & 31)) & 1))  ///< META type is passed to the callback
+#define SYSEX_WANTED(m)  ((m)->_sysexHandler != NULL && ((m)->_eventMask & EVENT_SYSEX))  ///< SYSEX events are passed to the callback
+
+  int loadTrack(struct MD_MFTrack *t,uint16_t trackId, struct MD_MIDIFile *mf, uint32_t offset);
+  int compileTracks(struct MD_MIDIFile *m);   ///< build the compiled event timeline from the loaded tracks
+  void freeEvents(struct MD_MIDIFile *m);     ///< release the compiled event timeline
+  void processCompiledEvents(struct MD_MIDIFile *m, uint16_t ticks);  ///< processEvents() for LOAD_COMPILED
+  void rebuildHeap(struct MD_MIDIFile *m);    ///< put all tracks with events left into the scheduler heap
+  BOOL nextDueTrack(struct MD_MIDIFile *m, uint32_t tick, uint16_t *trk);  ///< earliest track if due by tick
+  void trackAdvanced(struct MD_MIDIFile *m, BOOL bMore); ///< reschedule (or drop) the earliest track
+  uint32_t eventsSize(uint32_t count);        ///< size of the block holding the timeline columns
+  void setEventColumns(struct MD_MFEvents *e, uint8_t *mem, uint32_t count); ///< point the timeline columns into a block
+  BOOL loadCache(struct MD_MIDIFile *m);      ///< set up the song from an up to date cache file
+  BOOL saveCache(struct MD_MIDIFile *m);      ///< write the compiled song to the cache
+  void unloadCache(struct MD_MIDIFile *m);    ///< release the cache file the song was set up from
+  BOOL useCache(struct MD_MIDIFile *m, uint8_t *map, uint32_t len);  ///< set up the song from a compiled copy in memory
+  BOOL writeCache(struct MD_MIDIFile *m, int fd, const struct stat *st, uint32_t *imageOffset);  ///< write the compiled song at the current file position
+  BOOL packSong(struct MD_MIDIFile *m);       ///< use the song from the song pack, if it is there
+  uint32_t countEvents(struct MD_MFTrack *t); ///< number of events in a track, as far as parseEvent() would go
+  int  buildCheckpoints(struct MD_MIDIFile *m);  ///< record the seek checkpoints of all tracks
+  void freeCheckpoints(struct MD_MIDIFile *m);   ///< release the seek checkpoints
+  BOOL decodeEvent(struct MD_MIDIFile *m, const uint8_t **pp, const uint8_t *end, uint8_t *rs, uint8_t *status, uint8_t *d1, uint8_t *d2, uint32_t *payload); ///< decode an event without processing it
+  int  buildChasePoints(struct MD_MIDIFile *m); ///< take the chase state copies
+  void freeChasePoints(struct MD_MIDIFile *m);  ///< release the chase state copies
+  void chaseState(struct MD_MIDIFile *m);     ///< work out the chase state from the events played so far
+  uint16_t chaseSend(struct MD_MIDIFile *m);  ///< send the chase state, returns the bytes sent
+  BOOL chaseCurrent(struct MD_MIDIFile *m);   ///< chaseState(), mapping the SMF again when streaming
+  uint16_t chaseUpdate(struct MD_MIDIFile *m, struct MD_MFChase *sent, uint16_t budget, uint8_t *first);  ///< send the chase state changes that fit in a budget
+  BOOL scanStep(struct MD_MIDIFile *m, uint32_t now);  ///< getNextEvent() while scanning
+  void soundingOff(struct MD_MIDIFile *m);    ///< turn off every note sounding
+  int  buildTempoMap(struct MD_MIDIFile *m);  ///< collect the tempo and time signature changes of all tracks into the maps
+  void freeTempoMap(struct MD_MIDIFile *m);   ///< release the tempo and time signature maps
+  void resetPosition(struct MD_MIDIFile *m);  ///< start the playing position of a newly loaded song
+  void updatePosition(struct MD_MIDIFile *m); ///< work out the playing position from the last one and publish it
+  int  loadImage(struct MD_MIDIFile *m);    ///< map (or read) the whole SMF into memory
+  int  parseImage(struct MD_MIDIFile *m);   ///< read the header, tracks and tempo map from the SMF image
+  int  openStream(struct MD_MIDIFile *m);   ///< set up the track windows for LOAD_STREAMED
+  void closeStream(struct MD_MIDIFile *m);  ///< release the track windows
+  BOOL mapStreamImage(struct MD_MIDIFile *m);   ///< map the SMF again and move the track cursors into it
+  void unmapStreamImage(struct MD_MIDIFile *m); ///< move the track cursors into their windows and unmap the SMF
+  void trackSeek(struct MD_MFTrack *t, uint32_t offset); ///< read the window from offset in the file
+  void trackFill(struct MD_MFTrack *t);     ///< refill the window if the next event may not be in it
+  BOOL trackDone(struct MD_MFTrack *t);     ///< true if the cursor is at the end of the track data
+  const uint8_t *trackPayload(struct MD_MIDIFile *m, struct MD_MFTrack *t, const uint8_t **pp, uint32_t *len); ///< a SYSEX or META payload in one piece
+  const uint8_t *trackSkip(struct MD_MFTrack *t, const uint8_t *p, uint32_t len); ///< step over a SYSEX or META payload without reading it
+  void unloadImage(struct MD_MIDIFile *m);  ///< release the SMF image mapped by loadMIDIFile()
+  void *arenaAlloc(struct MD_MIDIFile *m, uint32_t size);  ///< cleared memory from the per-song arena
+  void freeArena(struct MD_MIDIFile *m);    ///< release the per-song arena and the tracks in it
+  int  allocTracks(struct MD_MIDIFile *m, uint16_t count); ///< size the tracks and the scheduler heap to the SMF
   void closeMIDIFile(struct MD_MIDIFile *m);
   void closeTrack(struct MD_MFTrack *t);
   
@@ -65,6 +65,86 @@ uint32_t readMultiByte(FILE *f, uint8_t nLen);
  */
 uint32_t readVarLen(FILE *f);
 
+/**
+ * Read a multi byte value from a memory buffer
+ *
+ * Same as readMultiByte() but working on the SMF image loaded in memory. The 
+ * buffer pointer is advanced past the bytes read.
+ *
+ * \param p    address of the pointer to the next byte to read.
+ * \param nLen one of MB_LONG, MB_TRYTE, MB_WORD, MB_BYTE to specify the number of bytes to read.
+ * \return the value read as a 4 byte integer. This should be cast to the expected size if required.
+ */
+uint32_t readMultiByteBuf(const uint8_t **p, uint8_t nLen);
+
+/**
+ * Read a variable length parameter from a memory buffer
+ *
+ * Same as readVarLen() but working on the SMF image loaded in memory. The 
+ * buffer pointer is advanced past the bytes read.
+ *
+ * \param p    address of the pointer to the next byte to read.
+ * \return the value read as a 4 byte integer. This should be cast to the expected size if required.
+ */
+uint32_t readVarLenBuf(const uint8_t **p);
+
+/**
+ * Read a multi byte value from a memory buffer, checking the bounds
+ *
+ * As readMultiByteBuf(), but nothing is read if the buffer ends before the value does.
+ *
+ * \param p     address of the pointer to the next byte to read, advanced past the value.
+ * \param end   first byte past the end of the buffer.
+ * \param nLen  one of MB_LONG, MB_TRYTE, MB_WORD, MB_BYTE to specify the number of bytes to read.
+ * \param value the value read.
+ * \return false if the value is truncated, true otherwise.
+ */
+BOOL decodeMultiByte(const uint8_t **p, const uint8_t *end, uint8_t nLen, uint32_t *value);
+
+/**
+ * Read a variable length parameter from a memory buffer, checking the bounds
+ *
+ * As readVarLenBuf(), but nothing is read if the buffer ends before the number does or 
+ * the number is longer than the 4 bytes a SMF allows. Single byte numbers are taken
+ * straight away and longer ones are decoded 4 bytes at a time (SWAR).
+ *
+ * \param p     address of the pointer to the next byte to read, advanced past the number.
+ * \param end   first byte past the end of the buffer.
+ * \param value the value read.
+ * \return false if the number is truncated or too long, true otherwise.
+ */
+BOOL decodeVarLen(const uint8_t **p, const uint8_t *end, uint32_t *value);
+
+/**
+ * Decode all the delta times of a track in one pass
+ *
+ * The events are skipped over with a table of MIDI message lengths and the lengths 
+ * held in SYSEX and META events, without decoding them. Decoding stops after the end 
+ * of track META event, at an event that is truncated or has an unknown status, or when 
+ * max events have been decoded.
+ *
+ * \param p      start of the track data.
+ * \param end    first byte past the end of the track data.
+ * \param tick   if not NULL, receives the absolute tick of each event.
+ * \param offset if not NULL, receives the offset of each event status byte from p.
+ * \param max    maximum number of events to decode.
+ * \return the number of events decoded.
+ */
+uint32_t decodeTrackTicks(const uint8_t *p, const uint8_t *end, uint32_t *tick, uint32_t *offset, uint32_t max);
+
+/**
+ * Time the decoders
+ *
+ * Prints the time per value taken by readVarLen() through a FILE, readVarLenBuf() 
+ * and decodeVarLen() on the same data, and the time per event to count the events 
+ * of the loaded SMF with decodeEvent() and with decodeTrackTicks().
+ *
+ * The MIDI_BENCHMARK macro define must be set to 1 to enable this function.
+ *
+ * \param m  MIDI file object with a SMF loaded, or NULL to skip the track timings.
+ */
+void benchmarkHelpers(struct MD_MIDIFile *m);
+
 /** 
  * Dump a block of data stream
  *
@@ -0,0 +1,238 @@
+/*
+  MD_MIDILibrary.h - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef _MDMIDILIBRARY_H
+#define _MDMIDILIBRARY_H
+
+#include "MD_MIDIFile.h"
+
+/**
+ * \file
+ * \brief Header file for the song library index
+ *
+ * The song library is an index of all the SMF in a song directory, with what is needed
+ * to choose a song - title, duration, tempo, track names, markers and the first program
+ * on each channel - without loading any of them. The songs are read by a pool of
+ * worker threads and the index is kept on disk, so that only new or changed files are
+ * read again the next time the directory is scanned.
+ */
+
+// ------------- Configuration Section - START
+
+/**
+ \def MIDI_LIB_THREADS
+ Number of worker threads reading songs when the library is scanned, one for each
+ core of the A20.
+ */
+#define MIDI_LIB_THREADS  2
+
+/**
+ \def MIDI_LIB_NAME
+ Longest file name kept in the library, including the terminating nul. Files with
+ longer names are left out.
+ */
+#define MIDI_LIB_NAME     64
+
+/**
+ \def MIDI_LIB_TEXT
+ Track names and markers are cut short to this many characters in the library.
+ */
+#define MIDI_LIB_TEXT     48
+
+/**
+ \def MIDI_LIB_MARKERS
+ Most markers kept for each song. Markers after this are left out.
+ */
+#define MIDI_LIB_MARKERS  64
+
+// ------------- Configuration Section - END
+
+/**
+ * Song library entry
+ *
+ * What the library knows about one SMF. The entries are saved in the index file as
+ * they are, so only add fields at the end and change LIBRARY_VERSION when this changes.
+ * The track names and markers are held in the text of the library, found through
+ * textOffset.
+ */
+struct MD_MLSong{
+	int64_t   mtimeSec;       ///< modification time of the SMF when it was read, seconds
+	int64_t   mtimeNsec;      ///< and nanoseconds
+	uint64_t  fileSize;       ///< size of the SMF when it was read
+	char      name[MIDI_LIB_NAME];  ///< file name in the song directory
+	int32_t   error;          ///< loadMIDIFile() error for the SMF, -1 if it can be played
+	uint8_t   format;         ///< file format - 0: single track, 1: multiple track
+	uint8_t   timeSigNum;     ///< time signature at the start - numerator
+	uint8_t   timeSigDen;     ///< and denominator
+	uint8_t   reserved;
+	uint16_t  trackCount;     ///< number of tracks
+	uint16_t  ticksPerQuarterNote; ///< time base of the file
+	uint16_t  tempo;          ///< tempo at the start in beats per minute
+	uint32_t  songTicks;      ///< length of the song in ticks
+	uint32_t  duration;       ///< length of the song in milliseconds
+	uint8_t   program[16];    ///< first program change on each channel, CHASE_UNSET if none
+	uint16_t  markerCount;    ///< number of markers kept
+	uint32_t  textOffset;     ///< track names then markers in the library text
+	uint32_t  textLen;        ///< bytes of text for this song
+};
+
+/**
+ * Song library
+ *
+ * All the songs in a directory in file name order, with their track names and markers
+ * in one block of text. Set up by scanLibrary().
+ */
+struct MD_MIDILibrary{
+	char      _dir[256];      ///< song directory
+	char      _index[256];    ///< index file, empty if the library is not kept on disk
+	struct MD_MLSong *_song;  ///< songs in file name order
+	uint32_t  _songCount;     ///< number of songs
+	char     *_text;          ///< track names and markers of all the songs
+	uint32_t  _textLen;       ///< size of the text
+	uint32_t  _scanned;       ///< songs read by the last scanLibrary(), the rest came from the index
+};
+
+  //--------------------------------------------------------------
+  /** \name Methods for the song library
+   * @{
+   */
+  /**
+   * Initialize the library object
+   *
+   * \param l pointer to the library object.
+   * \return No return data.
+   */
+  void initLibrary(struct MD_MIDILibrary *l);
+
+  /**
+   * Scan a song directory
+   *
+   * Every file in the directory ending in .mid (in any case) is put in the library.
+   * When there is an index file, songs whose size and modification time have not changed
+   * since it was written are taken from it, and only new or changed songs are read.
+   * These are shared out between MIDI_LIB_THREADS worker threads. The index file is
+   * then written again if anything changed.
+   *
+   * A song that cannot be loaded is kept in the library with its error, so that it is
+   * not read again until it changes.
+   *
+   * \param l     pointer to the library object.
+   * \param dir   the song directory.
+   * \param index the index file, or NULL if the library is not to be kept on disk.
+   * \return Error code with one of these values
+   * - -1 = no errors
+   * - 0 = Can't open the song directory
+   * - 1 = Not enough memory
+   * - 2 = Can't write the index file. The library is still usable.
+   */
+  int scanLibrary(struct MD_MIDILibrary *l, const char *dir, const char *index);
+
+  /**
+   * Release the library
+   *
+   * \param l pointer to the library object.
+   * \return No return data.
+   */
+  void closeLibrary(struct MD_MIDILibrary *l);
+
+  /**
+   * Get the number of songs in the library
+   *
+   * \param l pointer to the library object.
+   * \return the number of songs.
+   */
+  uint32_t getLibrarySize(struct MD_MIDILibrary *l);
+
+  /**
+   * Get a song from the library
+   *
+   * \param l pointer to the library object.
+   * \param n the song number [0..getLibrarySize()-1], in file name order.
+   * \return pointer to the song, or NULL if there is no song n.
+   */
+  const struct MD_MLSong *getLibrarySong(struct MD_MIDILibrary *l, uint32_t n);
+
+  /**
+   * Find a song in the library by file name
+   *
+   * \param l    pointer to the library object.
+   * \param name the file name, without the directory.
+   * \return the song number, or -1 if it is not in the library.
+   */
+  int32_t findLibrarySong(struct MD_MIDILibrary *l, const char *name);
+
+  /**
+   * Get the title of a song
+   *
+   * The name of the first track, which is the song name in a format 0 file and usually
+   * in a format 1 file too. The file name when the first track has no name.
+   *
+   * \param l pointer to the library object.
+   * \param n the song number.
+   * \return the title, or NULL if there is no song n.
+   */
+  const char *getSongTitle(struct MD_MIDILibrary *l, uint32_t n);
+
+  /**
+   * Get the name of a track of a song
+   *
+   * \param l     pointer to the library object.
+   * \param n     the song number.
+   * \param track the track number [0..trackCount-1].
+   * \return the track name, empty if the track has none, or NULL if there is no such track.
+   */
+  const char *getSongTrackName(struct MD_MIDILibrary *l, uint32_t n, uint16_t track);
+
+  /**
+   * Get a marker of a song
+   *
+   * The markers are in song order.
+   *
+   * \param l      pointer to the library object.
+   * \param n      the song number.
+   * \param marker the marker number [0..markerCount-1].
+   * \param tick   set to the tick of the marker, for seekTick().
+   * \return the marker text, or NULL if there is no such marker.
+   */
+  const char *getSongMarker(struct MD_MIDILibrary *l, uint32_t n, uint16_t marker, uint32_t *tick);
+
+  /**
+   * Write the songs of the library to a song pack
+   *
+   * All the songs in the library that can be played are put in one file, for 
+   * openSongPack(). The pack is written under a temporary name and renamed, so the 
+   * player never sees half a pack. Songs are found in the pack by their file name.
+   *
+   * With bCompile each song is also compiled as by LOAD_COMPILED and its compiled copy 
+   * is kept in the pack, so that loading it with LOAD_COMPILED needs no decoding. A 
+   * compiled pack only suits a player built with the same configuration.
+   *
+   * \param l        pointer to the library object, set up by scanLibrary().
+   * \param pack     the song pack file.
+   * \param bCompile true to keep a compiled copy of each song in the pack.
+   * \return Error code with one of these values
+   * - -1 = no errors
+   * - 0 = Can't write the song pack
+   * - 1 = Not enough memory
+   */
+  int writeSongPack(struct MD_MIDILibrary *l, const char *pack, BOOL bCompile);
+
+  /** @} */
+
+#endif /* _MDMIDILIBRARY_H */
@@ -0,0 +1,141 @@
+/*
+  MD_MIDIPreload.h - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef _MDMIDIPRELOAD_H
+#define _MDMIDIPRELOAD_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include "MD_MIDIFile.h"
+
+/**
+ * \file
+ * \brief Header file for the gapless song preloader
+ *
+ * The preloader plays one song while a background thread loads the next one into a
+ * second MD_MIDIFile object. When the playing song ends the two are swapped by
+ * exchanging a pointer, so the next song starts on the following call with no gap.
+ * The playing thread never waits for the loader: it takes the next song with an
+ * atomic exchange and hands the finished one back with a semaphore post, and the
+ * loader closes it.
+ */
+
+/**
+ * Gapless song preloader
+ *
+ * Two song objects take turns, one playing and one being loaded. Only the
+ * preloader functions should be used to load and close them.
+ */
+struct MD_MIDIPreload{
+	struct MD_MIDIFile _song[2];    ///< the two song objects
+	struct MD_MIDIFile *_current;   ///< song playing, only used by the playing thread
+	struct MD_MIDIFile *volatile _next;     ///< song loaded and ready to start, NULL if none - changed atomically
+	struct MD_MIDIFile *volatile _retired;  ///< song that has finished, for the loader to close - changed atomically
+	char      _request[MIDI_NAME_SIZE];     ///< song to load next, empty if none
+	int       _error;               ///< loadMIDIFile() error for the last song loaded
+	BOOL      _quit;                ///< the loader thread is to stop
+	pthread_mutex_t _lock;          ///< guards _request, _error and _quit
+	sem_t     _wake;                ///< posted when there is work for the loader
+	pthread_t _thread;              ///< loader thread
+};
+
+  //--------------------------------------------------------------
+  /** \name Methods for the song preloader
+   * @{
+   */
+  /**
+   * Start the preloader
+   *
+   * The settings of the template - callbacks, UART, load mode, event masks, chase mode,
+   * thinning, cache directory and song pack - are copied to both song objects and every song is
+   * loaded with them. A song pack opened on the template is shared and must stay open
+   * until closePreload().
+   *
+   * \param p    pointer to the preloader object.
+   * \param tmpl pointer to a MIDI file object set up with the settings to use.
+   * \return true if the loader thread was started.
+   */
+  BOOL initPreload(struct MD_MIDIPreload *p, const struct MD_MIDIFile *tmpl);
+
+  /**
+   * Stop the preloader
+   *
+   * Stops the loader thread and closes both songs.
+   *
+   * \param p pointer to the preloader object.
+   * \return No return data.
+   */
+  void closePreload(struct MD_MIDIPreload *p);
+
+  /**
+   * Queue the next song
+   *
+   * The song is loaded in the background and starts as soon as the playing song ends,
+   * or straight away if nothing is playing. Queueing another song before the swap
+   * replaces the one waiting. Not to be called from the playing thread, which must
+   * never wait.
+   *
+   * \param p    pointer to the preloader object.
+   * \param name the SMF name, as for setFilename().
+   * \return No return data.
+   */
+  void queueNextSong(struct MD_MIDIPreload *p, const char *name);
+
+  /**
+   * Play the songs
+   *
+   * Called from the playing thread in place of getNextEvent(). Plays the events that
+   * are due and starts the next song when the playing one ends. Never waits.
+   *
+   * \param p pointer to the preloader object.
+   * \return true if a song is playing.
+   */
+  BOOL playPreload(struct MD_MIDIPreload *p);
+
+  /**
+   * Get the song playing
+   *
+   * To be used from the playing thread only, and not to be loaded or closed.
+   *
+   * \param p pointer to the preloader object.
+   * \return pointer to the song playing, or NULL if there is none.
+   */
+  struct MD_MIDIFile *getPreloadSong(struct MD_MIDIPreload *p);
+
+  /**
+   * Check if the next song is ready
+   *
+   * \param p pointer to the preloader object.
+   * \return true if the next song has been loaded and is waiting to start.
+   */
+  BOOL isPreloadReady(struct MD_MIDIPreload *p);
+
+  /**
+   * Get the error for the last song loaded
+   *
+   * Not to be called from the playing thread.
+   *
+   * \param p pointer to the preloader object.
+   * \return the loadMIDIFile() error code, -1 if the song loaded.
+   */
+  int getPreloadError(struct MD_MIDIPreload *p);
+
+  /** @} */
+
+#endif /* _MDMIDIPRELOAD_H */
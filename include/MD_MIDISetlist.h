@@ -0,0 +1,199 @@
+/*
+  MD_MIDISetlist.h - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef _MDMIDISETLIST_H
+#define _MDMIDISETLIST_H
+
+#include <pthread.h>
+#include "MD_MIDIFile.h"
+
+/**
+ * \file
+ * \brief Header file for the setlist
+ *
+ * A setlist is the list of songs for a live set, any of which can be started at
+ * any time. The songs are kept loaded and compiled (LOAD_COMPILED) in a cache
+ * that holds as many as fit in a memory budget. When a song that is not in the
+ * cache is wanted, the songs used least recently are closed to make room for it.
+ * The cache can be filled in the background, in setlist order, when the setlist
+ * is set up.
+ */
+
+// ------------- Configuration Section - START
+
+/**
+ \def MIDI_SETLIST_SONGS
+ Most songs in a setlist.
+ */
+#define MIDI_SETLIST_SONGS  64
+
+// ------------- Configuration Section - END
+
+/**
+ * Setlist entry
+ */
+struct MD_MSEntry{
+	char      name[MIDI_NAME_SIZE]; ///< SMF name, as for setFilename()
+	struct MD_MIDIFile *song;     ///< the song loaded, NULL if it is not in the cache
+	uint32_t  bytes;              ///< memory held by the song
+	uint32_t  lastUse;            ///< when the song was last selected (or loaded), for the LRU order
+};
+
+/**
+ * Setlist cache statistics
+ *
+ * Returned by getSetlistStats().
+ */
+struct MD_MSStats{
+	uint32_t  hits;       ///< songs selected that were in the cache
+	uint32_t  misses;     ///< songs selected that had to be loaded
+	uint32_t  evictions;  ///< songs closed to keep within the budget
+	uint32_t  warmed;     ///< songs loaded by the background warm up
+	uint16_t  songs;      ///< songs in the cache
+	BOOL      warming;    ///< true while the background warm up is running
+	uint32_t  bytes;      ///< memory held by the songs in the cache
+	uint32_t  peakBytes;  ///< most memory held at any time
+	uint32_t  budget;     ///< memory budget
+};
+
+/**
+ * Setlist
+ *
+ * Set up by initSetlist() and addSetlistSong(). All the fields are guarded by _lock.
+ */
+struct MD_MIDISetlist{
+	struct MD_MIDIFile _settings;   ///< settings every song is loaded with
+	struct MD_MSEntry _entry[MIDI_SETLIST_SONGS];  ///< the songs in setlist order
+	uint16_t  _count;               ///< number of songs
+	int16_t   _current;             ///< song last selected, never closed to make room - -1 if none
+	uint32_t  _budget;              ///< memory budget in bytes
+	uint32_t  _useClock;            ///< running count for lastUse
+	struct MD_MSStats _stats;       ///< cache statistics
+	int       _error;               ///< loadMIDIFile() error for the last song that could not be loaded
+	BOOL      _quit;                ///< the warm up thread is to stop
+	BOOL      _threadStarted;       ///< there is a warm up thread to join
+	pthread_mutex_t _lock;          ///< guards everything
+	pthread_t _thread;              ///< warm up thread
+};
+
+  //--------------------------------------------------------------
+  /** \name Methods for the setlist
+   * @{
+   */
+  /**
+   * Set up an empty setlist
+   *
+   * The settings of the template - callbacks, UART, event masks, chase mode, thinning,
+   * cache directory and song pack - are used for every song, which is always loaded as
+   * LOAD_COMPILED. A song pack opened on the template is shared and must stay open
+   * until closeSetlist().
+   *
+   * \param s      pointer to the setlist object.
+   * \param tmpl   pointer to a MIDI file object set up with the settings to use.
+   * \param budget memory the cached songs may hold, in bytes.
+   * \return No return data.
+   */
+  void initSetlist(struct MD_MIDISetlist *s, const struct MD_MIDIFile *tmpl, uint32_t budget);
+
+  /**
+   * Add a song to the end of the setlist
+   *
+   * \param s    pointer to the setlist object.
+   * \param name the SMF name, as for setFilename().
+   * \return the song number in the setlist, or -1 if the setlist is full.
+   */
+  int16_t addSetlistSong(struct MD_MIDISetlist *s, const char *name);
+
+  /**
+   * Fill the cache in the background
+   *
+   * A thread loads the songs in setlist order until the cache is full. Songs that do
+   * not fit in what is left of the budget are passed over. Nothing is closed to make
+   * room. Songs should not be added while it runs.
+   *
+   * \param s pointer to the setlist object.
+   * \return true if the thread was started.
+   */
+  BOOL warmSetlist(struct MD_MIDISetlist *s);
+
+  /**
+   * Select a song to play
+   *
+   * The song is taken from the cache, or loaded if it is not there (which takes as long
+   * as loadMIDIFile()). It is put back at its start and stays loaded until another
+   * song is selected. The songs used least recently are then closed until the cache is
+   * within its budget. A song bigger than the budget is played anyway and clears the
+   * rest of the cache.
+   *
+   * Call this between songs, not from the playing loop.
+   *
+   * \param s pointer to the setlist object.
+   * \param n the song number in the setlist.
+   * \return pointer to the song, ready to play, or NULL if there is no song n or it
+   * cannot be loaded (see getSetlistError()). It must not be closed.
+   */
+  struct MD_MIDIFile *selectSetlistSong(struct MD_MIDISetlist *s, uint16_t n);
+
+  /**
+   * Release the setlist
+   *
+   * Stops the warm up thread and closes all the songs.
+   *
+   * \param s pointer to the setlist object.
+   * \return No return data.
+   */
+  void closeSetlist(struct MD_MIDISetlist *s);
+
+  /**
+   * Get the number of songs in the setlist
+   *
+   * \param s pointer to the setlist object.
+   * \return the number of songs.
+   */
+  uint16_t getSetlistSize(struct MD_MIDISetlist *s);
+
+  /**
+   * Check if a song is in the cache
+   *
+   * \param s pointer to the setlist object.
+   * \param n the song number in the setlist.
+   * \return true if the song is loaded.
+   */
+  BOOL isSetlistCached(struct MD_MIDISetlist *s, uint16_t n);
+
+  /**
+   * Get the cache statistics
+   *
+   * \param s  pointer to the setlist object.
+   * \param st set to the statistics.
+   * \return No return data.
+   */
+  void getSetlistStats(struct MD_MIDISetlist *s, struct MD_MSStats *st);
+
+  /**
+   * Get the error for the last song that could not be loaded
+   *
+   * \param s pointer to the setlist object.
+   * \return the loadMIDIFile() error code, -1 if there has been none.
+   */
+  int getSetlistError(struct MD_MIDISetlist *s);
+
+  /** @} */
+
+#endif /* _MDMIDISETLIST_H */
@@ -43,6 +43,17 @@ struct midi_time_event{
 	midi_event event;
 	unsigned long delta;
 };
+
+/* Output mixer: a master fader (a pot, 0-255) and a fader for each channel
+ * (0-127, 127 plays as sent), applied through tables rebuilt when a fader moves */
+struct mixer{
+	unsigned char master;
+	unsigned char level[16];
+	unsigned char velocity[16][128];	/* note on velocity */
+	unsigned char volume[16][128];		/* CC7 and CC11 value */
+};
+
+extern struct mixer fileMixer,playMixer;
 	
 unsigned char * getMidiEvent();
 struct midi_time_event * getMidiStruct(unsigned long dt);
@@ -52,6 +63,10 @@ void sendMidiBuffer(int fd,unsigned char *buf,unsigned char num);
 void sendProgramChange(int fd,unsigned char bank,unsigned char program);
 void midiFileVolume(unsigned char vol);
 void midiPlayVolume(unsigned char vol);
+void mixerInit(struct mixer *mx);
+void mixerMaster(struct mixer *mx,unsigned char vol);
+void mixerChannel(struct mixer *mx,unsigned char ch,unsigned char vol);
+void mixMessage(struct mixer *mx,unsigned char *data);
 void midiFun(int fd,midi_event *ev);
 void metaFun(const meta_event *ev);
 void sysexFun(sysex_event *ev);
@@ -0,0 +1,94 @@
+/*
+  MD_MIDIArena.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+
+/**
+ * \file
+ * \brief Main file for the per-song arena implementation
+ */
+
+#define ARENA_ALIGN(n)  (((n) + 7) & ~7)    // allocations start on 8 byte boundaries
+
+void *arenaAlloc(struct MD_MIDIFile *m, uint32_t size)
+// Hand out size bytes of cleared memory from the newest arena block, starting 
+// a new block when it is full. Nothing is given back until freeArena().
+{
+  struct MD_MFArena *a = m->_arena;
+  const uint32_t hdr = ARENA_ALIGN(sizeof(struct MD_MFArena));
+  uint8_t *p;
+
+  size = ARENA_ALIGN(size);
+  if (a == NULL || a->size - a->used < size)
+  {
+    uint32_t blockSize = MAX(size, MIDI_ARENA_BLOCK);
+
+    if ((a = malloc(hdr + blockSize)) == NULL)
+      return(NULL);
+    a->next = m->_arena;
+    a->size = blockSize;
+    a->used = 0;
+    m->_arena = a;
+  }
+
+  p = (uint8_t *)a + hdr + a->used;
+  a->used += size;
+  memset(p, 0, size);
+  return(p);
+}
+
+void freeArena(struct MD_MIDIFile *m)
+// Release everything allocated for the song in one go
+{
+  while (m->_arena != NULL)
+  {
+    struct MD_MFArena *a = m->_arena;
+
+    m->_arena = a->next;
+    free(a);
+  }
+  m->_track = NULL;
+  m->_heap = NULL;
+  m->_trackMute = m->_trackSolo = NULL;
+  m->_trackSolos = 0;
+  m->_sounding = NULL;
+  m->_trackCount = 0;
+}
+
+int allocTracks(struct MD_MIDIFile *m, uint16_t count)
+// Size the track data and the scheduler heap to the SMF
+{
+  uint16_t i;
+
+  m->_track = arenaAlloc(m, count * sizeof(struct MD_MFTrack));
+  m->_heap = arenaAlloc(m, count * sizeof(uint16_t));
+  if (m->_track == NULL || m->_heap == NULL || allocMute(m, count) != -1)
+    return(8);
+
+  for (i = 0; i < count; i++)
+    resetTrack(&m->_track[i]);
+  m->_trackCount = count;
+
+  return(-1);
+}
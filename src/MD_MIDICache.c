@@ -0,0 +1,365 @@
+/*
+  MD_MIDICache.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+
+/**
+ * \file
+ * \brief Main file for the compiled song cache implementation
+ */
+
+#define CACHE_MAGIC     "MDMC"
+#define CACHE_VERSION   4
+#define CACHE_ALIGN(n)  (((n) + 7) & ~7)    // blocks start on 8 byte boundaries
+
+// Cache file header. Everything after it is found through the offsets, which 
+// are from the start of the cache file.
+struct cacheHeader
+{
+  char      magic[4];
+  uint16_t  version;
+  uint16_t  trackPriority;    // changes the order of the timeline
+  uint32_t  chaseInterval;    // changes the chase state copies
+  uint32_t  chasePointSize;   // changes with the chase state layout
+  uint32_t  thinning;         // changes which controller messages were removed, 0 if none
+  // key - the cache is stale if the SMF has changed
+  uint64_t  fileSize;
+  int64_t   mtimeSec;
+  int64_t   mtimeNsec;
+  char      path[256];
+  // song
+  uint16_t  format;
+  uint16_t  trackCount;
+  uint16_t  ticksPerQuarterNote;
+  uint8_t   smpteFps;
+  uint8_t   smpteRes;
+  uint32_t  songTicks;
+  uint32_t  eventCount;
+  uint16_t  tempoCount;
+  uint16_t  timeSigCount;
+  uint32_t  chasePointCount;
+  uint32_t  thinBytes;
+  // blocks
+  uint32_t  imageOffset;      // SMF image, so payload offsets stay valid
+  uint32_t  imageLen;
+  uint32_t  tracksOffset;     // start offset and length of each track
+  uint32_t  eventsOffset;     // compiled timeline columns
+  uint32_t  tempoOffset;      // tempo map
+  uint32_t  timeSigOffset;    // time signature map
+  uint32_t  chaseOffset;      // chase state copies
+  uint32_t  totalLen;
+};
+
+static void cachePath(struct MD_MIDIFile *m, char *buf, size_t len)
+// The cache file for a SMF is named after a hash (FNV-1a) of its path
+{
+  uint32_t h = 2166136261UL;
+  const char *p;
+
+  for (p = m->_fileName; *p != '\0'; p++)
+    h = (h ^ (uint8_t)*p) * 16777619UL;
+
+  snprintf(buf, len, "%s/%08x.mdc", m->_cacheDir, h);
+}
+
+static void cacheConfig(struct MD_MIDIFile *m, struct cacheHeader *h)
+// Fill in the parts of the header that must match this build of the library
+// and the settings the song is loaded with
+{
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+  h->version = CACHE_VERSION;
+  h->trackPriority = TRACK_PRIORITY;
+  h->chaseInterval = MIDI_CHASE_INTERVAL;
+  h->chasePointSize = sizeof(struct MD_MFChasePoint);
+
+  // a hash (FNV-1a) of the thinning settings
+  if (m->_thinMode)
+  {
+    uint32_t hash = 2166136261UL ^ MIDI_THIN_INTERVAL;
+    uint16_t i;
+
+    for (i = 0; i < THIN_CONTROLS; i++)
+      hash = ((hash ^ m->_thinTol[i]) * 16777619UL);
+    h->thinning = hash | 1;   // never 0
+  }
+}
+
+static void cacheKey(struct MD_MIDIFile *m, struct cacheHeader *h, const struct stat *st)
+// Fill in the parts of the header that must match for the cache to be used
+{
+  cacheConfig(m, h);
+  h->fileSize = st->st_size;
+  h->mtimeSec = st->st_mtim.tv_sec;
+  h->mtimeNsec = st->st_mtim.tv_nsec;
+  memcpy(h->path, m->_fileName, strnlen(m->_fileName, sizeof(h->path) - 1));  // the header is zeroed, so it stays terminated
+}
+
+BOOL loadCache(struct MD_MIDIFile *m)
+// Set up the song straight from its cache file, if there is an up to date one.
+// The cache is mapped and used in place, nothing is parsed or copied.
+{
+  struct cacheHeader key;
+  struct stat st;
+  char path[sizeof(m->_cacheDir) + 16];
+  uint8_t *map;
+  int fd;
+
+  if (m->_cacheDir[0] == '\0' || stat(m->_fileName, &st) != 0)
+    return(FALSE);
+  cacheKey(m, &key, &st);
+
+  cachePath(m, path, sizeof(path));
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return(FALSE);
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(key))
+  {
+    close(fd);
+    return(FALSE);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return(FALSE);
+
+  // the SMF must not have changed since the cache was written
+  if (memcmp(map, &key, offsetof(struct cacheHeader, format)) != 0)
+  {
+    munmap(map, st.st_size);
+    return(FALSE);
+  }
+  madvise(map, st.st_size, MADV_WILLNEED);
+
+  return(useCache(m, map, st.st_size));
+}
+
+BOOL useCache(struct MD_MIDIFile *m, uint8_t *map, uint32_t len)
+// Set up the song from the compiled copy at map, either a mapped cache file or a 
+// song in the song pack. It is used in place and released by unloadCache().
+{
+  struct cacheHeader key;
+  const struct cacheHeader *h = (const struct cacheHeader *)map;
+  uint16_t i;
+
+  cacheConfig(m, &key);
+  if (len < sizeof(*h) || memcmp(h, &key, offsetof(struct cacheHeader, fileSize)) != 0 || h->totalLen != len)
+  {
+    if (!m->_fromPack)
+      munmap(map, len);
+    return(FALSE);
+  }
+
+  m->_cacheMap = map;
+  m->_cacheLen = len;
+
+  m->_data = map + h->imageOffset;
+  m->_dataLen = h->imageLen;
+  m->_dataMapped = FALSE;
+  m->_format = h->format;
+  if (allocTracks(m, h->trackCount) != -1)
+  {
+    freeArena(m);
+    unloadCache(m);
+    return(FALSE);
+  }
+  m->_ticksPerQuarterNote = h->ticksPerQuarterNote;
+  m->_smpteFps = h->smpteFps;
+  m->_smpteRes = h->smpteRes;
+  calcTickTime(m);
+  m->_songTicks = h->songTicks;
+
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    const uint32_t *trk = (const uint32_t *)(map + h->tracksOffset) + 2*i;
+    struct MD_MFTrack *t = &m->_track[i];
+
+    t->_trackId = t->_mev.track = i;
+    t->_startOffset = trk[0];
+    t->_length = trk[1];
+    t->_data = m->_data + t->_startOffset;
+    restartTrack(t);
+  }
+
+  setEventColumns(&m->_events, map + h->eventsOffset, h->eventCount);
+  m->_eventIdx = 0;
+  if (m->_format == 2)
+    findPatterns(m);
+  m->_tempoMap = (struct MD_MFTempo *)(map + h->tempoOffset);
+  m->_tempoCount = h->tempoCount;
+  m->_timeSigMap = (struct MD_MFTimeSig *)(map + h->timeSigOffset);
+  m->_timeSigCount = h->timeSigCount;
+  m->_chasePoints = (struct MD_MFChasePoint *)(map + h->chaseOffset);
+  m->_chasePointCount = h->chasePointCount;
+  m->_thinBytes = h->thinBytes;
+
+  return(TRUE);
+}
+
+void unloadCache(struct MD_MIDIFile *m)
+// Let go of a song set up by useCache(). The pointers into the cache are
+// cleared so the usual clean up does not try to free them. A compiled copy in
+// the song pack stays mapped with the pack.
+{
+  if (m->_cacheMap == NULL)
+    return;
+
+  memset(&m->_events, 0, sizeof(m->_events));
+  m->_tempoMap = NULL;
+  m->_timeSigMap = NULL;
+  m->_chasePoints = NULL;
+  m->_data = NULL;
+  m->_dataLen = 0;
+
+  if (!m->_fromPack)
+    munmap(m->_cacheMap, m->_cacheLen);
+  m->_cacheMap = NULL;
+  m->_cacheLen = 0;
+}
+
+static BOOL writeBlock(int fd, const void *buf, uint32_t len, uint32_t *offset)
+// Write a block at the next aligned offset and move the offset past it
+{
+  static const uint8_t pad[8] = { 0 };
+  const uint8_t *p = buf;
+  uint32_t fill = CACHE_ALIGN(*offset) - *offset;
+
+  if (fill != 0 && write(fd, pad, fill) != (ssize_t)fill)
+    return(FALSE);
+  *offset += fill;
+
+  while (len > 0)
+  {
+    ssize_t n = write(fd, p, len);
+
+    if (n <= 0)
+      return(FALSE);
+    p += n;
+    len -= n;
+    *offset += n;
+  }
+
+  return(TRUE);
+}
+
+BOOL writeCache(struct MD_MIDIFile *m, int fd, const struct stat *st, uint32_t *imageOffset)
+// Write the song just compiled as a cache file from the current position of fd. 
+// The offsets in it are from its own start, so it can be anywhere in a file 
+// as long as it starts on an 8 byte boundary. The offset of the SMF image in it
+// is saved in *imageOffset, unless that is NULL.
+{
+  struct cacheHeader h;
+  uint32_t offset = 0;
+  uint16_t i;
+  BOOL bOk;
+
+  cacheKey(m, &h, st);
+
+  h.format = m->_format;
+  h.trackCount = m->_trackCount;
+  h.ticksPerQuarterNote = m->_ticksPerQuarterNote;
+  h.smpteFps = m->_smpteFps;
+  h.smpteRes = m->_smpteRes;
+  h.songTicks = m->_songTicks;
+  h.eventCount = m->_events.count;
+  h.tempoCount = m->_tempoCount;
+  h.timeSigCount = m->_timeSigCount;
+  h.chasePointCount = m->_chasePointCount;
+  h.thinBytes = m->_thinBytes;
+
+  // work out where each block goes
+  offset = sizeof(h);
+  h.imageOffset = offset = CACHE_ALIGN(offset);
+  h.imageLen = m->_dataLen;
+  h.tracksOffset = offset = CACHE_ALIGN(offset + m->_dataLen);
+  h.eventsOffset = offset = CACHE_ALIGN(offset + 2*sizeof(uint32_t)*m->_trackCount);
+  h.tempoOffset = offset = CACHE_ALIGN(offset + eventsSize(m->_events.count));
+  h.timeSigOffset = offset = CACHE_ALIGN(offset + m->_tempoCount*sizeof(struct MD_MFTempo));
+  h.chaseOffset = offset = CACHE_ALIGN(offset + m->_timeSigCount*sizeof(struct MD_MFTimeSig));
+  h.totalLen = offset + m->_chasePointCount*sizeof(struct MD_MFChasePoint);
+  if (imageOffset != NULL)
+    *imageOffset = h.imageOffset;
+
+  offset = 0;
+  bOk = writeBlock(fd, &h, sizeof(h), &offset) &&
+        writeBlock(fd, m->_data, m->_dataLen, &offset);
+  for (i = 0; bOk && i < m->_trackCount; i++)
+  {
+    uint32_t trk[2];
+
+    trk[0] = m->_track[i]._startOffset;
+    trk[1] = m->_track[i]._length;
+    bOk = writeBlock(fd, trk, sizeof(trk), &offset);
+  }
+  bOk = bOk &&
+        writeBlock(fd, m->_events.tick, eventsSize(m->_events.count), &offset) &&
+        writeBlock(fd, m->_tempoMap, m->_tempoCount*sizeof(struct MD_MFTempo), &offset) &&
+        writeBlock(fd, m->_timeSigMap, m->_timeSigCount*sizeof(struct MD_MFTimeSig), &offset) &&
+        writeBlock(fd, m->_chasePoints, m->_chasePointCount*sizeof(struct MD_MFChasePoint), &offset);
+
+  return(bOk && offset == h.totalLen);
+}
+
+BOOL saveCache(struct MD_MIDIFile *m)
+// Write the song just compiled to its cache file. The file is written under a 
+// temporary name and renamed, so a reader never sees half a cache.
+{
+  struct stat st;
+  char path[sizeof(m->_cacheDir) + 16];
+  char tmp[sizeof(path) + 4];
+  BOOL bOk;
+  int fd;
+
+  if (m->_cacheDir[0] == '\0' || m->_loadMode != LOAD_COMPILED || stat(m->_fileName, &st) != 0)
+    return(FALSE);
+
+  cachePath(m, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return(FALSE);
+
+  bOk = writeCache(m, fd, &st, NULL);
+  close(fd);
+
+  if (!bOk || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+    return(FALSE);
+  }
+
+  return(TRUE);
+}
+
+void setCacheDir(struct MD_MIDIFile *m, const char *dir)
+{
+  if (dir == NULL)
+    dir = "";
+  strncpy(m->_cacheDir, dir, sizeof(m->_cacheDir) - 1);
+  m->_cacheDir[sizeof(m->_cacheDir) - 1] = '\0';
+}
@@ -0,0 +1,464 @@
+/*
+  MD_MIDIChase.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+
+/**
+ * \file
+ * \brief Main file for the controller chase implementation
+ */
+
+// Chase slots, in the order they are sent. Bank select has to go before the
+// program change for the Ketron to pick up the right sound.
+#define SLOT_PROGRAM  2     // program change
+#define SLOT_RPN      10    // RPN 0..2 data entry MSB, LSB
+#define SLOT_BEND     16    // pitch bend LSB, MSB
+#define CHASE_RPNS    3     // RPN 0 bend range, 1 fine tune, 2 coarse tune
+
+// controller for each CC slot, 0xff for the other slots
+static const uint8_t slotCC[CHASE_SLOTS] = 
+{ 
+  0, 32, 0xff, 1, 7, 10, 11, 64, 91, 93, 
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff 
+};
+
+// CC slot + 1 for each controller, 0 if the controller is not chased
+static const uint8_t ccSlot[128] = 
+{
+  [0] = 1, [32] = 2, [1] = 4, [7] = 5, [10] = 6, [11] = 7, [64] = 8, [91] = 9, [93] = 10
+};
+
+static void chaseEvent(struct MD_MFChase *c, uint8_t status, uint8_t d1, uint8_t d2)
+// Update the chase state with one MIDI message
+{
+  uint8_t ch = status & 0xf;
+  uint8_t *v = c->value[ch];
+
+  switch (status & 0xf0)
+  {
+  case 0xb0:
+    if (ccSlot[d1 & 0x7f] != 0)
+      v[ccSlot[d1 & 0x7f] - 1] = d2;
+    else if (d1 == 101 || d1 == 100)    // RPN select MSB, LSB
+      c->rpn[ch][101 - d1] = d2;
+    else if (d1 == 99 || d1 == 98)      // NRPN select, data entry no longer goes to an RPN
+      c->rpn[ch][0] = c->rpn[ch][1] = CHASE_UNSET;
+    else if ((d1 == 6 || d1 == 38) && c->rpn[ch][0] == 0 && c->rpn[ch][1] < CHASE_RPNS)
+      v[SLOT_RPN + 2*c->rpn[ch][1] + (d1 == 38)] = d2;
+    break;
+
+  case 0xc0:
+    v[SLOT_PROGRAM] = d1;
+    break;
+
+  case 0xe0:
+    v[SLOT_BEND] = d1;
+    v[SLOT_BEND + 1] = d2;
+    break;
+  }
+}
+
+int buildChasePoints(struct MD_MIDIFile *m)
+// Play the song through once without output, keeping a copy of the chase state
+// every MIDI_CHASE_INTERVAL events. Working out the state later then only needs
+// the events after the nearest copy.
+{
+  struct MD_MFChase state;
+  struct MD_MFChasePoint *cp;
+  uint32_t max, n;
+  uint16_t i;
+
+  if (m->_format == 2)    // not seekable, so never chased
+    return(-1);
+
+  memset(&state, CHASE_UNSET, sizeof(state));
+
+  if (m->_loadMode == LOAD_COMPILED)
+  {
+    struct MD_MFEvents *e = &m->_events;
+
+    max = e->count / MIDI_CHASE_INTERVAL;
+    if ((m->_chasePoints = malloc((max + 1) * sizeof(struct MD_MFChasePoint))) == NULL)
+      return(8);
+    cp = m->_chasePoints;
+
+    for (n = 0; n < e->count; n++)
+    {
+      if (n != 0 && n % MIDI_CHASE_INTERVAL == 0)
+      {
+        cp->tick = e->tick[n];
+        cp->eventIdx = n;
+        cp->state = state;
+        cp++;
+      }
+      if (e->status[n] >= 0xb0 && e->status[n] < 0xf0)
+        chaseEvent(&state, e->status[n], e->data1[n], e->data2[n]);
+    }
+  }
+  else
+  {
+    struct MD_MFChaseTrack *ct;
+    uint8_t  status, d1, d2;
+    uint32_t payload;
+    uint32_t last = 0;
+    uint32_t next = MIDI_CHASE_INTERVAL;
+
+    // the seek checkpoints give an upper bound for the number of events. The 
+    // track positions for each copy follow the copies in the same block.
+    max = 0;
+    for (i = 0; i < m->_trackCount; i++)
+      max += m->_track[i]._cpCount;
+    max = (max * MIDI_SEEK_INTERVAL) / MIDI_CHASE_INTERVAL;
+    if ((m->_chasePoints = malloc((max + 1) * (sizeof(struct MD_MFChasePoint) + 
+                                  m->_trackCount * sizeof(struct MD_MFChaseTrack)))) == NULL)
+      return(8);
+    cp = m->_chasePoints;
+    ct = m->_chaseTracks = (struct MD_MFChaseTrack *)(m->_chasePoints + max + 1);
+
+    // the tracks are driven through the scheduler heap, as compileTracks() does
+    for (i = 0; i < m->_trackCount; i++)
+      m->_track[i]._scanRs = 0;
+    rebuildHeap(m);
+    n = 0;
+    while (nextDueTrack(m, UINT32_MAX, &i))
+    {
+      struct MD_MFTrack *t = &m->_track[i];
+      uint32_t delta;
+      BOOL bMore;
+
+      // a copy is only taken between ticks, so it holds everything before its tick
+      if (n >= next && t->_nextTick > last && cp < m->_chasePoints + max)
+      {
+        uint16_t j;
+
+        cp->tick = t->_nextTick;
+        cp->eventIdx = n;
+        cp->state = state;
+        for (j = 0; j < m->_trackCount; j++, ct++)
+        {
+          struct MD_MFTrack *tj = &m->_track[j];
+
+          ct->offset = tj->_endOfTrack ? 0 : tj->_curr - m->_data;
+          ct->next = tj->_nextTick;
+          ct->rs = tj->_scanRs;
+        }
+        cp++;
+        next = n + MIDI_CHASE_INTERVAL;
+      }
+
+      if (!decodeEvent(m, &t->_curr, t->_data + t->_length, &t->_scanRs, &status, &d1, &d2, &payload))
+      {
+        t->_endOfTrack = TRUE;
+        trackAdvanced(m, FALSE);
+        continue;
+      }
+      n++;
+      last = t->_nextTick;
+      if (status >= 0xb0 && status < 0xf0)
+        chaseEvent(&state, status, d1, d2);
+
+      bMore = !IS_END_OF_TRACK(status, d1) && decodeVarLen(&t->_curr, t->_data + t->_length, &delta);
+      if (bMore)
+        t->_nextTick += delta;
+      else
+        t->_endOfTrack = TRUE;
+      trackAdvanced(m, bMore);
+    }
+
+    for (i = 0; i < m->_trackCount; i++)
+      restartTrack(&m->_track[i]);
+  }
+
+  m->_chasePointCount = cp - m->_chasePoints;
+  return(-1);
+}
+
+void freeChasePoints(struct MD_MIDIFile *m)
+// Release the chase state copies
+{
+  free(m->_chasePoints);   // the track positions are in the same block
+  m->_chasePoints = NULL;
+  m->_chaseTracks = NULL;
+  m->_chasePointCount = 0;
+}
+
+static struct MD_MFChasePoint *findChasePoint(struct MD_MIDIFile *m)
+// binary search for the last chase state copy that only holds events already 
+// played, NULL if there is none
+{
+  uint32_t lo = 0, hi = m->_chasePointCount;
+
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi) / 2;
+    BOOL bPlayed;
+
+    if (m->_loadMode == LOAD_COMPILED)
+      bPlayed = (m->_chasePoints[mid].eventIdx <= m->_eventIdx);
+    else
+      bPlayed = (m->_chasePoints[mid].tick <= m->_songTick);
+
+    if (bPlayed)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return(lo == 0 ? NULL : &m->_chasePoints[lo - 1]);
+}
+
+static BOOL chaseDelta(struct MD_MFTrack *t, const uint8_t **pp, uint32_t *tick)
+// Read the delta time of the next event of a track being chased. Returns false 
+// at the end of the track or if the event has not been played yet.
+{
+  uint32_t delta;
+
+  if (!decodeVarLen(pp, t->_data + t->_length, &delta))
+    return(FALSE);
+
+  *tick += delta;
+  return(t->_endOfTrack || *pp != t->_curr);
+}
+
+void chaseState(struct MD_MIDIFile *m)
+// Work out the state of every channel from all the events played so far,
+// starting from the nearest copy taken by buildChasePoints()
+{
+  struct MD_MFChase *c = &m->_chase;
+  struct MD_MFChasePoint *cp = findChasePoint(m);
+  uint8_t  status, d1, d2;
+  uint32_t payload;
+
+  if (cp != NULL)
+    *c = cp->state;
+  else
+    memset(c, CHASE_UNSET, sizeof(*c));
+
+  if (m->_loadMode == LOAD_COMPILED)
+  {
+    struct MD_MFEvents *e = &m->_events;
+    uint32_t n;
+
+    // the timeline is already in playing order
+    for (n = (cp != NULL ? cp->eventIdx : 0); n < m->_eventIdx; n++)
+      if (e->status[n] >= 0xb0 && e->status[n] < 0xf0)
+        chaseEvent(c, e->status[n], e->data1[n], e->data2[n]);
+  }
+  else
+  {
+    struct MD_MFChaseTrack *ct = (cp != NULL ? &m->_chaseTracks[(cp - m->_chasePoints) * m->_trackCount] : NULL);
+    struct MD_MFTrack *t;
+    uint16_t i, n;
+
+    // the tracks are merged in tick order up to the event each one is waiting to
+    // play, so RPN selection and data entry on a shared channel stay in sequence
+    for (i = 0; i < m->_trackCount; i++)
+    {
+      t = &m->_track[i];
+
+      if (ct == NULL)
+      {
+        t->_scan = t->_data;
+        t->_scanTick = 0;
+        t->_scanRs = 0;
+        t->_scanMore = chaseDelta(t, &t->_scan, &t->_scanTick);
+      }
+      else
+      {
+        t->_scan = m->_data + ct[i].offset;
+        t->_scanTick = ct[i].next;
+        t->_scanRs = ct[i].rs;
+        t->_scanMore = (ct[i].offset != 0 && (t->_endOfTrack || t->_scan != t->_curr));
+      }
+    }
+
+    for (;;)
+    {
+      n = m->_trackCount;
+      for (i = 0; i < m->_trackCount; i++)
+        if (m->_track[i]._scanMore && (n == m->_trackCount || m->_track[i]._scanTick < m->_track[n]._scanTick))
+          n = i;
+      if (n == m->_trackCount)
+        break;
+
+      t = &m->_track[n];
+      if (!decodeEvent(m, &t->_scan, t->_data + t->_length, &t->_scanRs, &status, &d1, &d2, &payload) || IS_END_OF_TRACK(status, d1))
+      {
+        t->_scanMore = FALSE;
+        continue;
+      }
+      if (status >= 0xb0 && status < 0xf0)
+        chaseEvent(c, status, d1, d2);
+      t->_scanMore = chaseDelta(t, &t->_scan, &t->_scanTick);
+    }
+  }
+}
+
+static void chaseMessage(struct MD_MIDIFile *m, uint8_t status, uint8_t d1, uint8_t d2, uint16_t *bytes, BOOL bSend)
+// Send one chase message through the MIDI callback, or only count its bytes
+{
+  midi_event mev;
+
+  if (m->_xform != NULL)    // played on another channel
+    status = (status & 0xf0) | m->_xform[status & 0xf];
+
+  mev.track = 0;
+  mev.channel = status & 0xf;
+  mev.data[0] = status & 0xf0;
+  mev.data[1] = d1;
+  mev.data[2] = d2;
+  mev.size = ((status & 0xe0) == 0xc0) ? 2 : 3;
+  *bytes += mev.size;
+
+#if !DUMP_DATA
+  if (bSend && m->_midiHandler != NULL)
+    (m->_midiHandler)(m->_uart, &mev);
+#endif
+}
+
+static uint16_t chaseChannel(struct MD_MIDIFile *m, uint8_t ch, struct MD_MFChase *sent, BOOL bSend)
+// The messages that bring a channel from the state sent to the chased state, and
+// the bytes they take. Only if bSend are they sent and the state sent updated.
+{
+  struct MD_MFChase *c = &m->_chase;
+  uint8_t *v = c->value[ch];
+  uint8_t *was = sent->value[ch];
+  uint16_t bytes = 0;
+  BOOL bRPN = FALSE;
+  BOOL bBank = FALSE;
+  uint8_t s;
+
+  for (s = 0; s < SLOT_RPN; s++)
+  {
+    // a new bank is only picked up with a program change
+    if (v[s] == CHASE_UNSET || (v[s] == was[s] && !(s == SLOT_PROGRAM && bBank)))
+      continue;
+    if (s == SLOT_PROGRAM)
+      chaseMessage(m, 0xc0 | ch, v[s], 0, &bytes, bSend);
+    else
+      chaseMessage(m, 0xb0 | ch, slotCC[s], v[s], &bytes, bSend);
+    bBank = bBank || s < SLOT_PROGRAM;
+  }
+
+  for (s = 0; s < CHASE_RPNS; s++)
+  {
+    uint8_t *rpn = &v[SLOT_RPN + 2*s];
+    uint8_t *wasRpn = &was[SLOT_RPN + 2*s];
+
+    if ((rpn[0] == CHASE_UNSET || rpn[0] == wasRpn[0]) && (rpn[1] == CHASE_UNSET || rpn[1] == wasRpn[1]))
+      continue;
+    chaseMessage(m, 0xb0 | ch, 101, 0, &bytes, bSend);
+    chaseMessage(m, 0xb0 | ch, 100, s, &bytes, bSend);
+    if (rpn[0] != CHASE_UNSET)
+      chaseMessage(m, 0xb0 | ch, 6, rpn[0], &bytes, bSend);
+    if (rpn[1] != CHASE_UNSET)
+      chaseMessage(m, 0xb0 | ch, 38, rpn[1], &bytes, bSend);
+    bRPN = TRUE;
+  }
+  // leave the RPN selected by the song, or none, so its next data entry goes 
+  // to the right place
+  if (bRPN || c->rpn[ch][0] != sent->rpn[ch][0] || c->rpn[ch][1] != sent->rpn[ch][1])
+  {
+    chaseMessage(m, 0xb0 | ch, 101, c->rpn[ch][0] == CHASE_UNSET ? 127 : c->rpn[ch][0], &bytes, bSend);
+    chaseMessage(m, 0xb0 | ch, 100, c->rpn[ch][1] == CHASE_UNSET ? 127 : c->rpn[ch][1], &bytes, bSend);
+  }
+
+  if (v[SLOT_BEND + 1] != CHASE_UNSET && (v[SLOT_BEND] != was[SLOT_BEND] || v[SLOT_BEND + 1] != was[SLOT_BEND + 1]))
+    chaseMessage(m, 0xe0 | ch, v[SLOT_BEND], v[SLOT_BEND + 1], &bytes, bSend);
+
+  if (bSend)
+  {
+    // a value the song has not set is left as the instrument has it
+    for (s = 0; s < CHASE_SLOTS; s++)
+      if (v[s] != CHASE_UNSET)
+        was[s] = v[s];
+    sent->rpn[ch][0] = c->rpn[ch][0];
+    sent->rpn[ch][1] = c->rpn[ch][1];
+  }
+  return(bytes);
+}
+
+uint16_t chaseUpdate(struct MD_MIDIFile *m, struct MD_MFChase *sent, uint16_t budget, uint8_t *first)
+// Send the messages needed to bring the channels from the state sent to the chased
+// state, a whole channel at a time starting with *first, while they fit in the budget.
+// The first channel with changes is always sent. *first is left at the channel the 
+// budget ran out on, so no channel waits behind one that keeps changing.
+{
+  uint16_t bytes = 0;
+  uint8_t n;
+
+  for (n = 0; n < 16; n++)
+  {
+    uint8_t ch = (*first + n) & 0xf;
+    uint16_t size = chaseChannel(m, ch, sent, FALSE);
+
+    if (size == 0)
+      continue;
+    if (bytes != 0 && bytes + size > budget)
+    {
+      *first = ch;
+      break;
+    }
+    bytes += chaseChannel(m, ch, sent, TRUE);
+  }
+
+  return(bytes);
+}
+
+uint16_t chaseSend(struct MD_MIDIFile *m)
+// Send the messages needed to put every channel into the chased state
+{
+  struct MD_MFChase none;
+  uint8_t first = 0;
+
+  memset(&none, CHASE_UNSET, sizeof(none));
+  return(chaseUpdate(m, &none, 0xffff, &first));
+}
+
+BOOL chaseCurrent(struct MD_MIDIFile *m)
+// chaseState(), with the SMF mapped again if playing from the track windows
+{
+  if (!STREAM_WINDOWED(m))
+  {
+    chaseState(m);
+    return(TRUE);
+  }
+
+  if (!mapStreamImage(m))
+    return(FALSE);
+  chaseState(m);
+  unmapStreamImage(m);
+  return(TRUE);
+}
+
+uint16_t chaseMIDIFile(struct MD_MIDIFile *m)
+{
+  if (!m->_fileOpen || m->_format == 2 || !chaseCurrent(m))
+    return(0);
+  return(chaseSend(m));
+}
+
+void setChase(struct MD_MIDIFile *m, BOOL bMode)
+{
+  m->_chaseMode = bMode;
+}
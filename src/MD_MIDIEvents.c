@@ -0,0 +1,280 @@
+/*
+  MD_MIDIEvents.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+
+/**
+ * \file
+ * \brief Main file for the compiled event timeline implementation
+ */
+
+BOOL decodeEvent(struct MD_MIDIFile *m, const uint8_t **pp, const uint8_t *end, uint8_t *rs, uint8_t *status, uint8_t *d1, uint8_t *d2, uint32_t *payload)
+// Decode the event at *pp without acting on it and move the pointer past it.
+// Returns false if the event cannot be decoded, has a data byte with the top bit 
+// set or runs past end. The load scan rejects any file where this happens.
+{
+  const uint8_t *p = *pp;
+  uint32_t len;
+  uint8_t s;
+
+  *d1 = *d2 = 0;
+  *payload = 0;
+
+  if (p >= end)
+    return(FALSE);
+  s = *p;
+
+  if (s < 0x80)     // running status, the byte is already data
+  {
+    if (*rs == 0)
+      return(FALSE);
+    s = *rs;
+  }
+  else
+    p++;
+  *status = s;
+
+  switch (s)
+  {
+  case 0x80 ... 0xbf:  // MIDI message with 2 parameters
+  case 0xe0 ... 0xef:
+    if (end - p < 2 || ((p[0] | p[1]) & 0x80))
+      return(FALSE);
+    *d1 = *p++;
+    *d2 = *p++;
+    *rs = s;
+    break;
+
+  case 0xc0 ... 0xdf:  // MIDI message with 1 parameter
+    if (end - p < 1 || (p[0] & 0x80))
+      return(FALSE);
+    *d1 = *p++;
+    *rs = s;
+    break;
+
+  case 0xf0:  // sysex_event = 0xF0/0xF7 + <len:v> + <data_bytes>
+  case 0xf7:
+    *payload = p - m->_data;
+    if (!decodeVarLen(&p, end, &len) || (uint32_t)(end - p) < len)
+      return(FALSE);
+    p += len;
+    break;
+
+  case 0xff:  // meta_event = 0xFF + <meta_type:1> + <length:v> + <event_data_bytes>
+    *payload = p - m->_data;
+    if (p >= end)
+      return(FALSE);
+    *d1 = *p++;
+    if (!decodeVarLen(&p, end, &len) || (uint32_t)(end - p) < len)
+      return(FALSE);
+    p += len;
+    break;
+
+  default:
+    return(FALSE);
+  }
+
+  *pp = p;
+  return(TRUE);
+}
+
+uint32_t eventsSize(uint32_t count)
+// Size of the block holding all the timeline columns for count events
+{
+  return(count * (2*sizeof(uint32_t) + sizeof(uint16_t) + 3*sizeof(uint8_t)));
+}
+
+void setEventColumns(struct MD_MFEvents *e, uint8_t *mem, uint32_t count)
+// All the columns live in one block, widest types first to keep alignment
+{
+  e->tick    = (uint32_t *)mem;
+  e->payload = e->tick + count;
+  e->track   = (uint16_t *)(e->payload + count);
+  e->status  = (uint8_t *)(e->track + count);
+  e->data1   = e->status + count;
+  e->data2   = e->data1 + count;
+  e->count   = count;
+}
+
+uint32_t countEvents(struct MD_MFTrack *t)
+// Count the events in a track, stopping where decodeEvent() would stop. Only the 
+// event lengths are needed, so the bulk delta time decoder does it in one pass.
+{
+  return(decodeTrackTicks(t->_data, t->_data + t->_length, NULL, NULL, UINT32_MAX));
+}
+
+int compileTracks(struct MD_MIDIFile *m)
+// Merge all the tracks into the compiled event timeline
+{
+  struct MD_MFEvents *e = &m->_events;
+  uint32_t count = 0;
+  uint16_t i;
+  uint8_t *mem;
+
+  // First pass - count the events so the columns can be sized exactly
+  for (i = 0; i < m->_trackCount; i++)
+    count += countEvents(&m->_track[i]);
+
+  if ((mem = malloc(eventsSize(count) + 1)) == NULL)
+    return(8);
+  setEventColumns(e, mem, count);
+  e->count = 0;
+
+  // Second pass - merge the tracks through the same scheduler heap used for
+  // LOAD_MAPPED playback, so both modes play events in the same order. The
+  // tracks of a format 2 file are patterns, compiled one after the other.
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    restartTrack(&m->_track[i]);
+    m->_track[i]._scanRs = 0;
+  }
+  m->_pattern = 0;
+  rebuildHeap(m);
+
+  while (e->count < count)
+  {
+    struct MD_MFTrack *t;
+    uint32_t n = e->count;
+    uint32_t delta;
+    BOOL bMore;
+
+    if (!nextDueTrack(m, UINT32_MAX, &i))
+    {
+      if (m->_format != 2 || ++m->_pattern >= m->_trackCount)
+        break;
+      rebuildHeap(m);     // the next pattern
+      continue;
+    }
+
+    t = &m->_track[i];
+    e->tick[n] = t->_nextTick;
+    if (!decodeEvent(m, &t->_curr, t->_data + t->_length, &t->_scanRs, &e->status[n], &e->data1[n], &e->data2[n], &e->payload[n]))
+    {
+      trackAdvanced(m, FALSE);
+      continue;
+    }
+    e->track[n] = i;
+    e->count++;
+
+    bMore = !IS_END_OF_TRACK(e->status[n], e->data1[n]) && 
+            decodeVarLen(&t->_curr, t->_data + t->_length, &delta);
+    if (bMore)
+      t->_nextTick += delta;
+    trackAdvanced(m, bMore);
+  }
+
+  // the tracks are only used for their state from now on
+  for (i = 0; i < m->_trackCount; i++)
+    restartTrack(&m->_track[i]);
+  m->_pattern = 0;
+
+  if (m->_thinMode)
+  {
+    int err;
+
+    if ((err = thinEvents(m)) != -1)
+      return(err);
+  }
+  if (m->_format == 2)
+    findPatterns(m);
+
+  m->_eventIdx = 0;
+  return(-1);
+}
+
+void freeEvents(struct MD_MIDIFile *m)
+// Release the compiled event timeline
+{
+  free(m->_events.tick);   // the start of the block holding all columns
+  memset(&m->_events, 0, sizeof(m->_events));
+  m->_eventIdx = 0;
+}
+
+void dispatchEvent(struct MD_MIDIFile *m, uint32_t i)
+// Hand one compiled event to the callbacks
+{
+  struct MD_MFEvents *e = &m->_events;
+  struct MD_MFTrack *t = &m->_track[e->track[i]];
+  uint8_t status = e->status[i];
+
+  switch (status)
+  {
+  case 0x80 ... 0xef:
+  {
+    midi_event mev;
+    uint8_t d1 = e->data1[i];
+
+    // transposed or played on another channel. A note off goes out as its note 
+    // on did, in case the transform changed while the note was sounding.
+    if (m->_xform != NULL)
+    {
+      uint16_t *sent = &m->_xformSent[(status & 0xf) << 7 | d1];
+
+      status = m->_xform[16 + i];
+      d1 = m->_xform[16 + e->count + i];
+      if ((status & 0xf0) == 0x90 && e->data2[i] != 0)
+        *sent = NOTE_SENT | (status & 0xf) << 8 | d1;
+      else if ((status & 0xe0) == 0x80 && (*sent & NOTE_SENT))
+      {
+        status = (status & 0xf0) | ((*sent >> 8) & 0xf);
+        d1 = *sent & 0x7f;
+        *sent = 0;
+      }
+    }
+
+    mev.track = e->track[i];
+    mev.channel = status & 0xf;
+    mev.data[0] = status & 0xf0;
+    mev.data[1] = d1;
+    mev.data[2] = e->data2[i];
+    mev.size = ((status & 0xe0) == 0xc0) ? 2 : 3;
+#if !DUMP_DATA
+    if (m->_midiHandler != NULL && (m->_eventMask & EVENT_MIDI) && !mutedEvent(m, &mev, e->status[i] & 0xf))
+      (m->_midiHandler)(m->_uart,&mev);
+#endif
+  }
+  break;
+
+  case 0xf0:
+  case 0xf7:
+    if (SYSEX_WANTED(m))
+      parseSysex(m, t, status, m->_data + e->payload[i]);
+    break;
+
+  case 0xff:    // the META type is already decoded, so skip the call if nothing is done
+    if (META_WANTED(m, e->data1[i]) || IS_PLAYER_META(e->data1[i]))
+      parseMeta(m, t, m->_data + e->payload[i]);
+    break;
+  }
+}
+
+void processCompiledEvents(struct MD_MIDIFile *m, uint16_t ticks)
+// Play everything that is due from the compiled timeline - a linear walk
+{
+  struct MD_MFEvents *e = &m->_events;
+
+  m->_songTick += ticks;
+  while (m->_eventIdx < e->count && e->tick[m->_eventIdx] <= m->_songTick)
+    dispatchEvent(m, m->_eventIdx++);
+}
@@ -22,7 +22,12 @@
 
 
 #include <string.h>
-#include <sys/time.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "MD_MIDIFile.h"
 #include "MD_MIDIHelper.h"
 /**
@@ -32,17 +37,83 @@
 
 void initialise(struct MD_MIDIFile *m,int fd)
 {
+  uint8_t i;
+
   m->_trackCount = 0;            // number of tracks in file
   m->_format = 0;
+  m->_errorOffset = 0;
+  m->_smpteFps = 0;
+  m->_smpteRes = 0;
   m->_tickTime = 0;
-  m->_lastTickError = 0;
+  m->_playMicros = 0;
+  m->_playRemainder = 0;
+  m->_tempoMap = NULL;
+  m->_tempoCount = 0;
+  m->_timeSigMap = NULL;
+  m->_timeSigCount = 0;
+  m->_posSig = 0;
+  m->_posBar = m->_posBarTick = m->_posTick = 0;
+  m->_posEnd = 0;
+  m->_posSeq = 0;
+  memset(&m->_position, 0, sizeof(m->_position));
+  m->_checkpoints = NULL;
+  m->_chaseMode = TRUE;
+  m->_chasePoints = NULL;
+  m->_chaseTracks = NULL;
+  m->_chasePointCount = 0;
+  m->_scanRate = 0;
+  m->_scanChannel = 0;
+  memset(&m->_scanSent, CHASE_UNSET, sizeof(m->_scanSent));
+  initThinning(m);
+  m->_transpose = 0;
+  for (i = 0; i < 16; i++)
+    m->_channelMap[i] = i;
+  m->_xformMem = NULL;
+  m->_xformSent = NULL;
+  m->_xform = m->_xformNext = m->_xformPosted = NULL;
+  m->_xformThreadStarted = FALSE;
+  m->_channelMute = m->_channelSolo = 0;
+  m->_trackMute = m->_trackSolo = NULL;
+  m->_trackSolos = 0;
+  m->_sounding = NULL;
+  m->_muteChanged = FALSE;
+  m->_cacheDir[0] = '\0';
+  m->_cacheMap = NULL;
+  m->_cacheLen = 0;
+  m->_packMap = NULL;
+  m->_packLen = 0;
+  m->_fromPack = FALSE;
+  m->_streamFd = -1;
+  m->_streamBuf = NULL;
+  m->_streamLong = NULL;
+  m->_streamLongSize = 0;
+  m->_songTicks = 0;
   m->_syncAtStart = FALSE;
   m->_paused = m->_looping = FALSE;
+  m->_data = NULL;
+  m->_dataLen = 0;
+  m->_dataMapped = FALSE;
+  m->_fileOpen = FALSE;
+  m->_loadMode = LOAD_MAPPED;
+  memset(&m->_events, 0, sizeof(m->_events));
+  m->_eventIdx = 0;
+  m->_songTick = 0;
+  m->_heap = NULL;
+  m->_heapCount = 0;
+  m->_heapSeq = 0;
+  m->_pattern = 0;
+  m->_nextPattern = NO_PATTERN;
+  m->_patternBase = 0;
+  m->_patternSwitch = 0;
+  m->_arena = NULL;
+  m->_track = NULL;
   
   setUartFd(m,fd);
   setMidiHandler(m,NULL);
   setSysexHandler(m,NULL);
   setMetaHandler(m,NULL);
+  setEventMask(m,EVENT_ALL);
+  setMetaMask(m,META_ALL,TRUE);
 
   // File handling
   setFilename(m,"");
@@ -55,6 +126,30 @@ void initialise(struct MD_MIDIFile *m,int fd)
   setTimeSignature(m,4, 4);     // 4/4 time
 }
 
+void copySettings(struct MD_MIDIFile *to, const struct MD_MIDIFile *from)
+// Give a song object the settings of another - callbacks, UART, load mode, event
+// masks, chase mode, thinning, transpose, channel map, channel mute and solo, cache
+// directory and song pack. The song pack is shared.
+{
+  to->_midiHandler = from->_midiHandler;
+  to->_sysexHandler = from->_sysexHandler;
+  to->_metaHandler = from->_metaHandler;
+  to->_eventMask = from->_eventMask;
+  memcpy(to->_metaMask, from->_metaMask, sizeof(to->_metaMask));
+  to->_uart = from->_uart;
+  to->_loadMode = from->_loadMode;
+  to->_chaseMode = from->_chaseMode;
+  to->_thinMode = from->_thinMode;
+  memcpy(to->_thinTol, from->_thinTol, sizeof(to->_thinTol));
+  to->_transpose = from->_transpose;
+  memcpy(to->_channelMap, from->_channelMap, sizeof(to->_channelMap));
+  to->_channelMute = from->_channelMute;
+  to->_channelSolo = from->_channelSolo;
+  memcpy(to->_cacheDir, from->_cacheDir, sizeof(to->_cacheDir));
+  to->_packMap = from->_packMap;
+  to->_packLen = from->_packLen;
+}
+
 void setMidiHandler(struct MD_MIDIFile *m,void (*mh)(int fd,midi_event *pev)) {
 	m->_midiHandler = mh; 
 }
@@ -69,13 +164,32 @@ void setMetaHandler(struct MD_MIDIFile *m,void (*mh)(const meta_event *mev)) {
 void setSysexHandler(struct MD_MIDIFile *m,void (*sh)(sysex_event *pev)) { 
 	m->_sysexHandler = sh; 
 }
+
+void setEventMask(struct MD_MIDIFile *m,uint8_t mask) {
+	m->_eventMask = mask;
+}
+
+void setMetaMask(struct MD_MIDIFile *m,uint16_t type,BOOL bWanted)
+// one bit per META type, checked by the parser before anything is decoded
+{
+  if (type == META_ALL)
+    memset(m->_metaMask, bWanted ? 0xff : 0, sizeof(m->_metaMask));
+  else if (type < META_ALL)
+  {
+    if (bWanted)
+      m->_metaMask[type >> 5] |= (1UL << (type & 31));
+    else
+      m->_metaMask[type >> 5] &= ~(1UL << (type & 31));
+  }
+}
+
+void setLoadMode(struct MD_MIDIFile *m,uint8_t mode) {
+	m->_loadMode = mode;
+}
 			
 void synchTracks(struct MD_MIDIFile *m)
+// Tracks run off the song tick, so only the tick clock needs to restart
 {
-	uint8_t i;
-	for (i=0; i<m->_trackCount; i++)
-    syncTime(&m->_track[i]);
-
   m->_lastTickCheckTime = getMicros();
 }
 
@@ -83,17 +197,31 @@ void synchTracks(struct MD_MIDIFile *m)
 void closeMIDIFile(struct MD_MIDIFile *m)
 // Close out - should be ready for the next file
 {
-	uint8_t i;
+	uint16_t i;
 	for (i = 0; i<m->_trackCount; i++)
   {
     closeTrack(&m->_track[i]);
   }
-  m->_trackCount = 0;
+  m->_heapCount = 0;
   m->_syncAtStart = FALSE;
   m->_paused = FALSE;
+  m->_scanRate = 0;     // the next song plays, it does not carry on the scan
+  m->_scanChannel = 0;
+  memset(&m->_scanSent, CHASE_UNSET, sizeof(m->_scanSent));
+  freeTransform(m);   // stops the thread working on the timeline
+  unloadCache(m);     // before the rest, the cache owns the blocks it set up
+  closeStream(m);
+  freeEvents(m);
+  freeChasePoints(m);
+  freeCheckpoints(m);
+  freeTempoMap(m);
+  freeArena(m);       // the tracks go with it
+  m->_songTick = 0;
+  m->_playMicros = 0;
 
   setFilename(m,"");
-  fclose(m->_fd);
+  unloadImage(m);
+  m->_fromPack = FALSE;
   m->_fileOpen = FALSE;
 }
 
@@ -149,13 +277,14 @@ void calcTickTime(struct MD_MIDIFile *m)
 
 BOOL isEOF(struct MD_MIDIFile *m)
 {
-  BOOL bEof = TRUE;
-  uint8_t i;
-  // check if each track has finished
-  for (i=0; i<m->_trackCount && bEof; i++)
-  {
-    bEof = (getEndOfTrack(&m->_track[i]) && bEof);  // breaks at first false
-  }
+  BOOL bEof;
+
+  if (m->_format == 2)
+    bEof = (patternEnded(m) && m->_nextPattern == NO_PATTERN);
+  else if (m->_loadMode == LOAD_COMPILED)
+    bEof = (m->_eventIdx >= m->_events.count);
+  else
+    bEof = (m->_heapCount == 0);    // finished tracks leave the scheduler
   
   if (bEof) DUMPS("\n! EOF");
 
@@ -172,10 +301,16 @@ BOOL isEOF(struct MD_MIDIFile *m)
 void pauseMIDIFile(struct MD_MIDIFile *m,BOOL bMode)
 // Start pause when true and restart when false
 {
+  BOOL bResume = m->_paused && !bMode;
+
   m->_paused = bMode;
 
   if (!m->_paused)           // restarting so ..
     m->_syncAtStart = FALSE; // .. force a time resynch when next processing events
+
+  // the instruments may have been changed while we were paused
+  if (bResume && m->_chaseMode)
+    chaseMIDIFile(m);
 }
 
 void restart(struct MD_MIDIFile *m)
@@ -184,35 +319,66 @@ void restart(struct MD_MIDIFile *m)
   // track 0 contains information that does not need to be reloaded every time, 
   // so if we are looping, ignore restarting that track. The file may have one 
   // track only and in this case always sync from track 0.
-	uint8_t i;
+	uint16_t i;
 	for (i=(m->_looping && m->_trackCount>1 ? 1 : 0); i<m->_trackCount; i++)
     restartTrack(&m->_track[i]);
 
+  // the compiled timeline is replayed in full as there is no cost in
+  // walking over the track 0 events again
+  m->_eventIdx = 0;
+  m->_songTick = 0;
+  m->_playMicros = 0;
+  rebuildHeap(m);
+  updatePosition(m);
+  if (m->_format == 2)       // the pattern playing starts again
+  {
+    m->_nextPattern = NO_PATTERN;
+    startPattern(m, m->_pattern, 0);
+  }
   m->_syncAtStart = FALSE;   // force a time resych
 }
 
 uint16_t tickClock(struct MD_MIDIFile *m)
 // check if enough time has passed for a MIDI tick and work out how many!
+// Song time is kept in microseconds and turned into ticks through the tempo
+// map, so there is no rounding error to carry and tempo changes land on the
+// exact tick they are set for.
 {
-  uint32_t  elapsedTime;
-  uint16_t  ticks = 0;
-  uint32_t uc = getMicros();   
-  elapsedTime = m->_lastTickError + uc - m->_lastTickCheckTime;
-   
-  if (elapsedTime >= m->_tickTime)
+  uint32_t  uc = getMicros();
+  uint32_t  elapsedTime = uc - m->_lastTickCheckTime;
+  uint32_t  target;
+
+  m->_lastTickCheckTime = uc;    // save for next round of checks
+
+  // the tempo adjustment speeds up or slows down the passing of song time, by
+  // (tempo + adjustment) / tempo. The fraction of a microsecond is carried over.
+  if (m->_tempoDelta == 0)
+    m->_playMicros += elapsedTime;
+  else
   {
-    ticks = elapsedTime/m->_tickTime;
-    m->_lastTickError = elapsedTime - (m->_tickTime * ticks);
-    m->_lastTickCheckTime = getMicros();    // save for next round of checks
+    int64_t rate = (60 * 1000000LL) + (int64_t)m->_tempoDelta * getTempoAt(m, m->_songTick);
+    uint64_t scaled;
+
+    if (rate < 0)
+      rate = 0;
+    scaled = (uint64_t)elapsedTime * rate + m->_playRemainder;
+    m->_playMicros += scaled / (60 * 1000000LL);
+    m->_playRemainder = scaled % (60 * 1000000LL);
   }
-	
-  return(ticks);
+
+  target = microsToTick(m, m->_playMicros);
+  if (target <= m->_songTick)
+    return(0);
+
+  return(MIN(target - m->_songTick, 0xffff));
 }
 
 BOOL getNextEvent(struct MD_MIDIFile *m)
 {
   uint16_t  ticks;
 
+  applyMute(m);   // even when paused, notes silenced are turned off at once
+
   // if we are paused we are paused!
   if (m->_paused) 
     return FALSE;
@@ -224,18 +390,115 @@ BOOL getNextEvent(struct MD_MIDIFile *m)
     m->_syncAtStart = TRUE;
   }
 
+  if (m->_scanRate != 0)    // fast forward or rewind, the seeks update the position
+    return(scanStep(m, getMicros()));
+
   // check if enough time has passed for a MIDI tick
   if ((ticks = tickClock(m)) == 0)
     return FALSE;
 
   processEvents(m,ticks);
+  updatePosition(m);
 
   return(TRUE);
 }
 
+static BOOL trackBefore(struct MD_MIDIFile *m, uint16_t a, uint16_t b)
+// Scheduler ordering - earliest tick first. Events due at the same tick are taken
+// track by track (TRACK_PRIORITY) or one from each track in turn (EVENT_PRIORITY).
+{
+  struct MD_MFTrack *ta = &m->_track[a];
+  struct MD_MFTrack *tb = &m->_track[b];
+
+  if (ta->_nextTick != tb->_nextTick)
+    return(ta->_nextTick < tb->_nextTick);
+#if TRACK_PRIORITY
+  return(a < b);
+#else
+  return((int32_t)(ta->_seq - tb->_seq) < 0);
+#endif
+}
+
+static void heapDown(struct MD_MIDIFile *m, uint32_t i)
+// Restore the heap order below position i
+{
+  uint16_t top = m->_heap[i];
+
+  for (;;)
+  {
+    uint32_t c = 2*i + 1;
+
+    if (c >= m->_heapCount)
+      break;
+    if (c+1 < m->_heapCount && trackBefore(m, m->_heap[c+1], m->_heap[c]))
+      c++;
+    if (!trackBefore(m, m->_heap[c], top))
+      break;
+    m->_heap[i] = m->_heap[c];
+    i = c;
+  }
+  m->_heap[i] = top;
+}
+
+void rebuildHeap(struct MD_MIDIFile *m)
+// Put every track that still has events into the scheduler heap. Only the 
+// pattern playing is scheduled in a format 2 file.
+{
+  uint16_t i;
+
+  m->_heapCount = 0;
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    if (getEndOfTrack(&m->_track[i]) || (m->_format == 2 && i != m->_pattern))
+      continue;
+    m->_track[i]._seq = m->_heapSeq++;
+    m->_heap[m->_heapCount++] = i;
+  }
+
+  for (i = m->_heapCount/2; i-- > 0; )
+    heapDown(m, i);
+}
+
+BOOL nextDueTrack(struct MD_MIDIFile *m, uint32_t tick, uint16_t *trk)
+// Get the track with the earliest event if it is due at or before tick
+{
+  if (m->_heapCount == 0 || m->_track[m->_heap[0]]._nextTick > tick)
+    return(FALSE);
+
+  *trk = m->_heap[0];
+  return(TRUE);
+}
+
+void trackAdvanced(struct MD_MIDIFile *m, BOOL bMore)
+// The track at the top of the heap has moved on to its next event (bMore)
+// or has no more events.
+{
+  if (bMore)
+    m->_track[m->_heap[0]]._seq = m->_heapSeq++;
+  else
+    m->_heap[0] = m->_heap[--m->_heapCount];
+
+  if (m->_heapCount > 0)
+    heapDown(m, 0);
+}
+
 void processEvents(struct MD_MIDIFile *m,uint16_t ticks)
 {
-  uint8_t n;
+  uint16_t i;
+
+  if (m->_loadMode == LOAD_COMPILED)
+    swapTransform(m);   // a transform changed in the background starts here
+
+  if (m->_format == 2)
+  {
+    processPatternEvents(m, ticks);
+    return;
+  }
+  if (m->_loadMode == LOAD_COMPILED)
+  {
+    processCompiledEvents(m, ticks);
+    return;
+  }
 
   if (m->_format != 0) 
   {
@@ -243,114 +506,142 @@ void processEvents(struct MD_MIDIFile *m,uint16_t ticks)
     DUMPS("] TRK "); 
   }
 
-#if TRACK_PRIORITY
-  // process all events from each track first - TRACK PRIORITY
-  for (uint8_t i = 0; i < m->_trackCount; i++)
+  // Tracks are kept in a min-heap on the tick of their next event, so only
+  // the tracks with something due are ever looked at.
+  m->_songTick += ticks;
+  while (nextDueTrack(m, m->_songTick, &i))
   {
     if (m->_format != 0) DUMPX("", i);
-    // Limit n to be a sensible number of events in the loop counter
-    // When there are no more events, just break out
-    // Other than the first event, the other have an elapsed time of 0 (ie occur simultaneously)
-    for (n=0; n < 100; n++)
-    {
-      if (!getNextTrackEvent(m,&m->_track[i], (n==0 ? ticks : 0)))
-        break;
-    }
+    trackAdvanced(m, getNextTrackEvent(m, &m->_track[i]));
+  }
+}
 
-    if ((n > 0) && (m->_format != 0))
-      DUMPS("\n-- TRK "); 
+int loadImage(struct MD_MIDIFile *m)
+// Bring the whole SMF into memory in one go. The file is mapped when possible
+// and read into the heap otherwise; either way playback makes no further I/O calls.
+{
+  struct stat st;
+  int fd;
+  void *p;
+
+  if ((fd = open(m->_fileName, O_RDONLY)) < 0)
+    return(FALSE);
+
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    close(fd);
+    return(FALSE);
   }
-#else // EVENT_PRIORITY
-  // process one event from each track round-robin style - EVENT PRIORITY
-  BOOL doneEvents;
+  m->_dataLen = st.st_size;
 
-  // Limit n to be a sensible number of events in the loop counter
-  for (n = 0; (n < 100) && (!doneEvents); n++)
+  p = mmap(NULL, m->_dataLen, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p != MAP_FAILED)
+  {
+    madvise(p, m->_dataLen, MADV_WILLNEED);
+    m->_dataMapped = TRUE;
+  }
+  else
   {
-    doneEvents = FALSE;
-    uint8_t i;
-    for (i = 0; i < m->_trackCount; i++) // cycle through all
+    uint32_t done = 0;
+    ssize_t  n;
+
+    if ((p = malloc(m->_dataLen)) == NULL)
     {
-      BOOL b;
+      close(fd);
+      return(FALSE);
+    }
+    while (done < m->_dataLen && (n = read(fd, (uint8_t *)p + done, m->_dataLen - done)) > 0)
+      done += n;
+    if (done != m->_dataLen)
+    {
+      free(p);
+      close(fd);
+      return(FALSE);
+    }
+    m->_dataMapped = FALSE;
+  }
+  close(fd);    // a mapping stays valid after the descriptor is closed
 
-      if (m->_format != 0) DUMPX("", i);
+  m->_data = p;
+  return(TRUE);
+}
 
-      // Other than the first event, the other have an elapsed time of 0 (ie occur simultaneously)
-      b = getNextTrackEvent(m,&m->_track[i], (n==0 ? ticks : 0));
-      if (b && (m->_format != 0))
-        DUMPS("\n-- TRK "); 
-      doneEvents = (doneEvents || b);
-    }
+void unloadImage(struct MD_MIDIFile *m)
+// Release the SMF image obtained by loadImage(). An image in the song pack
+// belongs to the pack.
+{
+  if (m->_data != NULL && !m->_fromPack)
+  {
+    if (m->_dataMapped)
+      munmap((void *)m->_data, m->_dataLen);
+    else
+      free((void *)m->_data);
+  }
+  m->_data = NULL;
+  m->_dataLen = 0;
+  m->_dataMapped = FALSE;
+}
 
-    // When there are no more events, just break out
-    if (!doneEvents)
-      break;
-  } 
-#endif // EVENT/TRACK_PRIORITY
+static int readyToPlay(struct MD_MIDIFile *m)
+// Put a newly loaded song at its start, transposed and remapped as set
+{
+  m->_songTick = 0;
+  m->_playMicros = 0;
+  m->_playRemainder = 0;
+  m->_pattern = 0;
+  m->_nextPattern = NO_PATTERN;
+  m->_patternBase = 0;
+  rebuildHeap(m);
+
+  resetPosition(m);
+
+  m->_fileOpen = TRUE;
+  if (m->_loadMode == LOAD_COMPILED && initTransform(m) != -1)
+  {
+    closeMIDIFile(m);
+    return(8);
+  }
+  return(-1);
 }
 
-int loadMIDIFile(struct MD_MIDIFile *m) 
-// Load the MIDI file into memory ready for processing
+int parseImage(struct MD_MIDIFile *m)
+// Read the header, the tracks and the tempo map from the SMF image. On an error 
+// everything but the image is released again.
 {
+  const uint8_t *p = m->_data;
   uint32_t dat32;
+  uint32_t offset;
   uint16_t dat16;
-  uint8_t i;
-  char    h[MTHD_HDR_SIZE+1]; // Header characters + nul
-  
-  if (m->_fileName[0] == '\0')  
-    return(0);
-
-  // open the file for reading:
-  if((m->_fd = fopen(m->_fileName,"r")) == NULL)
-    return(2);
+  uint16_t tracks;
+  uint16_t i;
+  int err;
 
   // Read the MIDI header
   // header chunk = "MThd" + <header_length:4> + <format:2> + <num_tracks:2> + <time_division:2>
-    
-  	  fread(&dat32,MTHD_HDR_SIZE,1,m->_fd);
-    //f_read(&m->_fd,h,MTHD_HDR_SIZE,(UINT *)&dat32);
-	
-    h[MTHD_HDR_SIZE] = '\0';
-
-    if (strcmp(h, MTHD_HDR) != 0)
-    {
-      fclose(m->_fd);
-      return(3);
-    }  
+  if (m->_dataLen < MTHD_HDR_SIZE + MB_LONG || memcmp(p, MTHD_HDR, MTHD_HDR_SIZE) != 0)
+    return(3);
+  p += MTHD_HDR_SIZE;
 
   // read header size
-  dat32 = readMultiByte(m->_fd, MB_LONG);
-  if (dat32 != 6)   // must be 6 for this header
-  {
-	fclose(m->_fd);
+  dat32 = readMultiByteBuf(&p, MB_LONG);
+  if (dat32 != 6 || m->_dataLen < MTHD_HDR_SIZE + MB_LONG + 6)   // must be 6 for this header
     return(4);
-  }
   
   // read file type
-  dat16 = readMultiByte(m->_fd, MB_WORD);
-  if ((dat16 != 0) && (dat16 != 1))
-  {
-    fclose(m->_fd);
+  dat16 = readMultiByteBuf(&p, MB_WORD);
+  if (dat16 > 2)
     return(5);
-  }
   m->_format = dat16;
  
    // read number of tracks
-  dat16 = readMultiByte(m->_fd, MB_WORD);
+  dat16 = readMultiByteBuf(&p, MB_WORD);
   if ((m->_format == 0) && (dat16 != 1)) 
-  {
-    fclose(m->_fd);
     return(6);
-  }
-  if (dat16 > MIDI_MAX_TRACKS)
-  {
-    fclose(m->_fd);
-    return(7);
-  }
-  m->_trackCount = dat16;
+  tracks = dat16;   // allocated once the rest of the header is known to be good
 
    // read ticks per quarter note
-  dat16 = readMultiByte(m->_fd, MB_WORD);
+  dat16 = readMultiByteBuf(&p, MB_WORD);
+  m->_smpteFps = m->_smpteRes = 0;
   if (dat16 & 0x8000) // top bit set is SMTE format
   {
     int framespersecond = (dat16 >> 8) & 0x00ff;
@@ -362,28 +653,136 @@ int loadMIDIFile(struct MD_MIDIFile *m)
       case 231:  framespersecond = 25; break;
       case 227:  framespersecond = 29; break;
       case 226:  framespersecond = 30; break;
-      default:   fclose(m->_fd); return(7);
+      default:   return(7);
     }
-    dat16 = framespersecond * resolution;
+    if (resolution == 0)
+      return(7);
+
+    // ticks are a fixed time, the tempo map is not used to time them. For bars 
+    // and beats a second (nominal, 30 frames at 29.97) stands in for a quarter note.
+    m->_smpteFps = framespersecond;
+    m->_smpteRes = resolution;
+    dat16 = (framespersecond == 29 ? 30 : framespersecond) * resolution;
   } 
+  else if (dat16 == 0)  // no ticks per quarter note
+    return(7);
   m->_ticksPerQuarterNote = dat16;
   calcTickTime(m);  // we may have changed from default, so recalculate
 
+  // track data sized to the file, from the song arena
+  if (allocTracks(m, tracks) != -1)
+  {
+    freeArena(m);
+    return(8);
+  }
+
   // load all tracks
+  offset = p - m->_data;
   for (i = 0; i<m->_trackCount; i++)
   {
-    int err;
-
-    if ((err = loadTrack(&m->_track[i],i,m )) != -1)
+    if ((err = loadTrack(&m->_track[i],i,m,offset)) != -1)
     {
-      fclose(m->_fd);
+      freeArena(m);
       return((10*(i+1))+err);
     }
-   }
+    offset = m->_track[i]._startOffset + m->_track[i]._length;
+  }
+
+  // tempo map for converting between ticks and time
+  if ((err = buildTempoMap(m)) != -1)
+  {
+    freeArena(m);
+    return(err);
+  }
 
   return(-1);
 }
 
+int loadMIDIFile(struct MD_MIDIFile *m) 
+// Load the MIDI file into memory ready for processing
+{
+  if (m->_fileName[0] == '\0')  
+    return(0);
+  m->_errorOffset = 0;
+  m->_fromPack = FALSE;
+  m->_thinBytes = 0;
+
+  // a song in the song pack is used where it is, with no file system calls,
+  // and is ready to play if it was compiled into the pack
+  if (m->_packMap != NULL && packSong(m))
+  {
+    if (m->_cacheMap != NULL)
+    {
+      return(readyToPlay(m));
+    }
+  }
+  else
+  {
+    // a compiled song may be waiting in the cache
+    if (m->_loadMode == LOAD_COMPILED && loadCache(m))
+    {
+      return(readyToPlay(m));
+    }
+
+    // map the whole file into memory
+    if (!loadImage(m))
+      return(2);
+  }
+
+  {
+    int err;
+
+    if ((err = parseImage(m)) != -1)
+    {
+      unloadImage(m);
+      return(err);
+    }
+  }
+
+  // optionally decode everything now so playback is just a walk along the timeline,
+  // otherwise record where to start decoding each track from after a seek
+  {
+    int err;
+
+    if (m->_loadMode == LOAD_COMPILED)
+      err = compileTracks(m);
+    else
+      err = buildCheckpoints(m);
+    if (err == -1)
+      err = buildChasePoints(m);
+    if (err != -1)
+    {
+      freeEvents(m);
+      freeCheckpoints(m);
+      freeTempoMap(m);
+      freeArena(m);
+      unloadImage(m);
+      return(err);
+    }
+  }
+  if (m->_loadMode == LOAD_COMPILED && !m->_fromPack)
+    saveCache(m);   // no harm done if it cannot be written
+
+  // streaming plays from the track windows, the image is not kept. The song
+  // pack is mapped anyway, so its songs play from there.
+  if (m->_loadMode == LOAD_STREAMED && !m->_fromPack)
+  {
+    int err;
+
+    if ((err = openStream(m)) != -1)
+    {
+      freeChasePoints(m);
+      freeCheckpoints(m);
+      freeTempoMap(m);
+      freeArena(m);
+      unloadImage(m);
+      return(err);
+    }
+  }
+
+  return(readyToPlay(m));
+}
+
 
 const char * getFilename(struct MD_MIDIFile *m) 
 { 
@@ -392,15 +791,19 @@ const char * getFilename(struct MD_MIDIFile *m)
 
 void setFilename(struct MD_MIDIFile *m,const char* aname) 
 { 
-	if (aname != NULL) strcpy(m->_fileName, aname); 
+	if (aname != NULL)
+	{
+		strncpy(m->_fileName, aname, sizeof(m->_fileName) - 1);
+		m->_fileName[sizeof(m->_fileName) - 1] = '\0';
+	}
 }	
 
 inline uint32_t getMicros(){
-	struct timeval tv;
-	struct timezone tz;
-	gettimeofday(&tv, &tz);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	return tv.tv_usec;
+	// wraps every 71 minutes, differences are still right in unsigned arithmetic
+	return (uint32_t)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
 }
 
 inline uint32_t getTickTime(struct MD_MIDIFile *m) { return (m->_tickTime); }
@@ -409,7 +812,8 @@ inline int16_t getTempoAdjust(struct MD_MIDIFile *m) { return(m->_tempoDelta); }
 inline uint16_t getTicksPerQuarterNote(struct MD_MIDIFile *m) { return(m->_ticksPerQuarterNote); }
 inline uint16_t getTimeSignature(struct MD_MIDIFile *m) { return((m->_timeSignature[0]<<8) + m->_timeSignature[1]); };
 inline uint8_t getFormat(struct MD_MIDIFile *m) { return(m->_format); }
-inline uint8_t getTrackCount(struct MD_MIDIFile *m) { return (m->_trackCount); };
+uint32_t getErrorOffset(struct MD_MIDIFile *m) { return(m->_errorOffset); }
+inline uint16_t getTrackCount(struct MD_MIDIFile *m) { return (m->_trackCount); };
 inline void looping(struct MD_MIDIFile *m, BOOL bMode) { m->_looping = bMode; };
 
 
@@ -426,7 +830,7 @@ void dumpFile(struct MD_MIDIFile *m)
   DUMP("/", getTimeSignature(m) & 0xf);
   DUMPS("\n");
  
-  for (uint8_t i=0; i<m->_trackCount; i++)
+  for (uint16_t i=0; i<m->_trackCount; i++)
   {
     //dumpTrack(m->_track[i])
     DUMPS("\n");
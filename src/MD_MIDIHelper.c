@@ -20,6 +20,8 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
 #include "MD_MIDIFile.h"
 #include "MD_MIDIHelper.h"
 
@@ -59,6 +61,266 @@ uint32_t readVarLen(FILE *f)
   return(value);
 }
 
+uint32_t readMultiByteBuf(const uint8_t **p, uint8_t nLen)
+// read fixed length parameter from a memory buffer
+{
+  const uint8_t *q = *p;
+  uint32_t  value = 0L;
+  uint8_t i;
+
+  for (i=0; i<nLen; i++)
+    value = (value << 8) + *q++;
+
+  *p = q;
+  return(value);
+}
+
+uint32_t readVarLenBuf(const uint8_t **p)
+// read variable length parameter from a memory buffer
+{
+  const uint8_t *q = *p;
+  uint32_t  value = 0;
+  uint8_t   c;
+
+  do
+  {
+    c = *q++;
+    value = (value << 7) + (c & 0x7f);
+  }  while (c & 0x80);
+
+  *p = q;
+  return(value);
+}
+
+BOOL decodeMultiByte(const uint8_t **p, const uint8_t *end, uint8_t nLen, uint32_t *value)
+// read fixed length parameter from a memory buffer, checking it is all there
+{
+  if (end - *p < nLen)
+    return(FALSE);
+
+  *value = readMultiByteBuf(p, nLen);
+  return(TRUE);
+}
+
+BOOL decodeVarLen(const uint8_t **p, const uint8_t *end, uint32_t *value)
+// read variable length parameter from a memory buffer, checking it is all there
+// and no longer than the 4 bytes allowed in a SMF
+{
+  const uint8_t *q = *p;
+
+  if (q >= end)
+    return(FALSE);
+
+  // most delta times are a single byte
+  if (*q < 0x80)
+  {
+    *value = *q;
+    *p = q + 1;
+    return(TRUE);
+  }
+
+  if (end - q >= 4)
+  {
+    // SWAR - the first byte without the continuation bit ends the number, and
+    // the 7 bit groups are packed together with shifts
+    uint32_t w = ((uint32_t)q[0] << 24) | ((uint32_t)q[1] << 16) | ((uint32_t)q[2] << 8) | q[3];
+    uint32_t stop = ~w & 0x80808080UL;
+    uint8_t  n;
+
+    if (stop == 0)
+      return(FALSE);
+    n = __builtin_clz(stop) / 8 + 1;
+    w >>= 32 - 8*n;
+    *value = (w & 0x7f) | ((w >> 1) & 0x3f80) | ((w >> 2) & 0x1fc000) | ((w >> 3) & 0xfe00000);
+    *p = q + n;
+    return(TRUE);
+  }
+  else
+  {
+    // near the end of the buffer, byte by byte
+    uint32_t v = 0;
+    uint8_t  c;
+
+    do
+    {
+      if (q >= end)
+        return(FALSE);
+      c = *q++;
+      v = (v << 7) + (c & 0x7f);
+    } while (c & 0x80);
+
+    *value = v;
+    *p = q;
+    return(TRUE);
+  }
+}
+
+// Data bytes after the status byte of a MIDI message, by the top nibble of the status
+static const uint8_t msgLen[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 2, 0 };
+
+uint32_t decodeTrackTicks(const uint8_t *p, const uint8_t *end, uint32_t *tick, uint32_t *offset, uint32_t max)
+// Decode the delta times of a whole track in one pass, skipping over the events
+// with a table of message lengths. Stops at the end of track META, at the first 
+// event that is truncated or cannot be decoded, or after max events.
+{
+  const uint8_t *start = p;
+  uint32_t now = 0;
+  uint32_t count = 0;
+  uint8_t  rs = 0;
+
+  while (p < end && count < max)
+  {
+    const uint8_t *q = p;
+    uint32_t delta, len;
+    uint8_t  s;
+
+    if (!decodeVarLen(&q, end, &delta) || q >= end)
+      break;
+
+    s = *q;
+    if (s < 0x80)           // running status
+    {
+      if (rs == 0)
+        break;
+      len = msgLen[rs >> 4];
+    }
+    else if (s < 0xf0)      // MIDI message
+    {
+      rs = s;
+      len = msgLen[s >> 4] + 1;
+    }
+    else if (s == 0xf0 || s == 0xf7 || s == 0xff)
+    {
+      const uint8_t *r = q + 1 + (s == 0xff);   // META has its type before the length
+
+      if (r > end || !decodeVarLen(&r, end, &len))
+        break;
+      len += r - q;
+    }
+    else
+      break;
+
+    if ((uint32_t)(end - q) < len)
+      break;
+
+    now += delta;
+    if (tick != NULL)
+      tick[count] = now;
+    if (offset != NULL)
+      offset[count] = q - start;
+    count++;
+
+    if (s == 0xff && q[1] == 0x2f)    // end of track
+      break;
+    p = q + len;
+  }
+
+  return(count);
+}
+
+#if MIDI_BENCHMARK
+#define BENCH_RUNS  5   // best of, to keep other processes out of the timings
+
+// Time code BENCH_RUNS times and keep the best time in seconds
+#define BENCH(best, code)                     \
+  for (r = 0, best = 1e9; r < BENCH_RUNS; r++) \
+  {                                           \
+    double t0 = benchNow();                   \
+    code;                                     \
+    t0 = benchNow() - t0;                     \
+    if (t0 < best) best = t0;                 \
+  }
+
+static double benchNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static uint32_t benchEvents(struct MD_MIDIFile *m)
+// count the events of all tracks one decodeEvent() at a time, as the load scans did
+{
+  uint32_t events = 0;
+  uint16_t t;
+
+  for (t = 0; t < m->_trackCount; t++)
+  {
+    const uint8_t *p = m->_track[t]._data;
+    const uint8_t *end = p + m->_track[t]._length;
+    uint8_t  rs = 0, status, d1, d2;
+    uint32_t payload, delta;
+
+    while (decodeVarLen(&p, end, &delta) && decodeEvent(m, &p, end, &rs, &status, &d1, &d2, &payload))
+    {
+      events++;
+      if (IS_END_OF_TRACK(status, d1))
+        break;
+    }
+  }
+
+  return(events);
+}
+
+void benchmarkHelpers(struct MD_MIDIFile *m)
+// Time the FILE based helpers against the buffer decoders on the same data,
+// and the bulk track decoder against event by event decoding of the loaded SMF
+{
+  const uint32_t N = 1000000;
+  uint8_t *buf = malloc(4 * N);
+  uint32_t len = 0, sum, i, v;
+  const uint8_t *p;
+  double best;
+  uint8_t r;
+  FILE *f;
+
+  if (buf == NULL)
+    return;
+
+  // delta times as found in real files - mostly 1 byte, some 2, a few 3
+  srand(1);
+  for (i = 0; i < N; i++)
+  {
+    uint32_t x = rand() % 100;
+
+    v = (x < 70) ? rand() % 0x80 : (x < 95) ? rand() % 0x4000 : rand() % 0x200000;
+    if (v >= 0x4000)  buf[len++] = 0x80 | (v >> 14);
+    if (v >= 0x80)    buf[len++] = 0x80 | ((v >> 7) & 0x7f);
+    buf[len++] = v & 0x7f;
+  }
+
+  if ((f = tmpfile()) != NULL)
+  {
+    fwrite(buf, 1, len, f);
+    BENCH(best, rewind(f); for (i = 0, sum = 0; i < N; i++) sum += readVarLen(f));
+    printf("readVarLen(FILE)    %6.2f ns/value (sum %u)\n", best * 1e9 / N, sum);
+    fclose(f);
+  }
+
+  BENCH(best, for (i = 0, sum = 0, p = buf; i < N; i++) sum += readVarLenBuf(&p));
+  printf("readVarLenBuf       %6.2f ns/value (sum %u)\n", best * 1e9 / N, sum);
+
+  BENCH(best, for (i = 0, sum = 0, p = buf; i < N && decodeVarLen(&p, buf + len, &v); i++) sum += v);
+  printf("decodeVarLen        %6.2f ns/value (sum %u)\n", best * 1e9 / N, sum);
+
+  // whole tracks of the loaded SMF
+  if (m != NULL && m->_fileOpen && m->_data != NULL)
+  {
+    uint16_t t;
+
+    BENCH(best, sum = benchEvents(m));
+    printf("decodeEvent         %6.2f ns/event (%u events)\n", best * 1e9 / sum, sum);
+
+    BENCH(best, for (t = 0, sum = 0; t < m->_trackCount; t++)
+                  sum += decodeTrackTicks(m->_track[t]._data, m->_track[t]._data + m->_track[t]._length, NULL, NULL, UINT32_MAX));
+    printf("decodeTrackTicks    %6.2f ns/event (%u events)\n", best * 1e9 / sum, sum);
+  }
+
+  free(buf);
+}
+#endif // MIDI_BENCHMARK
+
 #if DUMP_DATA
 void dumpBuffer(uint8_t *p, int len)
 // Formatted dump of a buffer of data
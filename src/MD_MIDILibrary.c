@@ -0,0 +1,618 @@
+/*
+  MD_MIDILibrary.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+#include "MD_MIDILibrary.h"
+
+/**
+ * \file
+ * \brief Main file for the song library index implementation
+ */
+
+#define LIBRARY_MAGIC     "MDML"
+#define LIBRARY_VERSION   1
+
+// Index file header. The songs follow it in file name order, then the text.
+struct libraryHeader
+{
+  char      magic[4];
+  uint16_t  version;
+  uint16_t  songSize;       // changes with the song entry layout
+  uint32_t  songCount;
+  uint32_t  textLen;
+};
+
+// A song found in the directory, with its text while the library is put together
+struct libraryJob
+{
+  struct MD_MLSong song;
+  const char *text;         // from the old index or owned
+  BOOL      bOwned;         // text was read now and must be freed
+};
+
+// A marker found while reading a song, before they are put in song order
+struct libraryMarker
+{
+  uint32_t  tick;
+  uint32_t  seq;            // keeps markers at the same tick in file order
+  char      text[MIDI_LIB_TEXT];
+};
+
+// Work shared by the worker threads
+struct libraryScan
+{
+  struct MD_MIDILibrary *l;
+  struct libraryJob *job;
+  uint32_t  *todo;          // jobs to read
+  uint32_t  todoCount;
+  uint32_t  next;           // next entry of todo to take, only changed atomically
+};
+
+// Growing block of text for one song
+struct libraryText
+{
+  char     *buf;
+  uint32_t  len;
+  uint32_t  size;
+};
+
+static BOOL textAdd(struct libraryText *t, const void *data, uint32_t len)
+// Append to the text, growing it as needed
+{
+  if (t->len + len > t->size)
+  {
+    uint32_t size = MAX(t->size * 2, t->len + len + 256);
+    char *buf = realloc(t->buf, size);
+
+    if (buf == NULL)
+      return(FALSE);
+    t->buf = buf;
+    t->size = size;
+  }
+  memcpy(t->buf + t->len, data, len);
+  t->len += len;
+  return(TRUE);
+}
+
+static void metaText(struct MD_MIDIFile *m, const uint8_t *end, uint32_t payload, char *buf)
+// Copy the text of the META event at payload, cut short to MIDI_LIB_TEXT
+{
+  const uint8_t *q = m->_data + payload + 1;   // past the type
+  uint32_t len;
+
+  decodeVarLen(&q, end, &len);    // already checked by decodeEvent()
+  len = MIN(len, MIDI_LIB_TEXT - 1);
+  memcpy(buf, q, len);
+  buf[len] = '\0';
+}
+
+static int markerCmp(const void *a, const void *b)
+// song order for the markers
+{
+  const struct libraryMarker *x = a, *y = b;
+
+  if (x->tick != y->tick)
+    return(x->tick < y->tick ? -1 : 1);
+  return(x->seq < y->seq ? -1 : 1);
+}
+
+static BOOL songText(struct MD_MIDIFile *m, struct libraryJob *job)
+// Walk all the tracks of a song loaded by parseImage() for the track names, the
+// markers and the first program change on each channel
+{
+  struct MD_MLSong *s = &job->song;
+  struct libraryText text = { NULL, 0, 0 };
+  struct libraryMarker *mk = NULL;
+  uint32_t mkCount = 0, mkSize = 0;
+  uint32_t progTick[16];
+  uint16_t i;
+
+  memset(s->program, CHASE_UNSET, sizeof(s->program));
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    struct MD_MFTrack *t = &m->_track[i];
+    const uint8_t *p = t->_data;
+    const uint8_t *end = t->_data + t->_length;
+    char name[MIDI_LIB_TEXT] = "";
+    uint32_t tick = 0, delta, payload;
+    uint8_t rs = 0, status, d1, d2;
+
+    while (p < end)
+    {
+      if (!decodeVarLen(&p, end, &delta) || !decodeEvent(m, &p, end, &rs, &status, &d1, &d2, &payload))
+        break;
+      tick += delta;
+
+      if ((status & 0xf0) == 0xc0)
+      {
+        uint8_t ch = status & 0xf;
+
+        // the earliest program wins, the lower track at the same tick
+        if (s->program[ch] == CHASE_UNSET || tick < progTick[ch])
+        {
+          s->program[ch] = d1;
+          progTick[ch] = tick;
+        }
+      }
+      else if (status == 0xff && d1 == 0x03 && name[0] == '\0')
+        metaText(m, end, payload, name);
+      else if (status == 0xff && d1 == 0x06)
+      {
+        if (mkCount == mkSize)
+        {
+          struct libraryMarker *x = realloc(mk, (mkSize + 16) * sizeof(*mk));
+
+          if (x == NULL)
+          {
+            free(mk);
+            free(text.buf);
+            return(FALSE);
+          }
+          mk = x;
+          mkSize += 16;
+        }
+        mk[mkCount].tick = tick;
+        mk[mkCount].seq = mkCount;
+        metaText(m, end, payload, mk[mkCount].text);
+        mkCount++;
+      }
+      else if (IS_END_OF_TRACK(status, d1))
+        break;
+    }
+
+    if (!textAdd(&text, name, strlen(name) + 1))
+    {
+      free(mk);
+      free(text.buf);
+      return(FALSE);
+    }
+  }
+
+  // markers can be on any track, keep the first ones in song order
+  qsort(mk, mkCount, sizeof(*mk), markerCmp);
+  s->markerCount = MIN(mkCount, MIDI_LIB_MARKERS);
+  for (i = 0; i < s->markerCount; i++)
+  {
+    if (!textAdd(&text, &mk[i].tick, sizeof(mk[i].tick)) ||
+        !textAdd(&text, mk[i].text, strlen(mk[i].text) + 1))
+    {
+      free(mk);
+      free(text.buf);
+      return(FALSE);
+    }
+  }
+  free(mk);
+
+  job->text = text.buf;
+  job->bOwned = TRUE;
+  s->textLen = text.len;
+  return(TRUE);
+}
+
+static void readSong(struct MD_MIDILibrary *l, struct MD_MIDIFile *m, struct libraryJob *job)
+// Load the header, tracks and tempo map of one song and fill in its library entry.
+// Nothing is set up for playing it.
+{
+  struct MD_MLSong *s = &job->song;
+  char path[sizeof(l->_dir) + MIDI_LIB_NAME + 1];
+  struct stat st;
+  void *map;
+  int fd;
+
+  initialise(m, -1);
+  s->error = 2;
+  s->markerCount = 0;
+  s->textLen = 0;
+  memset(s->program, CHASE_UNSET, sizeof(s->program));
+
+  if (snprintf(path, sizeof(path), "%s/%s", l->_dir, s->name) >= (int)sizeof(path) ||
+      (fd = open(path, O_RDONLY)) < 0)
+    return;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    close(fd);
+    return;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+
+  // the image is handed over, so unloadImage() unmaps it
+  m->_data = map;
+  m->_dataLen = st.st_size;
+  m->_dataMapped = TRUE;
+
+  if ((s->error = parseImage(m)) == -1)
+  {
+    uint16_t sig = getTimeSignatureAt(m, 0);
+    uint32_t us = getTempoAt(m, 0);
+
+    s->format = m->_format;
+    s->trackCount = m->_trackCount;
+    s->ticksPerQuarterNote = m->_ticksPerQuarterNote;
+    s->tempo = (us == 0 ? 0 : (60000000UL + us / 2) / us);
+    s->timeSigNum = sig >> 8;
+    s->timeSigDen = sig & 0xff;
+    s->songTicks = getSongTicks(m);
+    s->duration = getSongDuration(m);
+    if (!songText(m, job))
+      s->error = 8;
+
+    freeTempoMap(m);
+    freeArena(m);
+  }
+  unloadImage(m);
+}
+
+static void *libraryWorker(void *arg)
+// Worker thread - read songs until there are none left
+{
+  struct libraryScan *scan = arg;
+  struct MD_MIDIFile *m = malloc(sizeof(struct MD_MIDIFile));
+  uint32_t n;
+
+  if (m == NULL)
+    return(NULL);   // the others, or the scanning thread, do the work
+
+  while ((n = __sync_fetch_and_add(&scan->next, 1)) < scan->todoCount)
+    readSong(scan->l, m, &scan->job[scan->todo[n]]);
+
+  free(m);
+  return(NULL);
+}
+
+static int jobCmp(const void *a, const void *b)
+// file name order
+{
+  return(strcmp(((const struct libraryJob *)a)->song.name, ((const struct libraryJob *)b)->song.name));
+}
+
+static BOOL isSong(const char *name)
+// SMF are the files ending in .mid
+{
+  size_t len = strlen(name);
+
+  return(len > 4 && len < MIDI_LIB_NAME && strcasecmp(name + len - 4, ".mid") == 0);
+}
+
+static uint8_t *readIndex(struct MD_MIDILibrary *l, const struct libraryHeader **h)
+// Read the whole index file. Returns NULL if there is none or it cannot be used.
+{
+  struct stat st;
+  uint8_t *buf;
+  ssize_t n = -1;
+  int fd;
+
+  if (l->_index[0] == '\0' || (fd = open(l->_index, O_RDONLY)) < 0)
+    return(NULL);
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(**h) && (buf = malloc(st.st_size)) != NULL)
+  {
+    n = read(fd, buf, st.st_size);
+    if (n != st.st_size)
+    {
+      free(buf);
+      n = -1;
+    }
+  }
+  close(fd);
+  if (n < 0)
+    return(NULL);
+
+  *h = (const struct libraryHeader *)buf;
+  if (memcmp((*h)->magic, LIBRARY_MAGIC, sizeof((*h)->magic)) != 0 ||
+      (*h)->version != LIBRARY_VERSION || (*h)->songSize != sizeof(struct MD_MLSong) ||
+      (uint64_t)sizeof(**h) + (uint64_t)(*h)->songCount * sizeof(struct MD_MLSong) + (*h)->textLen != (uint64_t)n)
+  {
+    free(buf);
+    return(NULL);
+  }
+  return(buf);
+}
+
+static BOOL writeIndex(struct MD_MIDILibrary *l)
+// Save the library to the index file. It is written to a new file that then
+// replaces the old one, so a power cut never leaves half an index.
+{
+  struct libraryHeader h;
+  char tmp[sizeof(l->_index) + 4];
+  BOOL bOk;
+  FILE *f;
+
+  snprintf(tmp, sizeof(tmp), "%s.new", l->_index);
+  if ((f = fopen(tmp, "wb")) == NULL)
+    return(FALSE);
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, LIBRARY_MAGIC, sizeof(h.magic));
+  h.version = LIBRARY_VERSION;
+  h.songSize = sizeof(struct MD_MLSong);
+  h.songCount = l->_songCount;
+  h.textLen = l->_textLen;
+
+  bOk = fwrite(&h, sizeof(h), 1, f) == 1 &&
+        fwrite(l->_song, sizeof(struct MD_MLSong), l->_songCount, f) == l->_songCount &&
+        fwrite(l->_text, 1, l->_textLen, f) == l->_textLen;
+  bOk = (fclose(f) == 0) && bOk;
+  if (bOk && rename(tmp, l->_index) == 0)
+    return(TRUE);
+
+  unlink(tmp);
+  return(FALSE);
+}
+
+void initLibrary(struct MD_MIDILibrary *l)
+{
+  l->_dir[0] = '\0';
+  l->_index[0] = '\0';
+  l->_song = NULL;
+  l->_songCount = 0;
+  l->_text = NULL;
+  l->_textLen = 0;
+  l->_scanned = 0;
+}
+
+void closeLibrary(struct MD_MIDILibrary *l)
+{
+  free(l->_song);
+  free(l->_text);
+  initLibrary(l);
+}
+
+int scanLibrary(struct MD_MIDILibrary *l, const char *dir, const char *index)
+{
+  const struct libraryHeader *oh = NULL;
+  const struct MD_MLSong *old = NULL;
+  const char *oldText = NULL;
+  uint8_t *oldBuf;
+  struct libraryJob *job = NULL;
+  struct libraryScan scan;
+  uint32_t count = 0, size = 0, textLen = 0, i;
+  pthread_t worker[MIDI_LIB_THREADS];
+  uint8_t workers = 0;
+  struct dirent *de;
+  DIR *d;
+  int err = -1;
+
+  closeLibrary(l);
+  snprintf(l->_dir, sizeof(l->_dir), "%s", dir);
+  snprintf(l->_index, sizeof(l->_index), "%s", index != NULL ? index : "");
+
+  if ((d = opendir(l->_dir)) == NULL)
+    return(0);
+
+  // the songs in the directory, in file name order
+  while ((de = readdir(d)) != NULL)
+  {
+    char path[sizeof(l->_dir) + MIDI_LIB_NAME + 1];
+    struct stat st;
+
+    // a name too long for the song list is skipped before it is used
+    if (!isSong(de->d_name) ||
+        snprintf(path, sizeof(path), "%s/%s", l->_dir, de->d_name) >= (int)sizeof(path))
+      continue;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    if (count == size)
+    {
+      struct libraryJob *x = realloc(job, (size + 64) * sizeof(*job));
+
+      if (x == NULL)
+      {
+        closedir(d);
+        free(job);
+        return(1);
+      }
+      job = x;
+      size += 64;
+    }
+    memset(&job[count], 0, sizeof(job[count]));
+    strcpy(job[count].song.name, de->d_name);
+    job[count].song.mtimeSec = st.st_mtim.tv_sec;
+    job[count].song.mtimeNsec = st.st_mtim.tv_nsec;
+    job[count].song.fileSize = st.st_size;
+    count++;
+  }
+  closedir(d);
+  qsort(job, count, sizeof(*job), jobCmp);
+
+  // take what has not changed from the index, both are in file name order
+  if ((oldBuf = readIndex(l, &oh)) != NULL)
+  {
+    old = (const struct MD_MLSong *)(oh + 1);
+    oldText = (const char *)(old + oh->songCount);
+  }
+  scan.l = l;
+  scan.job = job;
+  scan.todo = malloc(MAX(count, 1) * sizeof(uint32_t));
+  scan.todoCount = 0;
+  scan.next = 0;
+  if (scan.todo == NULL)
+  {
+    free(oldBuf);
+    free(job);
+    return(1);
+  }
+  {
+    uint32_t j = 0;
+
+    for (i = 0; i < count; i++)
+    {
+      struct MD_MLSong *s = &job[i].song;
+      int c = 1;
+
+      while (oldBuf != NULL && j < oh->songCount && (c = strcmp(old[j].name, s->name)) < 0)
+        j++;
+      if (oldBuf != NULL && j < oh->songCount && c == 0 &&
+          old[j].mtimeSec == s->mtimeSec && old[j].mtimeNsec == s->mtimeNsec &&
+          old[j].fileSize == s->fileSize &&
+          (uint64_t)old[j].textOffset + old[j].textLen <= oh->textLen)
+      {
+        *s = old[j];
+        job[i].text = oldText + old[j].textOffset;
+      }
+      else
+        scan.todo[scan.todoCount++] = i;
+    }
+  }
+
+  // read the new and changed songs on all the cores, this thread waits
+  for (workers = 0; workers < MIN(MIDI_LIB_THREADS, scan.todoCount); workers++)
+  {
+    if (pthread_create(&worker[workers], NULL, libraryWorker, &scan) != 0)
+      break;
+  }
+  if (workers == 0)
+    libraryWorker(&scan);   // no threads, read them here
+  for (i = 0; i < workers; i++)
+    pthread_join(worker[i], NULL);
+  l->_scanned = scan.todoCount;
+
+  // put the library together
+  for (i = 0; i < count; i++)
+    textLen += job[i].song.textLen;
+  l->_song = malloc(MAX(count, 1) * sizeof(struct MD_MLSong));
+  l->_text = malloc(MAX(textLen, 1));
+  if (l->_song == NULL || l->_text == NULL)
+    err = 1;
+  else
+  {
+    for (i = 0; i < count; i++)
+    {
+      l->_song[i] = job[i].song;
+      l->_song[i].textOffset = l->_textLen;
+      if (job[i].song.textLen != 0)
+        memcpy(l->_text + l->_textLen, job[i].text, job[i].song.textLen);
+      l->_textLen += job[i].song.textLen;
+    }
+    l->_songCount = count;
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    if (job[i].bOwned)
+      free((void *)job[i].text);
+  }
+  free(scan.todo);
+  free(job);
+
+  if (err == 1)
+  {
+    free(oldBuf);
+    closeLibrary(l);
+    return(1);
+  }
+
+  // only write the index when it has changed
+  if (l->_index[0] != '\0' &&
+      (oldBuf == NULL || l->_scanned != 0 || oh->songCount != l->_songCount) &&
+      !writeIndex(l))
+    err = 2;
+  free(oldBuf);
+
+  return(err);
+}
+
+uint32_t getLibrarySize(struct MD_MIDILibrary *l)
+{
+  return(l->_songCount);
+}
+
+const struct MD_MLSong *getLibrarySong(struct MD_MIDILibrary *l, uint32_t n)
+{
+  return(n < l->_songCount ? &l->_song[n] : NULL);
+}
+
+int32_t findLibrarySong(struct MD_MIDILibrary *l, const char *name)
+// binary search, the songs are in file name order
+{
+  uint32_t lo = 0, hi = l->_songCount;
+
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi) / 2;
+    int c = strcmp(l->_song[mid].name, name);
+
+    if (c == 0)
+      return(mid);
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return(-1);
+}
+
+const char *getSongTrackName(struct MD_MIDILibrary *l, uint32_t n, uint16_t track)
+// the track names come first in the text of the song, one after the other
+{
+  const char *p;
+
+  if (n >= l->_songCount || track >= l->_song[n].trackCount || l->_song[n].error != -1)
+    return(NULL);
+
+  p = l->_text + l->_song[n].textOffset;
+  while (track-- > 0)
+    p += strlen(p) + 1;
+  return(p);
+}
+
+const char *getSongTitle(struct MD_MIDILibrary *l, uint32_t n)
+{
+  const char *p;
+
+  if (n >= l->_songCount)
+    return(NULL);
+
+  p = getSongTrackName(l, n, 0);
+  return((p == NULL || p[0] == '\0') ? l->_song[n].name : p);
+}
+
+const char *getSongMarker(struct MD_MIDILibrary *l, uint32_t n, uint16_t marker, uint32_t *tick)
+// the markers follow the track names, each is its tick then its text
+{
+  const char *p;
+  uint16_t i;
+
+  if (n >= l->_songCount || marker >= l->_song[n].markerCount)
+    return(NULL);
+
+  p = l->_text + l->_song[n].textOffset;
+  for (i = 0; i < l->_song[n].trackCount; i++)
+    p += strlen(p) + 1;
+  while (marker-- > 0)
+    p += sizeof(uint32_t) + strlen(p + sizeof(uint32_t)) + 1;
+
+  memcpy(tick, p, sizeof(uint32_t));
+  return(p + sizeof(uint32_t));
+}
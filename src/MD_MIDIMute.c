@@ -0,0 +1,212 @@
+/*
+  MD_MIDIMute.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "MD_MIDIFile.h"
+
+/**
+ * \file
+ * \brief Main file for the track and channel mute and solo implementation
+ *
+ * A track or channel is silent if it is muted, or if another one is soloed and it is
+ * not. The notes and key aftertouch of a silent track or channel are not sent; its other
+ * channel messages are, so the channel is set up when it is heard again.
+ *
+ * The masks may be changed by another thread while the song plays. The notes sent are
+ * kept in _sounding, and the playing thread turns off those a change has silenced the
+ * next time it runs processEvents(), so only notes actually sounding are turned off.
+ */
+
+// The masks are changed by other threads with atomic operations, and read in one go
+#define LOAD(x)  __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define MASK_BIT(mask, n)  ((LOAD((mask)[(n) >> 5]) >> ((n) & 31)) & 1)
+
+static BOOL isSilent(struct MD_MIDIFile *m, uint16_t track, uint8_t ch)
+// Track or channel is muted, or not soloed when another one is
+{
+  uint16_t bit = 1 << ch;
+  uint16_t solo = LOAD(m->_channelSolo);
+
+  if ((LOAD(m->_channelMute) & bit) || (solo != 0 && !(solo & bit)))
+    return(TRUE);
+  if (m->_trackMute == NULL)
+    return(FALSE);
+  return(MASK_BIT(m->_trackMute, track) || (LOAD(m->_trackSolos) != 0 && !MASK_BIT(m->_trackSolo, track)));
+}
+
+static BOOL changeBit(uint32_t *mask, uint16_t n, BOOL bSet)
+// Set or clear a mask bit atomically, returns the bit it had
+{
+  uint32_t bit = (uint32_t)1 << (n & 31);
+  uint32_t old;
+
+  if (bSet)
+    old = __sync_fetch_and_or(&mask[n >> 5], bit);
+  else
+    old = __sync_fetch_and_and(&mask[n >> 5], ~bit);
+  return((old & bit) != 0);
+}
+
+static void maskChanged(struct MD_MIDIFile *m)
+// Tell the playing thread, after the mask change (full barrier)
+{
+  __sync_bool_compare_and_swap(&m->_muteChanged, FALSE, TRUE);
+}
+
+int allocMute(struct MD_MIDIFile *m, uint16_t count)
+// The track masks and the sounding notes in the arena, all clear for a new song
+{
+  uint32_t words = (count + 31) / 32;
+
+  m->_trackMute = arenaAlloc(m, 2 * words * sizeof(uint32_t));
+  m->_sounding = arenaAlloc(m, 16 * 128 * sizeof(uint32_t));
+  if (m->_trackMute == NULL || m->_sounding == NULL)
+    return(8);
+  m->_trackSolo = m->_trackMute + words;
+  m->_trackSolos = 0;
+  return(-1);
+}
+
+BOOL mutedEvent(struct MD_MIDIFile *m, const midi_event *mev, uint8_t ch)
+// mev is the channel message as it would be sent, ch its channel in the SMF. 
+// Anything other than a note or key aftertouch is left alone at once.
+{
+  uint32_t *s;
+
+  if (mev->data[0] > 0xa0)
+    return(FALSE);
+  if (isSilent(m, mev->track, ch))
+    return(TRUE);
+  if (m->_sounding == NULL || mev->data[0] == 0xa0)
+    return(FALSE);
+
+  s = &m->_sounding[mev->channel << 7 | mev->data[1]];
+  if (mev->data[0] == 0x90 && mev->data[2] != 0)
+    *s = SOUNDING | (uint32_t)ch << 16 | mev->track;
+  else
+    *s = 0;
+  return(FALSE);
+}
+
+static void notesOff(struct MD_MIDIFile *m, BOOL bAll)
+// Turn off the notes sounding, all of them or those of silent tracks and channels
+{
+  midi_event mev;
+  uint16_t i;
+
+  if (m->_sounding == NULL)
+    return;
+
+  mev.size = 3;
+  mev.data[0] = 0x80;
+  mev.data[2] = 0;
+  for (i = 0; i < 16 * 128; i++)
+  {
+    uint32_t s = m->_sounding[i];
+
+    if (!(s & SOUNDING) || !(bAll || isSilent(m, s & 0xffff, (s >> 16) & 0xf)))
+      continue;
+
+    m->_sounding[i] = 0;
+    mev.track = s & 0xffff;
+    mev.channel = i >> 7;
+    mev.data[1] = i & 0x7f;
+#if !DUMP_DATA
+    if (m->_midiHandler != NULL && (m->_eventMask & EVENT_MIDI))
+      (m->_midiHandler)(m->_uart, &mev);
+#endif
+  }
+}
+
+void applyMute(struct MD_MIDIFile *m)
+// Turn off the notes sounding that a mask change has silenced
+{
+  if (__sync_bool_compare_and_swap(&m->_muteChanged, TRUE, FALSE))
+    notesOff(m, FALSE);
+}
+
+void soundingOff(struct MD_MIDIFile *m)
+{
+  notesOff(m, TRUE);
+}
+
+void setTrackMute(struct MD_MIDIFile *m, uint16_t track, BOOL bMute)
+{
+  if (m->_trackMute == NULL || track >= m->_trackCount)
+    return;
+  changeBit(m->_trackMute, track, bMute);
+  maskChanged(m);
+}
+
+BOOL getTrackMute(struct MD_MIDIFile *m, uint16_t track)
+{
+  return(m->_trackMute != NULL && track < m->_trackCount && MASK_BIT(m->_trackMute, track));
+}
+
+void setTrackSolo(struct MD_MIDIFile *m, uint16_t track, BOOL bSolo)
+{
+  BOOL bWas;
+
+  if (m->_trackSolo == NULL || track >= m->_trackCount)
+    return;
+  bWas = changeBit(m->_trackSolo, track, bSolo);
+  if (bSolo && !bWas)
+    __sync_fetch_and_add(&m->_trackSolos, 1);
+  else if (!bSolo && bWas)
+    __sync_fetch_and_sub(&m->_trackSolos, 1);
+  maskChanged(m);
+}
+
+BOOL getTrackSolo(struct MD_MIDIFile *m, uint16_t track)
+{
+  return(m->_trackSolo != NULL && track < m->_trackCount && MASK_BIT(m->_trackSolo, track));
+}
+
+void setChannelMute(struct MD_MIDIFile *m, uint8_t ch, BOOL bMute)
+{
+  if (ch > 15)
+    return;
+  if (bMute)
+    __sync_fetch_and_or(&m->_channelMute, 1 << ch);
+  else
+    __sync_fetch_and_and(&m->_channelMute, ~(1 << ch));
+  maskChanged(m);
+}
+
+BOOL getChannelMute(struct MD_MIDIFile *m, uint8_t ch)
+{
+  return(ch < 16 && ((LOAD(m->_channelMute) >> ch) & 1));
+}
+
+void setChannelSolo(struct MD_MIDIFile *m, uint8_t ch, BOOL bSolo)
+{
+  if (ch > 15)
+    return;
+  if (bSolo)
+    __sync_fetch_and_or(&m->_channelSolo, 1 << ch);
+  else
+    __sync_fetch_and_and(&m->_channelSolo, ~(1 << ch));
+  maskChanged(m);
+}
+
+BOOL getChannelSolo(struct MD_MIDIFile *m, uint8_t ch)
+{
+  return(ch < 16 && ((LOAD(m->_channelSolo) >> ch) & 1));
+}
@@ -0,0 +1,305 @@
+/*
+  MD_MIDIPack.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+#include "MD_MIDILibrary.h"
+
+/**
+ * \file
+ * \brief Main file for the song pack implementation
+ */
+
+#define PACK_MAGIC    "MDMP"
+#define PACK_VERSION  1
+#define PACK_ALIGN(n) (((n) + 7) & ~7)    // songs start on 8 byte boundaries
+
+// Song pack header. The directory follows it, then the songs.
+struct packHeader
+{
+  char      magic[4];
+  uint16_t  version;
+  uint16_t  entrySize;      // changes with the directory entry layout
+  uint32_t  songCount;
+  uint32_t  totalLen;
+};
+
+// Song pack directory entry, the directory is sorted by name. Offsets are from
+// the start of the pack.
+struct packEntry
+{
+  char      name[MIDI_LIB_NAME];
+  uint32_t  offset;         // SMF image
+  uint32_t  length;
+  uint32_t  compiledOffset; // compiled copy in the cache file layout, 0 if none
+  uint32_t  compiledLength;
+};
+
+static const struct packEntry *packDir(struct MD_MIDIFile *m)
+// the directory of the open song pack
+{
+  return((const struct packEntry *)(m->_packMap + sizeof(struct packHeader)));
+}
+
+BOOL openSongPack(struct MD_MIDIFile *m, const char *path)
+{
+  const struct packHeader *h;
+  const struct packEntry *e;
+  struct stat st;
+  uint8_t *map;
+  uint32_t i;
+  int fd;
+
+  closeSongPack(m);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return(FALSE);
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*h))
+  {
+    close(fd);
+    return(FALSE);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return(FALSE);
+
+  // everything is checked once here, so loading a song needs no checks
+  h = (const struct packHeader *)map;
+  e = (const struct packEntry *)(h + 1);
+  if (memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) != 0 || h->version != PACK_VERSION ||
+      h->entrySize != sizeof(*e) || h->totalLen != st.st_size ||
+      (uint64_t)h->songCount * sizeof(*e) > st.st_size - sizeof(*h))
+  {
+    munmap(map, st.st_size);
+    return(FALSE);
+  }
+  for (i = 0; i < h->songCount; i++)
+  {
+    if ((uint64_t)e[i].offset + e[i].length > h->totalLen ||
+        (uint64_t)e[i].compiledOffset + e[i].compiledLength > h->totalLen ||
+        e[i].name[sizeof(e[i].name) - 1] != '\0' ||
+        (i > 0 && strcmp(e[i-1].name, e[i].name) >= 0))
+    {
+      munmap(map, st.st_size);
+      return(FALSE);
+    }
+  }
+
+  m->_packMap = map;
+  m->_packLen = st.st_size;
+  return(TRUE);
+}
+
+void closeSongPack(struct MD_MIDIFile *m)
+{
+  if (m->_packMap != NULL)
+    munmap(m->_packMap, m->_packLen);
+  m->_packMap = NULL;
+  m->_packLen = 0;
+}
+
+uint32_t getPackSize(struct MD_MIDIFile *m)
+{
+  if (m->_packMap == NULL)
+    return(0);
+  return(((const struct packHeader *)m->_packMap)->songCount);
+}
+
+const char *getPackName(struct MD_MIDIFile *m, uint32_t n)
+{
+  return(n < getPackSize(m) ? packDir(m)[n].name : NULL);
+}
+
+BOOL setPackSong(struct MD_MIDIFile *m, uint32_t n)
+{
+  if (n >= getPackSize(m))
+    return(FALSE);
+  setFilename(m, packDir(m)[n].name);
+  return(TRUE);
+}
+
+BOOL packSong(struct MD_MIDIFile *m)
+// Find the song named by _fileName in the song pack (binary search) and point the
+// song at it. It is set up from its compiled copy if there is one and it can be
+// used. Returns false if the song is not in the pack.
+{
+  const struct packEntry *e = packDir(m);
+  uint32_t lo = 0, hi = getPackSize(m);
+
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi) / 2;
+    int c = strcmp(e[mid].name, m->_fileName);
+
+    if (c == 0)
+    {
+      e += mid;
+      m->_fromPack = TRUE;
+
+      if (m->_loadMode == LOAD_COMPILED && e->compiledLength != 0 &&
+          useCache(m, m->_packMap + e->compiledOffset, e->compiledLength))
+        return(TRUE);
+
+      m->_data = m->_packMap + e->offset;
+      m->_dataLen = e->length;
+      m->_dataMapped = FALSE;
+      return(TRUE);
+    }
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return(FALSE);
+}
+
+static BOOL writeAll(int fd, const void *buf, uint32_t len)
+// write the whole buffer
+{
+  const uint8_t *p = buf;
+
+  while (len > 0)
+  {
+    ssize_t n = write(fd, p, len);
+
+    if (n <= 0)
+      return(FALSE);
+    p += n;
+    len -= n;
+  }
+  return(TRUE);
+}
+
+static BOOL padTo8(int fd, uint32_t *offset)
+// move the file position on to the next 8 byte boundary
+{
+  static const uint8_t pad[8] = { 0 };
+  uint32_t fill = PACK_ALIGN(*offset) - *offset;
+
+  if (fill != 0 && !writeAll(fd, pad, fill))
+    return(FALSE);
+  *offset += fill;
+  return(TRUE);
+}
+
+int writeSongPack(struct MD_MIDILibrary *l, const char *pack, BOOL bCompile)
+{
+  struct packHeader h;
+  struct packEntry *dir;
+  struct MD_MIDIFile *m;
+  char tmp[MIDI_NAME_SIZE + 4];
+  uint32_t count = 0, offset, i;
+  BOOL bOk = TRUE;
+  int fd;
+
+  // only the songs that can be played go in the pack
+  dir = calloc(MAX(l->_songCount, 1), sizeof(*dir));
+  m = malloc(sizeof(struct MD_MIDIFile));
+  if (dir == NULL || m == NULL)
+  {
+    free(dir);
+    free(m);
+    return(1);
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.new", pack);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+  {
+    free(dir);
+    free(m);
+    return(0);
+  }
+
+  // the songs go after the directory, which is written last
+  for (i = 0; i < l->_songCount; i++)
+    count += (l->_song[i].error == -1);
+  offset = PACK_ALIGN(sizeof(h) + count * sizeof(*dir));
+  bOk = (lseek(fd, offset, SEEK_SET) == (off_t)offset);
+
+  count = 0;
+  for (i = 0; bOk && i < l->_songCount; i++)
+  {
+    struct packEntry *e = &dir[count];
+    char path[sizeof(l->_dir) + MIDI_LIB_NAME + 1];
+    struct stat st;
+
+    if (l->_song[i].error != -1)
+      continue;
+
+    snprintf(path, sizeof(path), "%s/%s", l->_dir, l->_song[i].name);
+    initialise(m, -1);
+    setFilename(m, path);
+    setLoadMode(m, bCompile ? LOAD_COMPILED : LOAD_MAPPED);
+    if (stat(path, &st) != 0 || loadMIDIFile(m) != -1)
+      continue;     // changed since the library was scanned
+
+    // a compiled song holds its own copy of the image, which the entry points at
+    bOk = padTo8(fd, &offset);
+    if (bOk && bCompile)
+    {
+      uint32_t image;
+
+      bOk = writeCache(m, fd, &st, &image);
+      e->compiledOffset = offset;
+      e->compiledLength = lseek(fd, 0, SEEK_CUR) - offset;
+      e->offset = offset + image;
+      offset += e->compiledLength;
+    }
+    else if (bOk)
+    {
+      bOk = writeAll(fd, m->_data, m->_dataLen);
+      e->offset = offset;
+      offset += m->_dataLen;
+    }
+    e->length = m->_dataLen;
+    strcpy(e->name, l->_song[i].name);
+    closeMIDIFile(m);
+    count++;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, PACK_MAGIC, sizeof(h.magic));
+  h.version = PACK_VERSION;
+  h.entrySize = sizeof(*dir);
+  h.songCount = count;
+  h.totalLen = offset;
+  bOk = bOk && pwrite(fd, &h, sizeof(h), 0) == sizeof(h) &&
+        pwrite(fd, dir, count * sizeof(*dir), sizeof(h)) == (ssize_t)(count * sizeof(*dir));
+  bOk = (close(fd) == 0) && bOk;
+  free(dir);
+  free(m);
+
+  if (!bOk || rename(tmp, pack) != 0)
+  {
+    unlink(tmp);
+    return(0);
+  }
+  return(-1);
+}
@@ -0,0 +1,156 @@
+/*
+  MD_MIDIPattern.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+
+/**
+ * \file
+ * \brief Main file for the format 2 pattern implementation
+ *
+ * Each track of a format 2 file is a pattern with its own timeline starting at 
+ * tick 0. The pattern playing is put on the song clock at _patternBase: with 
+ * LOAD_COMPILED its events are a range of the timeline (compiled one track after
+ * the other) and are compared against the song tick less the base, otherwise it 
+ * is the only track in the scheduler heap and the base is added to its _nextTick.
+ * Either way starting a pattern does not depend on the size of the file.
+ */
+
+void findPatterns(struct MD_MIDIFile *m)
+// Find the range of each track in the compiled timeline of a format 2 file, and
+// its length in ticks
+{
+  struct MD_MFEvents *e = &m->_events;
+  uint32_t n = 0;
+  uint16_t i;
+
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    struct MD_MFTrack *t = &m->_track[i];
+
+    t->_firstEvent = n;
+    while (n < e->count && e->track[n] == i)
+      n++;
+    t->_endEvent = n;
+    t->_ticks = (n > t->_firstEvent ? e->tick[n-1] : 0);
+  }
+}
+
+void startPattern(struct MD_MIDIFile *m, uint16_t n, uint32_t tick)
+// Start track n from the beginning, its first tick at song tick
+{
+  struct MD_MFTrack *t = &m->_track[n];
+
+  m->_pattern = n;
+  m->_patternBase = tick;
+
+  if (m->_loadMode == LOAD_COMPILED)
+    m->_eventIdx = t->_firstEvent;
+  else
+  {
+    restartTrack(t);
+    t->_nextTick += tick;
+    rebuildHeap(m);     // just this track
+  }
+}
+
+BOOL patternEnded(struct MD_MIDIFile *m)
+{
+  if (m->_loadMode == LOAD_COMPILED)
+    return(m->_eventIdx >= m->_track[m->_pattern]._endEvent);
+  return(m->_heapCount == 0);
+}
+
+static void playPattern(struct MD_MIDIFile *m, uint32_t tick)
+// Play the events of the pattern due by song tick. A looping pattern starts 
+// again at the tick after its last event, which may be in the future.
+{
+  for (;;)
+  {
+    struct MD_MFTrack *t = &m->_track[m->_pattern];
+
+    if (m->_loadMode == LOAD_COMPILED)
+    {
+      struct MD_MFEvents *e = &m->_events;
+
+      while (m->_eventIdx < t->_endEvent && e->tick[m->_eventIdx] + m->_patternBase <= tick)
+        dispatchEvent(m, m->_eventIdx++);
+    }
+    else
+    {
+      uint16_t i;
+
+      while (nextDueTrack(m, tick, &i))
+        trackAdvanced(m, getNextTrackEvent(m, &m->_track[i]));
+    }
+
+    // a pattern with no length cannot loop, it is left at its end
+    if (!patternEnded(m) || !m->_looping || t->_ticks == 0)
+      break;
+    startPattern(m, m->_pattern, m->_patternBase + t->_ticks);
+  }
+}
+
+void processPatternEvents(struct MD_MIDIFile *m, uint16_t ticks)
+// processEvents() for a format 2 file - the pattern playing, then the one waiting
+// from the tick it is due
+{
+  uint32_t target = m->_songTick + ticks;
+
+  while (m->_nextPattern != NO_PATTERN && m->_patternSwitch <= target)
+  {
+    playPattern(m, m->_patternSwitch - 1);  // the switch is always after _songTick
+    soundingOff(m);     // the old pattern's note offs are not played
+    startPattern(m, m->_nextPattern, m->_patternSwitch);
+    m->_nextPattern = NO_PATTERN;
+  }
+  playPattern(m, target);
+  m->_songTick = target;
+}
+
+BOOL setPattern(struct MD_MIDIFile *m, uint16_t n, BOOL bBar)
+{
+  uint32_t bar;
+
+  if (!m->_fileOpen || m->_format != 2 || n >= m->_trackCount)
+    return(FALSE);
+
+  // the events at _songTick have been played, so the new pattern starts with the
+  // next call to processEvents()
+  bar = barToTick(m, 2, 1) - barToTick(m, 1, 1);  // only one time signature
+  if (!bBar || bar == 0)
+  {
+    m->_nextPattern = NO_PATTERN;
+    soundingOff(m);     // the old pattern's note offs are not played
+    startPattern(m, n, m->_songTick);
+  }
+  else
+  {
+    m->_nextPattern = n;
+    m->_patternSwitch = (m->_songTick / bar + 1) * bar;
+  }
+  return(TRUE);
+}
+
+uint16_t getPattern(struct MD_MIDIFile *m)
+{
+  return(m->_pattern);
+}
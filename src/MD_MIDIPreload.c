@@ -0,0 +1,226 @@
+/*
+  MD_MIDIPreload.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIPreload.h"
+
+/**
+ * \file
+ * \brief Main file for the gapless song preloader implementation
+ */
+
+static void *preloadThread(void *arg)
+// Loader thread - close the songs that have finished and load the queued one.
+// Each song object is owned by one side at a time: the loader, _next, the playing
+// thread or _retired. The loader keeps count of its own in bFree and never looks
+// at the song playing.
+{
+  struct MD_MIDIPreload *p = arg;
+  BOOL bFree[2] = { TRUE, TRUE };
+
+  for (;;)
+  {
+    struct MD_MIDIFile *m;
+    char name[MIDI_NAME_SIZE];
+    uint8_t i;
+
+    int err;
+
+    if (sem_wait(&p->_wake) != 0)
+      continue;     // interrupted
+
+    // the playing thread hands back the song it has finished with
+    if ((m = __sync_lock_test_and_set(&p->_retired, NULL)) != NULL)
+    {
+      closeMIDIFile(m);
+      bFree[m - p->_song] = TRUE;
+    }
+
+    pthread_mutex_lock(&p->_lock);
+    if (p->_quit)
+    {
+      pthread_mutex_unlock(&p->_lock);
+      break;
+    }
+    strcpy(name, p->_request);
+    pthread_mutex_unlock(&p->_lock);
+    if (name[0] == '\0')
+      continue;
+
+    // a newer request replaces a song still waiting to start, unless the
+    // playing thread takes it first
+    if ((m = __sync_lock_test_and_set(&p->_next, NULL)) != NULL)
+    {
+      closeMIDIFile(m);
+      bFree[m - p->_song] = TRUE;
+    }
+
+    for (i = 0; i < 2 && !bFree[i]; i++)
+      ;
+    if (i == 2)
+      continue;     // both are busy, the one playing comes back with another post
+
+    pthread_mutex_lock(&p->_lock);
+    if (strcmp(name, p->_request) == 0)
+      p->_request[0] = '\0';
+    pthread_mutex_unlock(&p->_lock);
+
+    m = &p->_song[i];
+    setFilename(m, name);
+    err = loadMIDIFile(m);
+    pthread_mutex_lock(&p->_lock);
+    p->_error = err;
+    pthread_mutex_unlock(&p->_lock);
+    if (err != -1)
+    {
+      closeMIDIFile(m);
+      continue;
+    }
+
+    // publish it, the full barrier makes the song seen before the pointer
+    bFree[i] = FALSE;
+    __sync_bool_compare_and_swap(&p->_next, NULL, m);
+  }
+
+  return(NULL);
+}
+
+BOOL initPreload(struct MD_MIDIPreload *p, const struct MD_MIDIFile *tmpl)
+{
+  uint8_t i;
+
+  for (i = 0; i < 2; i++)
+  {
+    initialise(&p->_song[i], tmpl->_uart);
+    copySettings(&p->_song[i], tmpl);
+  }
+  p->_current = NULL;
+  p->_next = NULL;
+  p->_retired = NULL;
+  p->_request[0] = '\0';
+  p->_error = -1;
+  p->_quit = FALSE;
+
+  if (pthread_mutex_init(&p->_lock, NULL) != 0)
+    return(FALSE);
+  if (sem_init(&p->_wake, 0, 0) != 0)
+  {
+    pthread_mutex_destroy(&p->_lock);
+    return(FALSE);
+  }
+  if (pthread_create(&p->_thread, NULL, preloadThread, p) != 0)
+  {
+    sem_destroy(&p->_wake);
+    pthread_mutex_destroy(&p->_lock);
+    return(FALSE);
+  }
+  return(TRUE);
+}
+
+void closePreload(struct MD_MIDIPreload *p)
+{
+  uint8_t i;
+
+  pthread_mutex_lock(&p->_lock);
+  p->_quit = TRUE;
+  pthread_mutex_unlock(&p->_lock);
+  sem_post(&p->_wake);
+  pthread_join(p->_thread, NULL);
+  sem_destroy(&p->_wake);
+  pthread_mutex_destroy(&p->_lock);
+
+  for (i = 0; i < 2; i++)
+  {
+    closeMIDIFile(&p->_song[i]);
+    p->_song[i]._packMap = NULL;    // not ours to unmap
+  }
+  p->_current = p->_next = p->_retired = NULL;
+}
+
+void queueNextSong(struct MD_MIDIPreload *p, const char *name)
+{
+  pthread_mutex_lock(&p->_lock);
+  strncpy(p->_request, name, sizeof(p->_request) - 1);
+  p->_request[sizeof(p->_request) - 1] = '\0';
+  pthread_mutex_unlock(&p->_lock);
+  sem_post(&p->_wake);
+}
+
+static void retireSong(struct MD_MIDIPreload *p)
+// Hand the song playing to the loader to close. Left playing (at its end) if the
+// loader has not yet taken the last one.
+{
+  if (p->_current != NULL && __sync_bool_compare_and_swap(&p->_retired, NULL, p->_current))
+  {
+    p->_current = NULL;
+    sem_post(&p->_wake);
+  }
+}
+
+BOOL playPreload(struct MD_MIDIPreload *p)
+// The playing thread only exchanges pointers and posts the semaphore, neither waits
+{
+  struct MD_MIDIFile *m = p->_current;
+
+  if (m != NULL)
+  {
+    getNextEvent(m);
+    if (!isEOF(m))
+      return(TRUE);
+  }
+
+  // the song has ended (or none was playing), start the next one if it is ready
+  if ((m = __sync_lock_test_and_set(&p->_next, NULL)) == NULL)
+  {
+    retireSong(p);
+    return(FALSE);
+  }
+
+  retireSong(p);    // always room, the loader had a free song to load this one
+  p->_current = m;
+
+  // start the clock now and play what is on the first tick, rather than a tick later
+  synchTracks(m);
+  m->_syncAtStart = TRUE;
+  processEvents(m, 0);
+  return(TRUE);
+}
+
+struct MD_MIDIFile *getPreloadSong(struct MD_MIDIPreload *p)
+{
+  return(p->_current);
+}
+
+BOOL isPreloadReady(struct MD_MIDIPreload *p)
+{
+  return(p->_next != NULL);
+}
+
+int getPreloadError(struct MD_MIDIPreload *p)
+{
+  int err;
+
+  pthread_mutex_lock(&p->_lock);
+  err = p->_error;
+  pthread_mutex_unlock(&p->_lock);
+  return(err);
+}
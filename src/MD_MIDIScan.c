@@ -0,0 +1,116 @@
+/*
+  MD_MIDIScan.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+
+/**
+ * \file
+ * \brief Main file for the fast forward and rewind implementation
+ *
+ * A scan moves through the song with seekTick(), and works out the controller state at
+ * each position as a seek does. Only the changes from the state last sent to the 
+ * instrument go out, a channel at a time within the MIDI bandwidth set aside for them.
+ * When playing from the track windows the SMF is mapped for as long as the scan lasts.
+ */
+
+#define SCAN_MIN  4     // slowest scan, times real time
+#define SCAN_MAX  32    // fastest scan, times real time
+
+static void scanTo(struct MD_MIDIFile *m, uint64_t us, uint16_t budget)
+// Move to a time in the song and send the controller changes that fit in the budget
+{
+  seekTick(m, microsToTick(m, us));
+  m->_playMicros = us;
+  updatePosition(m);
+  if (chaseCurrent(m))
+    chaseUpdate(m, &m->_scanSent, budget, &m->_scanChannel);
+}
+
+BOOL scanStep(struct MD_MIDIFile *m, uint32_t now)
+// Move the song position by the rate times the time passed, once the scan 
+// interval is up. Returns true if it moved.
+{
+  uint32_t elapsed = now - m->_lastTickCheckTime;
+  uint64_t step, end, us;
+
+  if (elapsed < MIDI_SCAN_INTERVAL * 1000UL)
+    return(FALSE);
+  m->_lastTickCheckTime = now;
+
+  step = (uint64_t)elapsed * (m->_scanRate < 0 ? -m->_scanRate : m->_scanRate);
+  end = tickToMicros(m, m->_songTicks);
+  if (m->_scanRate > 0)
+    us = MIN(m->_playMicros + step, end);
+  else
+    us = (m->_playMicros > step ? m->_playMicros - step : 0);
+  // a late call does not get to catch up on more than a few intervals of bandwidth
+  elapsed = MIN(elapsed, 4 * MIDI_SCAN_INTERVAL * 1000UL);
+
+  scanTo(m, us, (uint64_t)elapsed * MIDI_SCAN_BANDWIDTH / 1000000);
+  m->_syncAtStart = TRUE;   // the scan keeps its own time, the seek need not resync it
+  return(TRUE);
+}
+
+BOOL setScan(struct MD_MIDIFile *m, int8_t rate)
+{
+  if (!m->_fileOpen || m->_format == 2)   // patterns have no song position
+    return(FALSE);
+
+  if (rate != 0)
+  {
+    int8_t speed = MAX(MIN(rate < 0 ? -(int16_t)rate : rate, SCAN_MAX), SCAN_MIN);
+
+    rate = (rate < 0 ? -speed : speed);
+  }
+
+  if (rate != 0 && m->_scanRate == 0)
+  {
+    // the SMF stays mapped for the whole scan, not once for every step
+    if (STREAM_WINDOWED(m) && !mapStreamImage(m))
+      return(FALSE);
+
+    // the instrument has the state of the song played so far
+    soundingOff(m);
+    if (!chaseCurrent(m))
+      memset(&m->_chase, CHASE_UNSET, sizeof(m->_chase));
+    m->_scanSent = m->_chase;
+    m->_scanChannel = 0;
+    m->_syncAtStart = FALSE;    // the scan time starts now
+  }
+  else if (rate == 0 && m->_scanRate != 0)
+  {
+    // all the changes still due, before seekTick() goes back to chasing
+    scanTo(m, m->_playMicros, 0xffff);
+    if (m->_streamFd >= 0 && m->_data != NULL)
+      unmapStreamImage(m);      // back to the track windows
+    m->_syncAtStart = FALSE;    // force a time resynch
+  }
+
+  m->_scanRate = rate;
+  return(TRUE);
+}
+
+int8_t getScan(struct MD_MIDIFile *m)
+{
+  return(m->_scanRate);
+}
@@ -0,0 +1,236 @@
+/*
+  MD_MIDISeek.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+
+/**
+ * \file
+ * \brief Main file for the random access seek implementation
+ */
+
+int buildCheckpoints(struct MD_MIDIFile *m)
+// Record where each track is every MIDI_SEEK_INTERVAL events, so a seek only
+// has to decode from the nearest checkpoint instead of from the track start.
+{
+  struct MD_MFCheckpoint *cp;
+  uint32_t count = 0;
+  uint16_t i;
+
+  if (m->_format == 2)    // not seekable
+    return(-1);
+
+  for (i = 0; i < m->_trackCount; i++)
+    count += countEvents(&m->_track[i]) / MIDI_SEEK_INTERVAL + 1;
+
+  if ((m->_checkpoints = malloc(count * sizeof(struct MD_MFCheckpoint))) == NULL)
+    return(8);
+
+  cp = m->_checkpoints;
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    struct MD_MFTrack *t = &m->_track[i];
+    const uint8_t *p = t->_data;
+    const uint8_t *end = t->_data + t->_length;
+    uint32_t tick = 0;
+    uint32_t n = 0;
+    uint8_t  rs = 0;
+    uint8_t  status, d1, d2;
+    uint32_t payload, delta;
+
+    t->_cp = cp;
+    t->_cpCount = 0;
+    while (p < end)
+    {
+      if (n++ % MIDI_SEEK_INTERVAL == 0)
+      {
+        cp->tick = tick;
+        cp->offset = p - m->_data;
+        cp->rs = rs;
+        cp++;
+        t->_cpCount++;
+      }
+
+      if (!decodeVarLen(&p, end, &delta))
+        break;
+      tick += delta;
+      if (!decodeEvent(m, &p, end, &rs, &status, &d1, &d2, &payload) || IS_END_OF_TRACK(status, d1))
+        break;
+    }
+  }
+
+  return(-1);
+}
+
+void freeCheckpoints(struct MD_MIDIFile *m)
+// Release the seek checkpoints
+{
+  uint16_t i;
+
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    m->_track[i]._cp = NULL;
+    m->_track[i]._cpCount = 0;
+  }
+  free(m->_checkpoints);
+  m->_checkpoints = NULL;
+}
+
+static void seekTrack(struct MD_MIDIFile *m, struct MD_MFTrack *t, uint32_t tick)
+// Put the track cursor on its first event at or after tick, as restartTrack() 
+// leaves it for the first event of the track.
+{
+  const uint8_t *end = t->_data + t->_length;
+  const uint8_t *p;
+  uint32_t lo = 0, hi = t->_cpCount;
+  uint32_t evTick;
+  uint8_t  rs;
+  uint8_t  status, d1, d2;
+  uint32_t payload, delta;
+
+  if (t->_cpCount == 0)   // no events to play
+  {
+    restartTrack(t);
+    return;
+  }
+
+  // binary search for the last checkpoint with all the events before it 
+  // earlier than tick. The first checkpoint is the start of the track.
+  while (hi - lo > 1)
+  {
+    uint32_t mid = (lo + hi) / 2;
+
+    if (t->_cp[mid].tick < tick)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  p = m->_data + t->_cp[lo].offset;
+  evTick = t->_cp[lo].tick;
+  rs = t->_cp[lo].rs;
+
+  // skip the events before tick, at most MIDI_SEEK_INTERVAL of them
+  t->_endOfTrack = TRUE;
+  while (p < end)
+  {
+    if (!decodeVarLen(&p, end, &delta))
+      break;
+    evTick += delta;
+    if (evTick >= tick)
+    {
+      t->_curr = p;
+      t->_nextTick = evTick;
+      t->_endOfTrack = FALSE;
+      break;
+    }
+    if (!decodeEvent(m, &p, end, &rs, &status, &d1, &d2, &payload) || IS_END_OF_TRACK(status, d1))
+      break;
+  }
+
+  // parseEvent() keeps the running status in the MIDI event
+  if (rs != 0)
+  {
+    t->_mev.data[0] = rs & 0xf0;
+    t->_mev.channel = rs & 0xf;
+    t->_mev.size = ((rs & 0xe0) == 0xc0) ? 2 : 3;
+  }
+}
+
+static uint32_t findEvent(struct MD_MIDIFile *m, uint32_t tick)
+// binary search for the first event of the compiled timeline at or after tick
+{
+  uint32_t lo = 0, hi = m->_events.count;
+
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi) / 2;
+
+    if (m->_events.tick[mid] < tick)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return(lo);
+}
+
+BOOL seekTick(struct MD_MIDIFile *m, uint32_t tick)
+{
+  uint16_t sig;
+  uint16_t i;
+
+  if (!m->_fileOpen || m->_format == 2)   // patterns have no song position
+    return(FALSE);
+
+  // the note offs of the notes sounding are skipped over
+  soundingOff(m);
+
+  if (m->_loadMode == LOAD_COMPILED)
+    m->_eventIdx = findEvent(m, tick);
+  else
+  {
+    BOOL bStream = STREAM_WINDOWED(m);   // playing from the track windows, not scanning
+
+    if (bStream && !mapStreamImage(m))
+      return(FALSE);
+    for (i = 0; i < m->_trackCount; i++)
+      seekTrack(m, &m->_track[i], tick);
+    if (bStream)
+      unmapStreamImage(m);
+    rebuildHeap(m);
+  }
+
+  // the events at tick are played by the next call to processEvents()
+  m->_songTick = tick;
+  m->_playMicros = tickToMicros(m, tick);
+  m->_playRemainder = 0;
+
+  // tempo and time signature as they would be if the song had played to here
+  setMicrosecondPerQuarterNote(m, getTempoAt(m, tick));
+  sig = getTimeSignatureAt(m, tick);
+  setTimeSignature(m, sig >> 8, sig & 0xff);
+
+  if (m->_chaseMode && m->_scanRate == 0)   // a scan sends the changes itself
+    chaseMIDIFile(m);
+  updatePosition(m);
+
+  m->_syncAtStart = FALSE;   // force a time resynch
+  return(TRUE);
+}
+
+BOOL seekMillis(struct MD_MIDIFile *m, uint32_t ms)
+{
+  uint64_t us = (uint64_t)ms * 1000;
+
+  if (!seekTick(m, microsToTick(m, us)))
+    return(FALSE);
+
+  // start the clock from the exact time, part way into the tick
+  m->_playMicros = us;
+  updatePosition(m);
+  return(TRUE);
+}
+
+BOOL seekBar(struct MD_MIDIFile *m, uint32_t bar, uint8_t beat)
+{
+  return(seekTick(m, barToTick(m, bar, beat)));
+}
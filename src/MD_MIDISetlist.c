@@ -0,0 +1,340 @@
+/*
+  MD_MIDISetlist.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDISetlist.h"
+
+/**
+ * \file
+ * \brief Main file for the setlist implementation
+ */
+
+static uint32_t songBytes(struct MD_MIDIFile *m)
+// Memory held by a compiled song. A song set up from a compiled copy holds the
+// copy, otherwise the image and the blocks built from it.
+{
+  struct MD_MFArena *a;
+  uint32_t bytes = sizeof(*m);
+
+  for (a = m->_arena; a != NULL; a = a->next)
+    bytes += sizeof(*a) + a->size;
+
+  if (m->_cacheMap != NULL)
+    return(bytes + m->_cacheLen);
+
+  return(bytes + m->_dataLen + eventsSize(m->_events.count) +
+         m->_tempoCount * sizeof(struct MD_MFTempo) +
+         m->_timeSigCount * sizeof(struct MD_MFTimeSig) +
+         m->_chasePointCount * sizeof(struct MD_MFChasePoint));
+}
+
+static struct MD_MIDIFile *loadSong(struct MD_MIDISetlist *s, const char *name)
+// Load and compile a song with the setlist settings. Called without the lock.
+{
+  struct MD_MIDIFile *m;
+  int err;
+
+  if ((m = malloc(sizeof(*m))) == NULL)
+    err = 8;    // as loadMIDIFile() when it runs out of memory
+  else
+  {
+    initialise(m, s->_settings._uart);
+    copySettings(m, &s->_settings);
+    setFilename(m, name);
+    if ((err = loadMIDIFile(m)) == -1)
+      return(m);
+    free(m);
+    m = NULL;
+  }
+
+  pthread_mutex_lock(&s->_lock);
+  s->_error = err;
+  pthread_mutex_unlock(&s->_lock);
+  return(NULL);
+}
+
+static void closeSong(struct MD_MIDIFile *m)
+// Close a song loaded by loadSong(). The song pack stays open.
+{
+  closeMIDIFile(m);
+  free(m);
+}
+
+static void cacheSong(struct MD_MIDISetlist *s, uint16_t n, struct MD_MIDIFile *m)
+// Put a song loaded by loadSong() in the cache. Called with the lock.
+{
+  struct MD_MSEntry *e = &s->_entry[n];
+
+  e->song = m;
+  e->bytes = songBytes(m);
+  e->lastUse = ++s->_useClock;
+  s->_stats.songs++;
+  s->_stats.bytes += e->bytes;
+  s->_stats.peakBytes = MAX(s->_stats.peakBytes, s->_stats.bytes);
+}
+
+static uint16_t evictSongs(struct MD_MIDISetlist *s, struct MD_MIDIFile **evicted)
+// Take the songs used least recently out of the cache until it is within the
+// budget, other than the song selected. Called with the lock, the songs are
+// closed after it is released. Returns the number of songs in evicted.
+{
+  uint16_t count = 0;
+
+  while (s->_stats.bytes > s->_budget)
+  {
+    struct MD_MSEntry *e = NULL;
+    uint16_t i;
+
+    for (i = 0; i < s->_count; i++)
+    {
+      if (s->_entry[i].song != NULL && i != s->_current &&
+          (e == NULL || s->_entry[i].lastUse < e->lastUse))
+        e = &s->_entry[i];
+    }
+    if (e == NULL)
+      break;
+
+    evicted[count++] = e->song;
+    s->_stats.songs--;
+    s->_stats.bytes -= e->bytes;
+    s->_stats.evictions++;
+    e->song = NULL;
+    e->bytes = 0;
+  }
+
+  return(count);
+}
+
+static void *warmThread(void *arg)
+// Load the songs in setlist order while they fit in the budget
+{
+  struct MD_MIDISetlist *s = arg;
+  uint16_t i;
+
+  for (i = 0; ; i++)
+  {
+    struct MD_MIDIFile *m;
+    char name[MIDI_NAME_SIZE];
+    BOOL bKeep;
+
+    pthread_mutex_lock(&s->_lock);
+    if (s->_quit || i >= s->_count || s->_stats.bytes >= s->_budget)
+    {
+      s->_stats.warming = FALSE;
+      pthread_mutex_unlock(&s->_lock);
+      break;
+    }
+    bKeep = (s->_entry[i].song == NULL);
+    strcpy(name, s->_entry[i].name);
+    pthread_mutex_unlock(&s->_lock);
+
+    if (!bKeep || (m = loadSong(s, name)) == NULL)
+      continue;
+
+    // the song may have been selected while it was loading
+    pthread_mutex_lock(&s->_lock);
+    bKeep = (s->_entry[i].song == NULL && s->_stats.bytes + songBytes(m) <= s->_budget);
+    if (bKeep)
+    {
+      cacheSong(s, i, m);
+      s->_stats.warmed++;
+    }
+    pthread_mutex_unlock(&s->_lock);
+
+    if (!bKeep)
+      closeSong(m);
+  }
+
+  return(NULL);
+}
+
+void initSetlist(struct MD_MIDISetlist *s, const struct MD_MIDIFile *tmpl, uint32_t budget)
+{
+  initialise(&s->_settings, tmpl->_uart);
+  copySettings(&s->_settings, tmpl);
+  s->_settings._loadMode = LOAD_COMPILED;
+
+  memset(s->_entry, 0, sizeof(s->_entry));
+  s->_count = 0;
+  s->_current = -1;
+  s->_budget = budget;
+  s->_useClock = 0;
+  memset(&s->_stats, 0, sizeof(s->_stats));
+  s->_stats.budget = budget;
+  s->_error = -1;
+  s->_quit = FALSE;
+  s->_threadStarted = FALSE;
+  pthread_mutex_init(&s->_lock, NULL);
+}
+
+int16_t addSetlistSong(struct MD_MIDISetlist *s, const char *name)
+{
+  int16_t n = -1;
+
+  pthread_mutex_lock(&s->_lock);
+  if (s->_count < MIDI_SETLIST_SONGS)
+  {
+    struct MD_MSEntry *e = &s->_entry[s->_count];
+
+    strncpy(e->name, name, sizeof(e->name) - 1);
+    e->name[sizeof(e->name) - 1] = '\0';
+    n = s->_count++;
+  }
+  pthread_mutex_unlock(&s->_lock);
+
+  return(n);
+}
+
+BOOL warmSetlist(struct MD_MIDISetlist *s)
+{
+  if (s->_threadStarted)
+    return(FALSE);
+
+  pthread_mutex_lock(&s->_lock);
+  s->_stats.warming = TRUE;
+  pthread_mutex_unlock(&s->_lock);
+  if (pthread_create(&s->_thread, NULL, warmThread, s) != 0)
+  {
+    pthread_mutex_lock(&s->_lock);
+    s->_stats.warming = FALSE;
+    pthread_mutex_unlock(&s->_lock);
+    return(FALSE);
+  }
+  s->_threadStarted = TRUE;
+  return(TRUE);
+}
+
+struct MD_MIDIFile *selectSetlistSong(struct MD_MIDISetlist *s, uint16_t n)
+{
+  struct MD_MIDIFile *evicted[MIDI_SETLIST_SONGS + 1];
+  struct MD_MIDIFile *m;
+  char name[MIDI_NAME_SIZE];
+  uint16_t count, i;
+
+  pthread_mutex_lock(&s->_lock);
+  if (n >= s->_count)
+  {
+    pthread_mutex_unlock(&s->_lock);
+    return(NULL);
+  }
+
+  count = 0;
+  if ((m = s->_entry[n].song) != NULL)
+    s->_stats.hits++;
+  else
+  {
+    s->_stats.misses++;
+    strcpy(name, s->_entry[n].name);
+    pthread_mutex_unlock(&s->_lock);
+
+    if ((m = loadSong(s, name)) == NULL)
+      return(NULL);
+
+    // the warm up may have loaded it in the meantime
+    pthread_mutex_lock(&s->_lock);
+    if (s->_entry[n].song == NULL)
+      cacheSong(s, n, m);
+    else
+    {
+      evicted[count++] = m;
+      m = s->_entry[n].song;
+    }
+  }
+
+  s->_current = n;
+  s->_entry[n].lastUse = ++s->_useClock;
+  count += evictSongs(s, evicted + count);
+  pthread_mutex_unlock(&s->_lock);
+
+  for (i = 0; i < count; i++)
+    closeSong(evicted[i]);
+
+  // back to the start, as if it had just been loaded
+  restart(m);
+  m->_paused = FALSE;
+  m->_playRemainder = 0;
+  return(m);
+}
+
+void closeSetlist(struct MD_MIDISetlist *s)
+{
+  uint16_t i;
+
+  if (s->_threadStarted)
+  {
+    pthread_mutex_lock(&s->_lock);
+    s->_quit = TRUE;
+    pthread_mutex_unlock(&s->_lock);
+    pthread_join(s->_thread, NULL);
+    s->_threadStarted = FALSE;
+  }
+
+  for (i = 0; i < s->_count; i++)
+  {
+    if (s->_entry[i].song != NULL)
+      closeSong(s->_entry[i].song);
+  }
+  memset(s->_entry, 0, sizeof(s->_entry));
+  s->_count = 0;
+  s->_current = -1;
+  s->_stats.songs = 0;
+  s->_stats.bytes = 0;
+  pthread_mutex_destroy(&s->_lock);
+}
+
+uint16_t getSetlistSize(struct MD_MIDISetlist *s)
+{
+  uint16_t n;
+
+  pthread_mutex_lock(&s->_lock);
+  n = s->_count;
+  pthread_mutex_unlock(&s->_lock);
+  return(n);
+}
+
+BOOL isSetlistCached(struct MD_MIDISetlist *s, uint16_t n)
+{
+  BOOL b;
+
+  pthread_mutex_lock(&s->_lock);
+  b = (n < s->_count && s->_entry[n].song != NULL);
+  pthread_mutex_unlock(&s->_lock);
+  return(b);
+}
+
+void getSetlistStats(struct MD_MIDISetlist *s, struct MD_MSStats *st)
+{
+  pthread_mutex_lock(&s->_lock);
+  *st = s->_stats;
+  pthread_mutex_unlock(&s->_lock);
+}
+
+int getSetlistError(struct MD_MIDISetlist *s)
+{
+  int err;
+
+  pthread_mutex_lock(&s->_lock);
+  err = s->_error;
+  pthread_mutex_unlock(&s->_lock);
+  return(err);
+}
@@ -0,0 +1,257 @@
+/*
+  MD_MIDIStream.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+
+/**
+ * \file
+ * \brief Main file for the streamed playback implementation
+ */
+
+// Bytes that must be in the window ahead of the cursor before an event is
+// parsed. This covers any MIDI message with its delta time, and the header of
+// a SYSEX or META event. Their payload is brought in by trackPayload().
+#define STREAM_AHEAD        64
+#define STREAM_MIN_WINDOW   (4 * STREAM_AHEAD)
+
+void trackSeek(struct MD_MFTrack *t, uint32_t offset)
+// Put the window at offset in the file, keeping what is already there
+{
+  uint32_t end = t->_startOffset + t->_length;
+  uint32_t keep = 0;
+  uint32_t want;
+  ssize_t  n;
+
+  if (offset >= t->_winOffset && offset < t->_winOffset + t->_winLen)
+  {
+    keep = t->_winOffset + t->_winLen - offset;
+    memmove(t->_win, t->_win + (offset - t->_winOffset), keep);
+  }
+
+  want = MIN(t->_winSize, end - MIN(offset, end));
+  t->_winOffset = offset;
+  t->_winLen = keep;
+  while (t->_winLen < want)
+  {
+    n = pread(t->_fd, t->_win + t->_winLen, want - t->_winLen, offset + t->_winLen);
+    if (n <= 0)
+      break;
+    t->_winLen += n;
+  }
+  t->_curr = t->_win;
+
+  // let the kernel read the next window while this one is played
+  if (offset + t->_winLen < end)
+    posix_fadvise(t->_fd, offset + t->_winLen, MIN(t->_winSize, end - offset - t->_winLen), POSIX_FADV_WILLNEED);
+}
+
+void trackFill(struct MD_MFTrack *t)
+// Refill the window if there is not enough ahead of the cursor for the next event
+{
+  uint32_t used = t->_curr - t->_win;
+  uint32_t end = t->_startOffset + t->_length;
+
+  // a SYSEX or META event longer than the window leaves the cursor past its end
+  if (used <= t->_winLen && 
+      (t->_winLen - used >= STREAM_AHEAD || t->_winOffset + t->_winLen >= end))
+    return;
+
+  trackSeek(t, t->_winOffset + used);
+}
+
+const uint8_t *trackPayload(struct MD_MIDIFile *m, struct MD_MFTrack *t, const uint8_t **pp, uint32_t *len)
+// Get the *len bytes of SYSEX or META payload at *pp in one piece and move *pp 
+// past them. The SMF image was checked at load, so the payload is known to be 
+// inside the track. When streaming the file is read again, so the payload is cut 
+// short at the end of the track, the window is moved to start at the payload if 
+// it is not all there, and a payload bigger than the window is read into the 
+// overflow buffer.
+{
+  const uint8_t *p = *pp;
+  uint32_t offset, end;
+  ssize_t  n;
+
+  if (!TRACK_STREAMING(t))
+  {
+    *pp = p + *len;
+    return(p);
+  }
+
+  offset = t->_winOffset + (p - t->_win);
+  end = t->_startOffset + t->_length;
+  *len = MIN(*len, end - MIN(offset, end));
+
+  if ((uint32_t)(p - t->_win) + *len <= t->_winLen)
+  {
+    *pp = p + *len;
+    return(p);
+  }
+
+  if (*len <= t->_winSize)
+  {
+    trackSeek(t, offset);
+    *pp = t->_win + *len;
+    return(t->_win);
+  }
+
+  // bigger than the window
+  if (*len > m->_streamLongSize)
+  {
+    uint8_t *buf = realloc(m->_streamLong, *len);
+
+    if (buf == NULL)    // skip it, the handler gets none of it
+    {
+      trackSeek(t, offset + *len);
+      *len = 0;
+      *pp = t->_win;
+      return(t->_win);
+    }
+    m->_streamLong = buf;
+    m->_streamLongSize = *len;
+  }
+  n = pread(t->_fd, m->_streamLong, *len, offset);
+  trackSeek(t, offset + *len);
+  *len = MAX(n, 0);
+  *pp = t->_win;
+  return(m->_streamLong);
+}
+
+const uint8_t *trackSkip(struct MD_MFTrack *t, const uint8_t *p, uint32_t len)
+// Step over len bytes of SYSEX or META payload at p without reading them. When 
+// streaming this stops at the end of the track, like trackPayload(), and the cursor 
+// may land past the window, which the next trackFill() sorts out.
+{
+  uint32_t offset, end;
+
+  if (!TRACK_STREAMING(t))
+    return(p + len);
+
+  offset = t->_winOffset + (p - t->_win);
+  end = t->_startOffset + t->_length;
+  return(p + MIN(len, end - MIN(offset, end)));
+}
+
+BOOL trackDone(struct MD_MFTrack *t)
+// true if the cursor has reached the end of the track data
+{
+  if (TRACK_STREAMING(t))
+    return(t->_winOffset + (uint32_t)(t->_curr - t->_win) >= t->_startOffset + t->_length);
+
+  return(t->_curr >= t->_data + t->_length);
+}
+
+int openStream(struct MD_MIDIFile *m)
+// Give each track its read ahead window and let go of the SMF image
+{
+  uint32_t size;
+  uint16_t i;
+
+  if ((m->_streamFd = open(m->_fileName, O_RDONLY)) < 0)
+    return(2);
+  posix_fadvise(m->_streamFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // the windows share MIDI_STREAM_BUFFER bytes
+  size = (m->_trackCount == 0 ? MIDI_STREAM_BUFFER : MIDI_STREAM_BUFFER / m->_trackCount);
+  size = MAX(size, STREAM_MIN_WINDOW);
+  if ((m->_streamBuf = malloc(size * MAX(m->_trackCount, 1))) == NULL)
+  {
+    close(m->_streamFd);
+    m->_streamFd = -1;
+    return(8);
+  }
+
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    struct MD_MFTrack *t = &m->_track[i];
+
+    t->_win = m->_streamBuf + i*size;
+    t->_winSize = size;
+    t->_winOffset = t->_winLen = 0;
+    t->_fd = m->_streamFd;
+  }
+
+  unmapStreamImage(m);
+  return(-1);
+}
+
+void closeStream(struct MD_MIDIFile *m)
+// Release the read ahead windows
+{
+  uint16_t i;
+
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    m->_track[i]._win = NULL;
+    m->_track[i]._winSize = m->_track[i]._winLen = 0;
+  }
+  free(m->_streamBuf);
+  m->_streamBuf = NULL;
+  free(m->_streamLong);
+  m->_streamLong = NULL;
+  m->_streamLongSize = 0;
+  if (m->_streamFd >= 0)
+    close(m->_streamFd);
+  m->_streamFd = -1;
+}
+
+BOOL mapStreamImage(struct MD_MIDIFile *m)
+// Seek and chase work on the whole SMF image. While they run the image is 
+// mapped again and the track cursors are moved from the windows into it.
+{
+  uint16_t i;
+
+  if (!loadImage(m))
+    return(FALSE);
+
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    struct MD_MFTrack *t = &m->_track[i];
+    uint32_t offset = t->_winOffset + (t->_curr - t->_win);
+
+    t->_data = m->_data + t->_startOffset;
+    t->_curr = m->_data + MIN(offset, t->_startOffset + t->_length);
+  }
+
+  return(TRUE);
+}
+
+void unmapStreamImage(struct MD_MIDIFile *m)
+// Move the track cursors back into the windows and let go of the image
+{
+  uint16_t i;
+
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    struct MD_MFTrack *t = &m->_track[i];
+    uint32_t offset = t->_curr - m->_data;
+
+    t->_data = NULL;
+    t->_winLen = 0;     // nothing in the window is kept
+    trackSeek(t, offset);
+  }
+
+  unloadImage(m);
+}
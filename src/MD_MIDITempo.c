@@ -0,0 +1,498 @@
+/*
+  MD_MIDITempo.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include "MD_MIDIFile.h"
+#include "MD_MIDIHelper.h"
+
+/**
+ * \file
+ * \brief Main file for the tempo map implementation
+ */
+
+#define DEFAULT_US_PER_QN 500000    // 120 beats per minute when the SMF does not say
+
+static void addTempo(struct MD_MIDIFile *m, uint32_t tick, uint32_t usPerQN)
+// Insert a tempo change in tick order. A later change at the same tick replaces
+// the earlier one, as it would when the events are played.
+{
+  struct MD_MFTempo *map = m->_tempoMap;
+  uint16_t i = m->_tempoCount;
+
+  while (i > 0 && map[i-1].tick > tick)
+    i--;
+  if (i > 0 && map[i-1].tick == tick)
+  {
+    map[i-1].usPerQN = usPerQN;
+    return;
+  }
+  memmove(&map[i+1], &map[i], (m->_tempoCount - i) * sizeof(map[0]));
+  map[i].tick = tick;
+  map[i].usPerQN = usPerQN;
+  m->_tempoCount++;
+}
+
+static void addTimeSig(struct MD_MIDIFile *m, uint32_t tick, uint8_t num, uint8_t den)
+// Insert a time signature change in tick order, like addTempo()
+{
+  struct MD_MFTimeSig *map = m->_timeSigMap;
+  uint16_t i = m->_timeSigCount;
+
+  while (i > 0 && map[i-1].tick > tick)
+    i--;
+  if (i == 0 || map[i-1].tick != tick)
+  {
+    memmove(&map[i+1], &map[i], (m->_timeSigCount - i) * sizeof(map[0]));
+    m->_timeSigCount++;
+    i++;
+  }
+  map[i-1].tick = tick;
+  map[i-1].num = num;
+  map[i-1].den = den;
+}
+
+static BOOL scanTempo(struct MD_MIDIFile *m, struct MD_MFTrack *t, BOOL bAdd, uint32_t *tempos, uint32_t *sigs)
+// Walk a track looking for set tempo and time signature events. These are counted, 
+// and added to the maps if bAdd. The track end tick is saved in _songTicks.
+// This is also the check that the track can be played: every delta time and event 
+// up to the end of track META must be whole and inside the chunk, and no set tempo
+// may be 0. Returns false with the offset of the bad delta time or event in 
+// _errorOffset if not.
+{
+  const uint8_t *p = t->_data;
+  const uint8_t *end = t->_data + t->_length;
+  uint32_t tick = 0;
+  uint8_t  rs = 0;
+  uint8_t  status, d1, d2;
+  uint32_t payload, delta;
+  BOOL     bOk = TRUE;
+
+  while (p < end)   // a chunk may end without the end of track META
+  {
+    const uint8_t *ev = p;
+
+    if (!decodeVarLen(&p, end, &delta) || !decodeEvent(m, &p, end, &rs, &status, &d1, &d2, &payload))
+    {
+      m->_errorOffset = ev - m->_data;
+      bOk = FALSE;
+      break;
+    }
+    tick += delta;
+    if (status == 0xff && (d1 == 0x51 || d1 == 0x58))
+    {
+      const uint8_t *q = m->_data + payload + 1;
+      uint32_t len, usPerQN;
+
+      decodeVarLen(&q, end, &len);    // already checked by decodeEvent()
+      if (d1 == 0x51 && len == 3 && decodeMultiByte(&q, end, MB_TRYTE, &usPerQN))
+      {
+        if (usPerQN == 0)   // no time per tick to play at
+        {
+          m->_errorOffset = ev - m->_data;
+          bOk = FALSE;
+          break;
+        }
+        if (bAdd)
+          addTempo(m, tick, usPerQN);
+        (*tempos)++;
+      }
+      else if (d1 == 0x58 && len >= 2 && q[0] != 0 && q[1] < 8)
+      {
+        if (bAdd)
+          addTimeSig(m, tick, q[0], 1 << q[1]);  // denominator is 2^n
+        (*sigs)++;
+      }
+    }
+    if (IS_END_OF_TRACK(status, d1))
+      break;
+  }
+
+  t->_ticks = tick;
+  if (tick > m->_songTicks)
+    m->_songTicks = tick;
+  return(bOk);
+}
+
+static uint32_t barTicks(struct MD_MIDIFile *m, const struct MD_MFTimeSig *sig)
+// length of a bar in ticks for the time signature
+{
+  return(((uint32_t)m->_ticksPerQuarterNote * 4 * sig->num) / sig->den);
+}
+
+static uint64_t segmentMicros(struct MD_MIDIFile *m, struct MD_MFTempo *seg, uint32_t tick)
+// Time from the start of the segment to tick, rounded up so that it is the first
+// microsecond at which the tick has been reached
+{
+  uint64_t x = (uint64_t)(tick - seg->tick) * seg->usPerQN;
+
+  return((x + m->_ticksPerQuarterNote - 1) / m->_ticksPerQuarterNote);
+}
+
+int buildTempoMap(struct MD_MIDIFile *m)
+// Collect the tempo and time signature changes from all tracks into the maps 
+// and work out the time and the bar at which each one starts.
+{
+  uint32_t tempos = 1;   // room for the default tempo at tick 0
+  uint32_t sigs = 1;     // and for the default 4/4
+  uint16_t i;
+
+  // the first pass also checks the tracks, so a corrupt SMF fails here
+  m->_songTicks = 0;
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    if (!scanTempo(m, &m->_track[i], FALSE, &tempos, &sigs))
+      return((10*(i+1))+2);
+  }
+
+  m->_tempoMap = malloc(tempos * sizeof(struct MD_MFTempo));
+  m->_timeSigMap = malloc(sigs * sizeof(struct MD_MFTimeSig));
+  if (m->_tempoMap == NULL || m->_timeSigMap == NULL)
+  {
+    freeTempoMap(m);
+    return(8);
+  }
+
+  m->_tempoCount = m->_timeSigCount = 0;
+  addTempo(m, 0, DEFAULT_US_PER_QN);
+  addTimeSig(m, 0, 4, 4);
+  tempos = sigs = 0;
+  for (i = 0; i < m->_trackCount; i++)
+  {
+    scanTempo(m, &m->_track[i], TRUE, &tempos, &sigs);
+    if (m->_format == 2)
+      break;
+  }
+
+  // the tracks of a format 2 file have no common timeline, so it plays at the
+  // tempo and time signature set at the start of track 0
+  if (m->_format == 2)
+  {
+    for (i = 0; i < m->_tempoCount && m->_tempoMap[i].tick == 0; i++)
+      ;
+    m->_tempoCount = i;
+    for (i = 0; i < m->_timeSigCount && m->_timeSigMap[i].tick == 0; i++)
+      ;
+    m->_timeSigCount = i;
+  }
+
+  // cumulative time at the start of each segment
+  m->_tempoMap[0].micros = 0;
+  for (i = 1; i < m->_tempoCount; i++)
+  {
+    struct MD_MFTempo *prev = &m->_tempoMap[i-1];
+
+    m->_tempoMap[i].micros = prev->micros + segmentMicros(m, prev, m->_tempoMap[i].tick);
+  }
+
+  // bar at the start of each time signature. A change in the middle of a bar
+  // starts a new bar, as a sequencer would show it.
+  m->_timeSigMap[0].bar = 0;
+  for (i = 1; i < m->_timeSigCount; i++)
+  {
+    struct MD_MFTimeSig *prev = &m->_timeSigMap[i-1];
+    uint32_t len = barTicks(m, prev);
+
+    m->_timeSigMap[i].bar = prev->bar + (m->_timeSigMap[i].tick - prev->tick + len - 1) / len;
+  }
+
+  return(-1);
+}
+
+void freeTempoMap(struct MD_MIDIFile *m)
+// Release the tempo and time signature maps
+{
+  free(m->_tempoMap);
+  free(m->_timeSigMap);
+  m->_tempoMap = NULL;
+  m->_timeSigMap = NULL;
+  m->_tempoCount = 0;
+  m->_timeSigCount = 0;
+  m->_songTicks = 0;
+}
+
+static uint16_t findTempoTick(struct MD_MIDIFile *m, uint32_t tick)
+// binary search for the last segment starting at or before tick
+{
+  uint16_t lo = 0, hi = m->_tempoCount;
+
+  while (hi - lo > 1)
+  {
+    uint16_t mid = (lo + hi) / 2;
+
+    if (m->_tempoMap[mid].tick <= tick)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return(lo);
+}
+
+static uint16_t findTempoMicros(struct MD_MIDIFile *m, uint64_t us)
+// binary search for the last segment starting at or before us
+{
+  uint16_t lo = 0, hi = m->_tempoCount;
+
+  while (hi - lo > 1)
+  {
+    uint16_t mid = (lo + hi) / 2;
+
+    if (m->_tempoMap[mid].micros <= us)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return(lo);
+}
+
+static void smpteTickTime(struct MD_MIDIFile *m, uint64_t *num, uint64_t *den)
+// Length of a tick with an SMPTE time division, as num/den microseconds. 29.97 
+// frames per second is 30 frames in 1.001 seconds.
+{
+  if (m->_smpteFps == 29)
+  {
+    *num = 1001000;
+    *den = 30 * m->_smpteRes;
+  }
+  else
+  {
+    *num = 1000000;
+    *den = m->_smpteFps * m->_smpteRes;
+  }
+}
+
+uint64_t tickToMicros(struct MD_MIDIFile *m, uint32_t tick)
+{
+  struct MD_MFTempo *seg;
+
+  if (m->_smpteFps != 0)
+  {
+    uint64_t num, den;
+
+    smpteTickTime(m, &num, &den);
+    return((tick * num + den - 1) / den);  // rounded up, as segmentMicros()
+  }
+  if (m->_tempoCount == 0)
+    return((uint64_t)tick * m->_tickTime);
+
+  seg = &m->_tempoMap[findTempoTick(m, tick)];
+  return(seg->micros + segmentMicros(m, seg, tick));
+}
+
+uint32_t microsToTick(struct MD_MIDIFile *m, uint64_t us)
+{
+  struct MD_MFTempo *seg;
+
+  if (m->_smpteFps != 0)
+  {
+    uint64_t num, den;
+
+    smpteTickTime(m, &num, &den);
+    return((us * den) / num);
+  }
+  if (m->_tempoCount == 0)
+    return(m->_tickTime == 0 ? 0 : us / m->_tickTime);
+
+  seg = &m->_tempoMap[findTempoMicros(m, us)];
+  return(seg->tick + ((us - seg->micros) * m->_ticksPerQuarterNote) / seg->usPerQN);
+}
+
+uint32_t getTempoAt(struct MD_MIDIFile *m, uint32_t tick)
+{
+  if (m->_tempoCount == 0)
+    return(DEFAULT_US_PER_QN);
+
+  return(m->_tempoMap[findTempoTick(m, tick)].usPerQN);
+}
+
+static uint16_t findTimeSigTick(struct MD_MIDIFile *m, uint32_t tick)
+// binary search for the last time signature starting at or before tick
+{
+  uint16_t lo = 0, hi = m->_timeSigCount;
+
+  while (hi - lo > 1)
+  {
+    uint16_t mid = (lo + hi) / 2;
+
+    if (m->_timeSigMap[mid].tick <= tick)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return(lo);
+}
+
+static uint16_t findTimeSigBar(struct MD_MIDIFile *m, uint32_t bar)
+// binary search for the last time signature starting at or before bar
+{
+  uint16_t lo = 0, hi = m->_timeSigCount;
+
+  while (hi - lo > 1)
+  {
+    uint16_t mid = (lo + hi) / 2;
+
+    if (m->_timeSigMap[mid].bar <= bar)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return(lo);
+}
+
+uint32_t barToTick(struct MD_MIDIFile *m, uint32_t bar, uint8_t beat)
+{
+  struct MD_MFTimeSig *sig;
+
+  if (m->_timeSigCount == 0)
+    return(0);
+
+  // bars and beats are counted from 1
+  bar = (bar == 0 ? 0 : bar - 1);
+  beat = (beat == 0 ? 0 : beat - 1);
+
+  sig = &m->_timeSigMap[findTimeSigBar(m, bar)];
+  return(sig->tick + (bar - sig->bar) * barTicks(m, sig) + 
+         ((uint32_t)beat * m->_ticksPerQuarterNote * 4) / sig->den);
+}
+
+uint16_t getTimeSignatureAt(struct MD_MIDIFile *m, uint32_t tick)
+{
+  struct MD_MFTimeSig *sig;
+
+  if (m->_timeSigCount == 0)
+    return((4 << 8) + 4);
+
+  sig = &m->_timeSigMap[findTimeSigTick(m, tick)];
+  return((sig->num << 8) + sig->den);
+}
+
+uint8_t getFrameRate(struct MD_MIDIFile *m)
+{
+  return(m->_smpteFps);
+}
+
+uint32_t getSongTicks(struct MD_MIDIFile *m)
+{
+  return(m->_songTicks);
+}
+
+uint32_t getSongDuration(struct MD_MIDIFile *m)
+{
+  return(tickToMicros(m, m->_songTicks) / 1000);
+}
+
+void resetPosition(struct MD_MIDIFile *m)
+// Start from the first bar, and publish it
+{
+  m->_posSig = 0;
+  m->_posBar = 0;
+  m->_posBarTick = 0;
+  m->_posTick = 0;
+  m->_posEnd = tickToMicros(m, m->_songTicks);
+  updatePosition(m);
+}
+
+static void publishPosition(struct MD_MIDIFile *m, const midi_position *p)
+// Seqlock write, there is only ever one writer. The words are stored atomically
+// as a reader may be copying them at the same time.
+{
+  const uint32_t *src = (const uint32_t *)p;
+  uint32_t *dst = (uint32_t *)&m->_position;
+  uint32_t seq = m->_posSeq;
+  uint8_t i;
+
+  __atomic_store_n(&m->_posSeq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);    // the odd count is seen before any new word
+  for (i = 0; i < sizeof(midi_position) / sizeof(uint32_t); i++)
+    __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&m->_posSeq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void updatePosition(struct MD_MIDIFile *m)
+// Playback only moves forward between seeks, so the time signature in force and 
+// the bar are carried on from the last position. Going back starts from the map.
+{
+  static const struct MD_MFTimeSig common = { 0, 0, 4, 4 };   // if the SMF has none
+  const struct MD_MFTimeSig *sig;
+  uint32_t tick = m->_songTick;
+  uint32_t len, inBar;
+  midi_position p;
+  uint64_t us;
+
+  if (tick < m->_posTick && m->_timeSigCount != 0)
+  {
+    m->_posSig = findTimeSigTick(m, tick);
+    m->_posBar = m->_timeSigMap[m->_posSig].bar;
+    m->_posBarTick = m->_timeSigMap[m->_posSig].tick;
+  }
+  while (m->_posSig + 1 < m->_timeSigCount && m->_timeSigMap[m->_posSig + 1].tick <= tick)
+  {
+    m->_posSig++;
+    m->_posBar = m->_timeSigMap[m->_posSig].bar;
+    m->_posBarTick = m->_timeSigMap[m->_posSig].tick;
+  }
+  if (tick < m->_posBarTick)    // no map, back to the start
+    m->_posBar = m->_posBarTick = 0;
+  m->_posTick = tick;
+
+  sig = (m->_timeSigCount != 0 ? &m->_timeSigMap[m->_posSig] : &common);
+  len = barTicks(m, sig);
+  if (len != 0 && tick - m->_posBarTick >= len)
+  {
+    uint32_t bars = (tick - m->_posBarTick) / len;
+
+    m->_posBar += bars;
+    m->_posBarTick += bars * len;
+  }
+
+  inBar = tick - m->_posBarTick;
+  len = ((uint32_t)m->_ticksPerQuarterNote * 4) / sig->den;  // a beat
+  p.bar = m->_posBar + 1;
+  p.beat = (len == 0 ? 0 : MIN(inBar / len, sig->num - 1U));
+  p.tick = inBar - p.beat * len;
+  p.beat++;
+  p.songTick = tick;
+  p.timeSig = (sig->num << 8) + sig->den;
+  us = getTempoAt(m, tick);     // the tempo map, as _tempo is a whole BPM
+  p.tempo = (us == 0 ? 0 : (60000000UL + us / 2) / us);
+
+  us = MIN(m->_playMicros, m->_posEnd);
+  p.elapsed = us / 1000;
+  p.remaining = (m->_posEnd - us) / 1000;
+
+  publishPosition(m, &p);
+}
+
+void getPosition(struct MD_MIDIFile *m, midi_position *pos)
+{
+  uint32_t *dst = (uint32_t *)pos;
+  uint32_t seq;
+  uint8_t i;
+
+  do
+  {
+    while ((seq = __atomic_load_n(&m->_posSeq, __ATOMIC_ACQUIRE)) & 1)
+      ;   // being written
+    for (i = 0; i < sizeof(midi_position) / sizeof(uint32_t); i++)
+      dst[i] = __atomic_load_n(&((uint32_t *)&m->_position)[i], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);    // the words are read before the count again
+  } while (__atomic_load_n(&m->_posSeq, __ATOMIC_RELAXED) != seq);
+}
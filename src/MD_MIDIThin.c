@@ -0,0 +1,281 @@
+/*
+  MD_MIDIThin.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include "MD_MIDIFile.h"
+
+/**
+ * \file
+ * \brief Main file for the controller thinning implementation
+ *
+ * Thinning is a pass over the compiled timeline. Each channel has a stream for 
+ * every controller, pitch bend and channel aftertouch, and one for the aftertouch
+ * of every key. A message is removed when it repeats the value last kept in its 
+ * stream, or is within the tolerance of it and soon after it. The last message 
+ * removed is held, and put back if it turns out to be a peak or dip of the curve
+ * or the value the stream comes to rest at.
+ */
+
+#define THIN_STREAMS  (16 * (THIN_CONTROLS + 128))  // the key aftertouch streams follow the others
+
+struct thinStream
+{
+  BOOL      seen;     // a message has been kept since the stream was last started
+  uint16_t  kept;     // value of the last message kept
+  uint32_t  keptMs;   // and its time
+  uint32_t  held;     // timeline index + 1 of the last message removed, 0 if none
+  uint16_t  heldVal;  // its value
+  uint32_t  heldMs;   // and its time
+  BOOL      listed;   // in the list of streams used since the last full restart
+};
+
+void initThinning(struct MD_MIDIFile *m)
+{
+  static const uint8_t cc[] = { 1, 2, 4, 7, 10, 11 };
+  uint16_t i;
+
+  for (i = 0; i < THIN_CONTROLS; i++)
+    m->_thinTol[i] = THIN_OFF;
+  for (i = 0; i < ARRAY_SIZE(cc); i++)
+    m->_thinTol[cc[i]] = MIDI_THIN_CC_TOL;
+  m->_thinTol[THIN_BEND] = MIDI_THIN_BEND_TOL;
+  m->_thinTol[THIN_PRESSURE] = MIDI_THIN_PRESSURE_TOL;
+  m->_thinMode = FALSE;
+  m->_thinBytes = 0;
+}
+
+static void keepHeld(struct thinStream *s, uint8_t *drop)
+// Put the held message back
+{
+  drop[s->held - 1] = FALSE;
+  s->kept = s->heldVal;
+  s->keptMs = s->heldMs;
+  s->held = 0;
+}
+
+static void restartStreams(struct thinStream *s, uint32_t count, uint8_t *drop)
+// Start count streams afresh, keeping the messages they hold
+{
+  for (; count > 0; count--, s++)
+  {
+    if (s->held != 0)
+      keepHeld(s, drop);
+    s->seen = FALSE;
+  }
+}
+
+static void restartUsed(struct thinStream *streams, uint16_t *used, uint16_t *count, uint8_t *drop)
+// Start afresh all the streams used since the last time, so a SYSEX costs as
+// much as the streams the song uses and not all of them
+{
+  uint16_t i;
+
+  for (i = 0; i < *count; i++)
+  {
+    restartStreams(&streams[used[i]], 1, drop);
+    streams[used[i]].listed = FALSE;
+  }
+  *count = 0;
+}
+
+static BOOL thinStream(struct thinStream *s, uint16_t tol, uint16_t val, uint32_t ms, uint32_t i, uint8_t *drop)
+// Decide on message i of a stream. Returns true if it is removed.
+{
+  uint16_t diff;
+
+  if (!s->seen)
+  {
+    s->seen = TRUE;
+    s->kept = val;
+    s->keptMs = ms;
+    s->held = 0;
+    return(FALSE);
+  }
+
+  // the message held is needed if the stream rested on it or turned back at it
+  if (s->held != 0 &&
+      (ms - s->heldMs >= MIDI_THIN_INTERVAL ||
+       (s->heldVal > s->kept) != (val > s->heldVal) || val == s->heldVal))
+    keepHeld(s, drop);
+
+  diff = (val > s->kept ? val - s->kept : s->kept - val);
+  if (diff == 0)
+    return(TRUE);   // nothing to put back, the value is already there
+  if (diff <= tol && ms - s->keptMs < MIDI_THIN_INTERVAL)
+  {
+    s->held = i + 1;
+    s->heldVal = val;
+    s->heldMs = ms;
+    return(TRUE);
+  }
+
+  s->kept = val;
+  s->keptMs = ms;
+  s->held = 0;
+  return(FALSE);
+}
+
+int thinEvents(struct MD_MIDIFile *m)
+// Remove the redundant controller messages from the compiled timeline and move 
+// what is left to a block of the right size
+{
+  struct MD_MFEvents *e = &m->_events;
+  struct MD_MFEvents thin;
+  struct thinStream *streams;
+  uint16_t *used;     // the streams used since the last full restart
+  uint16_t usedCount = 0;
+  uint32_t bytes = 0;
+  uint32_t count, i, n;
+  uint8_t *drop;
+  uint8_t *mem;
+
+  m->_thinBytes = 0;
+  if ((streams = calloc(THIN_STREAMS, sizeof(*streams) + sizeof(*used))) == NULL)
+    return(8);
+  used = (uint16_t *)(streams + THIN_STREAMS);
+  if ((drop = calloc(e->count + 1, 1)) == NULL)
+  {
+    free(streams);
+    return(8);
+  }
+
+  for (i = 0; i < e->count; i++)
+  {
+    uint8_t ch = e->status[i] & 0xf;
+    struct thinStream *s;
+    uint16_t val;
+    uint16_t tol;
+
+    // the patterns of a format 2 file each play on their own
+    if (m->_format == 2 && i > 0 && e->track[i] != e->track[i-1])
+      restartUsed(streams, used, &usedCount, drop);
+
+    switch (e->status[i] & 0xf0)
+    {
+    case 0xa0:    // key aftertouch
+      s = &streams[16 * THIN_CONTROLS + ch * 128 + e->data1[i]];
+      tol = m->_thinTol[THIN_PRESSURE];
+      val = e->data2[i];
+      break;
+
+    case 0xb0:
+      if (e->data1[i] == 121)   // reset all controllers
+      {
+        restartStreams(&streams[ch * THIN_CONTROLS], THIN_CONTROLS, drop);
+        restartStreams(&streams[16 * THIN_CONTROLS + ch * 128], 128, drop);
+        continue;
+      }
+      s = &streams[ch * THIN_CONTROLS + e->data1[i]];
+      tol = m->_thinTol[e->data1[i]];
+      val = e->data2[i];
+      break;
+
+    case 0xd0:    // channel aftertouch
+      s = &streams[ch * THIN_CONTROLS + THIN_PRESSURE];
+      tol = m->_thinTol[THIN_PRESSURE];
+      val = e->data1[i];
+      break;
+
+    case 0xe0:
+      s = &streams[ch * THIN_CONTROLS + THIN_BEND];
+      tol = m->_thinTol[THIN_BEND];
+      val = e->data1[i] | (e->data2[i] << 7);
+      break;
+
+    case 0xf0:    // a SYSEX may reset the device
+      if (e->status[i] != 0xff)
+        restartUsed(streams, used, &usedCount, drop);
+      continue;
+
+    default:
+      continue;
+    }
+
+    if (tol == THIN_OFF)
+      continue;
+    if (!s->listed)
+    {
+      s->listed = TRUE;
+      used[usedCount++] = s - streams;
+    }
+    drop[i] = thinStream(s, tol, val, tickToMicros(m, e->tick[i]) / 1000, i, drop);
+  }
+  restartUsed(streams, used, &usedCount, drop);
+  free(streams);
+
+  for (i = count = 0; i < e->count; i++)
+  {
+    if (drop[i])
+      bytes += ((e->status[i] & 0xf0) == 0xd0 ? 2 : 3);
+    else
+      count++;
+  }
+
+  if (count < e->count)
+  {
+    if ((mem = malloc(eventsSize(count) + 1)) == NULL)
+    {
+      free(drop);
+      return(8);
+    }
+    setEventColumns(&thin, mem, count);
+
+    for (i = n = 0; i < e->count; i++)
+    {
+      if (drop[i])
+        continue;
+      thin.tick[n] = e->tick[i];
+      thin.payload[n] = e->payload[i];
+      thin.track[n] = e->track[i];
+      thin.status[n] = e->status[i];
+      thin.data1[n] = e->data1[i];
+      thin.data2[n] = e->data2[i];
+      n++;
+    }
+    freeEvents(m);
+    *e = thin;
+  }
+  free(drop);
+
+  m->_thinBytes = bytes;
+  return(-1);
+}
+
+void setThinning(struct MD_MIDIFile *m, BOOL bMode)
+{
+  m->_thinMode = bMode;
+}
+
+void setThinTolerance(struct MD_MIDIFile *m, uint8_t ctl, uint16_t tolerance)
+{
+  if (ctl < THIN_CONTROLS)
+    m->_thinTol[ctl] = tolerance;
+}
+
+uint32_t getThinSaving(struct MD_MIDIFile *m)
+{
+  uint32_t ms = getSongDuration(m);
+
+  if (ms == 0)
+    return(0);
+  return((uint64_t)m->_thinBytes * 1000 / ms);
+}
@@ -32,8 +32,14 @@ void resetTrack(struct MD_MFTrack *t)
 {
   t->_length = 0;        // length of track in bytes
   t->_startOffset = 0;   // start of the track in bytes from start of file
+  t->_data = NULL;       // start of the track in the SMF image
+  t->_cp = NULL;         // seek checkpoints
+  t->_cpCount = 0;
+  t->_win = NULL;        // read ahead window when streaming
+  t->_winOffset = t->_winLen = t->_winSize = 0;
+  t->_fd = -1;
   restartTrack(t);
-  t->_trackId = 255;
+  t->_trackId = 0xffff;
 }
 
 
@@ -54,74 +60,63 @@ BOOL getEndOfTrack(struct MD_MFTrack *t)
   return t->_endOfTrack;
 }
 
-void syncTime(struct MD_MFTrack *t)
-{
-  t->_elapsedTicks = 0;
-}
-
 void restartTrack(struct MD_MFTrack *t)
 // Start playing the track from the beginning again
 {
-  t->_currOffset = 0;
-  t->_endOfTrack = FALSE;
-  t->_elapsedTicks = 0;
+  if (TRACK_STREAMING(t))
+    trackSeek(t, t->_startOffset);
+  else
+    t->_curr = t->_data;
+  t->_nextTick = 0;
+  t->_endOfTrack = (t->_length == 0);
+
+  // the delta time of the first event is read ahead so the scheduler
+  // knows when this track is next due
+  if (!t->_endOfTrack)
+    t->_nextTick = readVarLenBuf(&t->_curr);
 }
 
-BOOL getNextTrackEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t, uint16_t tickCount)
+BOOL getNextTrackEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t)
 // track_event = <time:v> + [<midi_event> | <meta_event> | <sysex_event>]
+// The scheduler only calls this once _nextTick is due. The event at the cursor
+// is processed and the delta time of the following one is read ahead.
 {
-  uint32_t deltaT;
-
   // is there anything to process?
   if (t->_endOfTrack)
     return(FALSE);
 
-  // move the file pointer to where we left off
-  fseek(mf->_fd,t->_startOffset+t->_currOffset,SEEK_SET);
-
-  // Work out new total elapsed ticks - include the overshoot from
-  // last event.
-  t->_elapsedTicks += tickCount;
-
-  // Get the DeltaT from the file in order to see if enough ticks have
-  // passed for the event to be active.
-  deltaT = readVarLen(mf->_fd);
-
-  // If not enough ticks, just return without saving the file pointer and 
-  // we will go back to the same spot next time.
-  if (t->_elapsedTicks < deltaT)
-    return(FALSE);
-
-  // Adjust the total elapsed time to the error against actual DeltaT to avoid 
-  // accumulation of errors, as we only check for _elapsedTicks being >= ticks,
-  // giving positive biased errors every time.
-  t->_elapsedTicks -= deltaT;
-
-  DUMP("\ndT: ", deltaT);
-  DUMP(" + ", _elapsedTicks);
+  DUMP("\nT: ", t->_nextTick);
   DUMPS("\t");
 
+  // parseEvent() advances the cursor past the event, which must be in the
+  // window when streaming
+  if (TRACK_STREAMING(t))
+    trackFill(t);
   parseEvent(mf,t);
 
-  // remember the offset for next time
-  t->_currOffset = ftell(mf->_fd) - t->_startOffset;
-
   // catch end of track when there is no META event  
-  t->_endOfTrack = t->_endOfTrack || (t->_currOffset >= t->_length);
-  if (t->_endOfTrack) DUMPS(" - OUT OF TRACK");
+  t->_endOfTrack = t->_endOfTrack || trackDone(t);
+  if (t->_endOfTrack)
+  {
+    DUMPS(" - OUT OF TRACK");
+    return(FALSE);
+  }
+
+  if (TRACK_STREAMING(t))
+    trackFill(t);
+  t->_nextTick += readVarLenBuf(&t->_curr);
 
   return(TRUE);
 }
 
 void parseEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t)
-// process the event from the physical file
+// process the event from the SMF image
 {
+  const uint8_t *p = t->_curr;
   uint8_t eType;
-  uint8_t bVal;
-  uint32_t mLen;
   uint8_t i;
   // now we have to process this event
-  fread(&eType,1,1,mf->_fd);
+  eType = *p++;
 
   switch (eType)
   {
@@ -136,14 +131,14 @@ void parseEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t)
     t->_mev.data[0] = eType;
     t->_mev.channel = t->_mev.data[0] & 0xf;  // mask off the channel
     t->_mev.data[0] = t->_mev.data[0] & 0xf0; // just the command byte
-    fread(&t->_mev.data[1],1,1,mf->_fd);
-    fread(&t->_mev.data[2],1,1,mf->_fd);
+    t->_mev.data[1] = *p++;
+    t->_mev.data[2] = *p++;
     DUMP("[MID2] Ch: ", _mev.channel);
     DUMPX(" Data: ", _mev.data[0]);
     DUMPX(" ", _mev.data[1]);
     DUMPX(" ", _mev.data[2]);	
 #if !DUMP_DATA
-    if (mf->_midiHandler != NULL)
+    if (mf->_midiHandler != NULL && (mf->_eventMask & EVENT_MIDI) && !mutedEvent(mf, &t->_mev, t->_mev.channel))
       (mf->_midiHandler)(mf->_uart,&t->_mev);
 #endif // !DUMP_DATA
   break;
@@ -153,13 +148,13 @@ void parseEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t)
     t->_mev.data[0] = eType;
     t->_mev.channel = t->_mev.data[0] & 0xf;  // mask off the channel
     t->_mev.data[0] = t->_mev.data[0] & 0xf0; // just the command byte
-    fread(&t->_mev.data[1],1,1,mf->_fd);
+    t->_mev.data[1] = *p++;
     DUMP("[MID1] Ch: ", _mev.channel);
     DUMPX(" Data: ", _mev.data[0]);
     DUMPX(" ", _mev.data[1]);
 
 #if !DUMP_DATA
-    if (mf->_midiHandler != NULL)
+    if (mf->_midiHandler != NULL && (mf->_eventMask & EVENT_MIDI) && !mutedEvent(mf, &t->_mev, t->_mev.channel))
       (mf->_midiHandler)(mf->_uart,&t->_mev);
 #endif
   break;
@@ -178,7 +173,7 @@ void parseEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t)
     t->_mev.data[1] = eType;
     for (i = 2; i < t->_mev.size; i++)
     {
-      fread(&t->_mev.data[i],1,1,mf->_fd);  // next byte
+      t->_mev.data[i] = *p++;  // next byte
     } 
 
     DUMP("[MID+] Ch: ", _mev.channel);
@@ -189,7 +184,7 @@ void parseEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t)
     }
 
 #if !DUMP_DATA
-    if (mf->_midiHandler != NULL)
+    if (mf->_midiHandler != NULL && (mf->_eventMask & EVENT_MIDI) && !mutedEvent(mf, &t->_mev, t->_mev.channel))
       (mf->_midiHandler)(mf->_uart,&t->_mev);
 #endif
   }
@@ -198,276 +193,225 @@ void parseEvent(struct MD_MIDIFile *mf,struct MD_MFTrack *t)
 // ---------------------------- SYSEX
   case 0xf0:  // sysex_event = 0xF0 + <len:1> + <data_bytes> + 0xF7 
   case 0xf7:  // sysex_event = 0xF7 + <len:1> + <data_bytes> + 0xF7 
-  {
-    sysex_event sev;
-    uint16_t index = 0;
-
-    // collect all the bytes until the 0xf7 - boundaries are included in the message
-    sev.track = t->_trackId;
-    mLen = readVarLen(mf->_fd);
-    sev.size = mLen;
-    if (eType==0xF0)       // add space for 0xF0
-    {
-      sev.data[index++] = eType;
-      sev.size++;
-    }
-    uint16_t minLen = MIN(sev.size, ARRAY_SIZE(sev.data));
-    // The length parameter includes the 0xF7 but not the start boundary.
-    // However, it may be bigger than our buffer will allow us to store.
-    for (i=index; i<minLen; ++i)
-      fread(&sev.data[i],1,1,mf->_fd);
-    if (sev.size>minLen)
-      fseek(mf->_fd,ftell(mf->_fd) + (sev.size-minLen),SEEK_SET);
-
-#if DUMP_DATA
-    DUMPS("[SYSX] Data:");
-    for (uint16_t i = 0; i<minLen; i++)
-    {
-      DUMPX(" ", sev.data[i]);
-    }
-    if (sev.size>minLen)
-      DUMPS("...");
-#else
-    if (mf->_sysexHandler != NULL)
-      (mf->_sysexHandler)(&sev);
-#endif
-  }
+    p = parseSysex(mf, t, eType, p);
   break;
 
 // ---------------------------- META
   case 0xff:  // meta_event = 0xFF + <meta_type:1> + <length:v> + <event_data_bytes>
+    p = parseMeta(mf, t, p);
+  break;
+  
+// ---------------------------- UNKNOWN
+  default:
+    // loadMIDIFile() rejects a file with one of these, but a streamed file may
+    // have changed since. Stop playing this track as we cannot identify the eType
+    t->_endOfTrack = TRUE;
+    DUMPX("[UKNOWN 0x", eType);
+    DUMPS("] Track aborted");
+    break;
+  }
+
+  t->_curr = p;
+}
+
+const uint8_t *parseSysex(struct MD_MIDIFile *mf,struct MD_MFTrack *t, uint8_t eType, const uint8_t *p)
+// process a SYSEX event, p points just after the 0xF0/0xF7 and the returned
+// pointer is just after the event
+{
+  sysex_event sev;
+
+  // the length parameter includes the 0xF7 but not the start boundary
+  sev.size = readVarLenBuf(&p);
+#if !DUMP_DATA
+  if (!SYSEX_WANTED(mf))
+    return(trackSkip(t, p, sev.size));   // the data is never touched
+#endif
+  sev.track = t->_trackId;
+  sev.type = eType;
+  sev.data = trackPayload(mf, t, &p, &sev.size);
+
+#if DUMP_DATA
+  DUMPS("[SYSX] Data:");
+  DUMPX(" ", sev.type);
+  for (uint32_t i = 0; i<sev.size; i++)
   {
-    meta_event mev;
-    
-	fread(&eType,1,1,mf->_fd);
-    mLen =  readVarLen(mf->_fd);
+    DUMPX(" ", sev.data[i]);
+  }
+#else
+  if (mf->_sysexHandler != NULL)
+    (mf->_sysexHandler)(&sev);
+#endif
+
+  return(p);
+}
+
+const uint8_t *parseMeta(struct MD_MIDIFile *mf,struct MD_MFTrack *t, const uint8_t *p)
+// process a META event, p points just after the 0xFF and the returned
+// pointer is just after the event
+{
+  meta_event mev;
+  const uint8_t *d;
+  BOOL bWanted;
+
+  mev.type = *p++;
+  mev.size = readVarLenBuf(&p);
+
+  // Types nobody is interested in are stepped over using the length alone
+  bWanted = META_WANTED(mf, mev.type);
+  if (!bWanted && !IS_PLAYER_META(mev.type))
+    return(trackSkip(t, p, mev.size));
 
-    mev.track = t->_trackId;
-    mev.size = mLen;
-    mev.type = eType;
+  mev.track = t->_trackId;
+  mev.data = d = trackPayload(mf, t, &p, &mev.size);   // p is now at the next event
+  mev.key[0] = '\0';
 
-    //DUMPX("[META] Type: 0x", eType);
-    //DUMP("\tLen: ", mLen);
-   // DUMPS("\t");
+  //DUMPX("[META] Type: 0x", mev.type);
+  //DUMP("\tLen: ", mev.size);
+ // DUMPS("\t");
 
-    switch (eType)
+  switch (mev.type)
+  {
+    case 0x2f:  // End of track
     {
-      case 0x2f:  // End of track
-      {
-        t->_endOfTrack = TRUE;
-        //DUMPS("END OF TRACK");
-      }
-      break;
+      t->_endOfTrack = TRUE;
+      //DUMPS("END OF TRACK");
+    }
+    break;
 
-      case 0x51:  // set Tempo - really the microseconds per tick
-      {
-        uint32_t value = readMultiByte(mf->_fd, MB_TRYTE);
-        
-        setMicrosecondPerQuarterNote(mf,value);
-        
-        mev.data[0] = (value >> 16) & 0xFF;
-        mev.data[1] = (value >> 8) & 0xFF;
-        mev.data[2] = value & 0xFF;
-        
-        //DUMP("SET TEMPO to ", getTickTime(mf));
-        //DUMP(" us/tick or ", getTempo(mf));
-        //DUMPS(" beats/min");
-      }
-      break;
-
-      case 0x58:  // time signature
-      {
-        uint8_t n,d;
-		fread(&n,1,1,mf->_fd);
-        fread(&d,1,1,mf->_fd);
-        
-        setTimeSignature(mf,n, 1 << d);  // denominator is 2^n
-        fseek(mf->_fd,ftell(mf->_fd) + (mLen - 2),SEEK_SET);
-
-        mev.data[0] = n;
-        mev.data[1] = d;
-        mev.data[2] = 0;
-        mev.data[3] = 0;
-
-        //DUMP("SET TIME SIGNATURE to ", getTimeSignature(mf) >> 8);
-        //DUMP("/", getTimeSignature(mf) & 0xf);
-      }
-      break;
-
-      case 0x59:  // Key Signature
-      {
-        int8_t sf,mi;
+    case 0x51:  // set Tempo - really the microseconds per tick
+    if (mev.size >= 3)
+    {
+      uint32_t value = readMultiByteBuf(&d, MB_TRYTE);
+      
+      setMicrosecondPerQuarterNote(mf,value);
+      
+      //DUMP("SET TEMPO to ", getTickTime(mf));
+      //DUMP(" us/tick or ", getTempo(mf));
+      //DUMPS(" beats/min");
+    }
+    break;
+
+    case 0x58:  // time signature
+    if (mev.size >= 2)
+    {
+      setTimeSignature(mf, d[0], 1 << d[1]);  // denominator is 2^n
+
+      //DUMP("SET TIME SIGNATURE to ", getTimeSignature(mf) >> 8);
+      //DUMP("/", getTimeSignature(mf) & 0xf);
+    }
+    break;
+
+    case 0x59:  // Key Signature - the name is only built for the callback
+    if (bWanted)
+    {
+      int8_t sf,mi;
 		//DUMPS("KEY SIGNATURE");
-        fread(&sf,1,1,mf->_fd);
-        fread(&mi,1,1,mf->_fd);
-        const char* aaa[] = {"Cb", "Gb", "Db", "Ab", "Eb", "Bb", "F", "C", "G", "D", "A", "E", "B", "F#", "C#", "G#", "D#", "A#"};
+      const char* aaa[] = {"Cb", "Gb", "Db", "Ab", "Eb", "Bb", "F", "C", "G", "D", "A", "E", "B", "F#", "C#", "G#", "D#", "A#"};
 
-        if (sf >= -7 && sf <= 7) 
-        {
-          switch(mi)
-          {
-            case 0:
-              strcpy(mev.chars, aaa[sf+7]);
-              strcat(mev.chars, "M");
-              break;
-            case 1:
-              strcpy(mev.chars, aaa[sf+10]);
-              strcat(mev.chars, "m");
-              break;
-            default:
-              strcpy(mev.chars, "Err"); // error mi
-          }
-        } else
-          strcpy(mev.chars, "Err"); // error sf
-
-        mev.size = strlen(mev.chars); // change META length
-        //DUMP(" ", mev.chars);
-      }
-      break;
-
-      case 0x00:  // Sequence Number
+      sf = (mev.size >= 2 ? (int8_t)d[0] : -128);
+      mi = (mev.size >= 2 ? (int8_t)d[1] : -1);
+      if (sf >= -7 && sf <= 7) 
       {
-        uint16_t x = readMultiByte(mf->_fd, MB_WORD);
+        switch(mi)
+        {
+          case 0:
+            strcpy(mev.key, aaa[sf+7]);
+            strcat(mev.key, "M");
+            break;
+          case 1:
+            strcpy(mev.key, aaa[sf+10]);
+            strcat(mev.key, "m");
+            break;
+          default:
+            strcpy(mev.key, "Err"); // error mi
+        }
+      } else
+        strcpy(mev.key, "Err"); // error sf
+
+      //DUMP(" ", mev.key);
+    }
+    break;
 
-        mev.data[0] = (x >> 8) & 0xFF;
-        mev.data[1] = x & 0xFF;
+#if SHOW_UNUSED_META
+    case 0x01:  // Text
+    //DUMPS("TEXT ");
+    break;
 
-        //DUMP("SEQUENCE NUMBER ", mev.data[0]);
-        //DUMP(" ", mev.data[1]);
-      }
-      break;
+    case 0x02:  // Copyright Notice
+    //DUMPS("COPYRIGHT ");
+    break;
 
-      case 0x20:  // Channel Prefix
-      mev.data[0] = readMultiByte(mf->_fd, MB_BYTE);
-      //DUMP("CHANNEL PREFIX ", mev.data[0]);
-      break;
+    case 0x03:  // Sequence or Track Name
+    //DUMPS("SEQ/TRK NAME ");
+    break;
 
-      case 0x21:  // Port Prefix
-      mev.data[0] = readMultiByte(mf->_fd, MB_BYTE);
-      //DUMP("PORT PREFIX ", mev.data[0]);
-      break;
+    case 0x04:  // Instrument Name
+    //DUMPS("INSTRUMENT ");
+    break;
 
-#if SHOW_UNUSED_META
-      case 0x01:  // Text
-      //DUMPS("TEXT ");
-      for (i=0; i<mLen; i++)
-        fread(&bVal,1,1,mf->_fd);
-      break;
-
-      case 0x02:  // Copyright Notice
-      //DUMPS("COPYRIGHT ");
-      for (i=0; i<mLen; i++)
-    	  fread(&bVal,1,1,mf->_fd);
-      break;
-
-      case 0x03:  // Sequence or Track Name
-      //DUMPS("SEQ/TRK NAME ");
-      for (i=0; i<mLen; i++)
-        	fread(&bVal,1,1,mf->_fd);
-      break;
-
-      case 0x04:  // Instrument Name
-      //DUMPS("INSTRUMENT ");
-      for (i=0; i<mLen; i++)
-        	fread(&bVal,1,1,mf->_fd);
-      break;
-
-      case 0x05:  // Lyric
-      //DUMPS("LYRIC ");
-      for (i=0; i<mLen; i++)
-       	fread(&bVal,1,1,mf->_fd);
-      break;
-
-      case 0x06:  // Marker
-      //DUMPS("MARKER ");
-      for (i=0; i<mLen; i++)
-        	fread(&bVal,1,1,mf->_fd);
-      break;
-
-      case 0x07:  // Cue Point
-      //DUMPS("CUE POINT ");
-      for (i=0; i<mLen; i++)
-        	fread(&bVal,1,1,mf->_fd);
-      break;
-
-      case 0x54:  // SMPTE Offset
-      //DUMPS("SMPTE OFFSET");
-      for (i=0; i<mLen; i++)
-      {
-        	fread(&bVal,1,1,mf->_fd);
-      }
-      break;
+    case 0x05:  // Lyric
+    //DUMPS("LYRIC ");
+    break;
 
-      case 0x7F:  // Sequencer Specific Metadata
-      //DUMPS("SEQ SPECIFIC");
-      for (i=0; i<mLen; i++)
-      {
-        	fread(&bVal,1,1,mf->_fd);
-      }
-      break;
+    case 0x06:  // Marker
+    //DUMPS("MARKER ");
+    break;
+
+    case 0x07:  // Cue Point
+    //DUMPS("CUE POINT ");
+    break;
+
+    case 0x54:  // SMPTE Offset
+    //DUMPS("SMPTE OFFSET");
+    break;
+
+    case 0x7F:  // Sequencer Specific Metadata
+    //DUMPS("SEQ SPECIFIC");
+    break;
 #endif // SHOW_UNUSED_META
 
-      default:
-      {
-        uint8_t minLen = MIN(ARRAY_SIZE(mev.data), mLen);
-        
-        for (i = 0; i < minLen; ++i)
-          	fread(&mev.data[i],1,1,mf->_fd); // read next
-		 		  
-        mev.chars[minLen] = '\0'; // in case it is a string
-        if (mLen > ARRAY_SIZE(mev.data))
-          fseek(mf->_fd,ftell(mf->_fd) + (mLen-ARRAY_SIZE(mev.data)),SEEK_SET);
-  //    DUMPS("IGNORED");
-      }
-      break;
-    }
-    if (mf->_metaHandler != NULL)
-      (mf->_metaHandler)(&mev);
-  }
-  break;
-  
-// ---------------------------- UNKNOWN
-  default:
-    // stop playing this track as we cannot identify the eType
-    t->_endOfTrack = TRUE;
-    DUMPX("[UKNOWN 0x", eType);
-    DUMPS("] Track aborted");
+    // everything else is passed on as it is, for the handler to decode
+    default:
+//    DUMPS("IGNORED");
     break;
   }
+
+  if (bWanted)
+    (mf->_metaHandler)(&mev);
+
+  return(p);
 }
 
-int loadTrack(struct MD_MFTrack *t,uint8_t trackId, struct MD_MIDIFile *mf)
+int loadTrack(struct MD_MFTrack *t,uint16_t trackId, struct MD_MIDIFile *mf, uint32_t offset)
 {
+  const uint8_t *p = mf->_data + offset;
   uint32_t  dat32;
-  //uint16_t  dat16;
 
   // save the trackid for use later
   t->_trackId = t->_mev.track = trackId;
   
   // Read the Track header
   // track_chunk = "MTrk" + <length:4> + <track_event> [+ <track_event> ...]
-  {
-    char    h[MTRK_HDR_SIZE+1]; // Header characters + nul
-    dat32 = fread(h,MTRK_HDR_SIZE,1,mf->_fd);
-    h[MTRK_HDR_SIZE] = '\0';
-
-    if (strcmp(h, MTRK_HDR) != 0)
-      return(0);
-  }
+  if (offset + MTRK_HDR_SIZE + MB_LONG > mf->_dataLen)
+    return(0);
+  if (memcmp(p, MTRK_HDR, MTRK_HDR_SIZE) != 0)
+    return(0);
+  p += MTRK_HDR_SIZE;
 
   // Row read track chunk size and in bytes. This is not really necessary 
   // since the track MUST end with an end of track meta event.
-  dat32 = readMultiByte(mf->_fd, MB_LONG);
+  dat32 = readMultiByteBuf(&p, MB_LONG);
   t->_length = dat32;
 
-  // save where we are in the file as this is the start of offset for this track
-  t->_startOffset = ftell(mf->_fd);
-  t->_currOffset = 0;
+  // save where we are in the image as this is the start of offset for this track
+  t->_startOffset = p - mf->_data;
+  t->_data = p;
 
-  // Advance the file pointer to the start of the next track;
-  if (fseek(mf->_fd,(t->_startOffset+t->_length),SEEK_SET) == -1)
+  // The whole chunk must be inside the image
+  if (t->_length > mf->_dataLen - t->_startOffset)
     return(1);
 
+  restartTrack(t);
   return(-1);
 }
 
@@ -479,7 +423,7 @@ void dumpTrack(struct MD_MFTrack *t)
   DUMP("\nLength:\t\t\t", t->_length);
   DUMP("\nFile Location:\t\t", t->_startOffset);
   DUMP("\nEnd of Track:\t\t", t->_endOfTrack);
-  DUMP("\nCurrent buffer offset:\t", t->_currOffset);
+  DUMP("\nCurrent buffer offset:\t", t->_curr - t->_data);
 }
 #endif // DUMP_DATA
 
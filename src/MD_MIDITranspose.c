@@ -0,0 +1,213 @@
+/*
+  MD_MIDITranspose.c - An Arduino library for processing Standard MIDI Files (SMF).
+  Copyright (C) 2012 Marco Colli
+  All rights reserved.
+
+  See MD_MIDIFile.h for complete comments
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include "MD_MIDIFile.h"
+
+/**
+ * \file
+ * \brief Main file for the transpose and channel map implementation
+ *
+ * The compiled timeline may be mapped from the cache or the song pack, so it is
+ * never changed. The status and data1 of every event are worked out again into a
+ * transform buffer, which dispatchEvent() plays from instead. There are two 
+ * buffers: a change made while playing is applied to the one not in use by a 
+ * background thread, and handed to the playing thread through _xformNext as the 
+ * preloader hands over songs.
+ */
+
+#define XFORM_SIZE(count)  (16 + 2*(count))   // channel map, status and data1 columns
+
+static BOOL isIdentity(struct MD_MIDIFile *m)
+// Nothing to transform
+{
+  uint8_t ch;
+
+  for (ch = 0; ch < 16 && m->_channelMap[ch] == ch; ch++)
+    ;
+  return(ch == 16 && m->_transpose == 0);
+}
+
+static void transformEvents(struct MD_MIDIFile *m, uint8_t *x)
+// Work out the transform buffer x from the compiled timeline. Each column is
+// done in a simple pass of its own.
+{
+  struct MD_MFEvents *e = &m->_events;
+  uint8_t *status = x + 16;
+  uint8_t *data1 = status + e->count;
+  uint8_t note[2][128];   // note number with and without the transpose
+  uint8_t ch;
+  uint32_t i;
+
+  memcpy(x, m->_channelMap, 16);
+
+  for (i = 0; i < 128; i++)
+  {
+    int16_t n = (int16_t)i + m->_transpose;
+
+    while (n > 127)
+      n -= 12;
+    while (n < 0)
+      n += 12;
+    note[0][i] = i;
+    note[1][i] = n;
+  }
+
+  for (i = 0; i < e->count; i++)
+  {
+    uint8_t s = e->status[i];
+
+    status[i] = (s < 0xf0 ? (s & 0xf0) | x[s & 0xf] : s);
+  }
+
+  memcpy(data1, e->data1, e->count);
+  for (i = 0; i < e->count; i++)
+  {
+    uint8_t s = e->status[i];
+
+    // note off, note on and key aftertouch
+    if (s < 0xb0)
+    {
+      ch = s & 0xf;
+      data1[i] = note[ch != MIDI_DRUM_CHANNEL && x[ch] != MIDI_DRUM_CHANNEL][data1[i]];
+    }
+  }
+}
+
+static BOOL allocTransform(struct MD_MIDIFile *m)
+// The note table and both transform buffers in one block
+{
+  if (m->_xformMem != NULL)
+    return(TRUE);
+  if ((m->_xformMem = malloc(16 * 128 * sizeof(uint16_t) + 2 * XFORM_SIZE(m->_events.count))) == NULL)
+    return(FALSE);
+  m->_xformSent = (uint16_t *)m->_xformMem;
+  memset(m->_xformSent, 0, 16 * 128 * sizeof(uint16_t));
+  return(TRUE);
+}
+
+static uint8_t *xformBuffer(struct MD_MIDIFile *m, uint8_t n)
+{
+  return(m->_xformMem + 16 * 128 * sizeof(uint16_t) + n * XFORM_SIZE(m->_events.count));
+}
+
+int initTransform(struct MD_MIDIFile *m)
+{
+  if (isIdentity(m))
+    return(-1);
+  if (!allocTransform(m))
+    return(8);
+  m->_xform = m->_xformPosted = xformBuffer(m, 0);
+  transformEvents(m, m->_xform);
+  return(-1);
+}
+
+static void stopTransform(struct MD_MIDIFile *m)
+// Wait for the background thread to finish
+{
+  if (m->_xformThreadStarted)
+  {
+    pthread_join(m->_xformThread, NULL);
+    m->_xformThreadStarted = FALSE;
+  }
+}
+
+void freeTransform(struct MD_MIDIFile *m)
+{
+  stopTransform(m);
+  free(m->_xformMem);
+  m->_xformMem = NULL;
+  m->_xformSent = NULL;
+  m->_xform = m->_xformNext = m->_xformPosted = NULL;
+}
+
+static void *transformThread(void *arg)
+// Rebuild the transform buffer the playing thread is not using and hand it over
+{
+  struct MD_MIDIFile *m = arg;
+  uint8_t *x;
+
+  // a buffer not yet taken is not in use, and is replaced. Otherwise the playing
+  // thread has the one posted last, or will have once it has swapped it in.
+  if ((x = __sync_lock_test_and_set(&m->_xformNext, NULL)) == NULL)
+    x = xformBuffer(m, m->_xformPosted == xformBuffer(m, 0));
+  transformEvents(m, x);
+
+  // publish it, the full barrier makes the buffer seen before the pointer
+  m->_xformPosted = x;
+  __sync_bool_compare_and_swap(&m->_xformNext, NULL, x);
+  return(NULL);
+}
+
+static void startTransform(struct MD_MIDIFile *m)
+// Apply the settings to the song playing in the background
+{
+  if (!m->_fileOpen || m->_loadMode != LOAD_COMPILED)
+    return;     // applied when the song is loaded
+  if (m->_xformMem == NULL && isIdentity(m))
+    return;
+
+  if (allocTransform(m))
+    m->_xformThreadStarted = (pthread_create(&m->_xformThread, NULL, transformThread, m) == 0);
+}
+
+void swapTransform(struct MD_MIDIFile *m)
+// Both atomics are full barriers, so the background thread only reuses the
+// buffer swapped out once the playing thread is done reading it
+{
+  uint8_t *x = __sync_val_compare_and_swap(&m->_xformNext, NULL, NULL);
+
+  if (x != NULL && __sync_bool_compare_and_swap(&m->_xformNext, x, NULL))
+  {
+    // the notes sounding before the first transform had their note ons left
+    // out of _xformSent, so their note offs would go out transformed and miss
+    if (m->_xform == NULL)
+      soundingOff(m);
+    m->_xform = x;
+  }
+}
+
+void setTranspose(struct MD_MIDIFile *m, int8_t semitones)
+{
+  stopTransform(m);
+  m->_transpose = MAX(semitones, -127);
+  startTransform(m);
+}
+
+int8_t getTranspose(struct MD_MIDIFile *m)
+{
+  return(m->_transpose);
+}
+
+void setChannelMap(struct MD_MIDIFile *m, uint8_t from, uint8_t to)
+{
+  if (from > 15 || to > 15)
+    return;
+  stopTransform(m);
+  m->_channelMap[from] = to;
+  startTransform(m);
+}
+
+uint8_t getChannelMap(struct MD_MIDIFile *m, uint8_t ch)
+{
+  return(ch < 16 ? m->_channelMap[ch] : ch);
+}
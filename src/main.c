@@ -115,6 +115,8 @@ int main(int argc,char *argv[]) {
 		if (read(fd_spi, inputdata, 6) > 0){
 			if((*((uint64_t *)inputdata)) == 0x0000FFFFFFFFFFFF)
 				continue;
+			midiFileVolume(inputdata[POT0]);	/* the mixers are only rebuilt when a pot moves */
+			midiPlayVolume(inputdata[POT1]);
 			translateJoystick(inputdata[JOYX], inputdata[JOYY], &joyx, &joyy);
 			sleepTime = calculateSleepTime(joyx);
 			joychanged = TRUE;
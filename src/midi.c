@@ -9,6 +9,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <math.h>
 #include "midi.h"
 
 // midi state machine
@@ -21,7 +22,8 @@ unsigned char midiBytesToIgnore;
 struct midi_time_event work_event;
 BOOL noteEvent = FALSE;
 
-unsigned char playVolume = 65,fileVolume;
+// output mixers for the file player and for live thru
+struct mixer fileMixer,playMixer;
 
 /* simple map of midi messages
       first byte
@@ -56,6 +58,63 @@ F F   0                            Reset
 
 void midiInit(){
 	midiState = MIDI_WAIT;
+	mixerInit(&fileMixer);
+	mixerInit(&playMixer);
+}
+
+/* Work out the mixer tables from the faders. This is the only place with any
+ * arithmetic, mixing a message is then one table lookup. CC7 and CC11 multiply
+ * together on the instrument, so each is scaled by the square root of the gain.
+ * With a fader down the note ons go out at velocity 0, so nothing is heard. */
+static void mixerBuild(struct mixer *mx){
+	unsigned char ch,v;
+
+	for(ch = 0; ch < 16; ch++){
+		unsigned long gain = (unsigned long)mx->master * mx->level[ch];	/* unity is 255*127 */
+		double root = sqrt(gain / (255.0 * 127.0));
+
+		for(v = 0; v < 128; v++){
+			mx->velocity[ch][v] = (v * gain + 255 * 127 / 2) / (255 * 127);
+			if(gain > 0 && v > 0 && mx->velocity[ch][v] == 0)
+				mx->velocity[ch][v] = 1;	/* a note on must not turn into a note off */
+			mx->volume[ch][v] = (unsigned char)(v * root + 0.5);
+		}
+	}
+}
+
+void mixerInit(struct mixer *mx){
+	mx->master = 255;
+	memset(mx->level,127,sizeof(mx->level));
+	mixerBuild(mx);
+}
+
+void mixerMaster(struct mixer *mx,unsigned char vol){
+	if(vol == mx->master)
+		return;
+	mx->master = vol;
+	mixerBuild(mx);
+}
+
+void mixerChannel(struct mixer *mx,unsigned char ch,unsigned char vol){
+	vol = MIN(vol,127);
+	if(ch > 15 || vol == mx->level[ch])
+		return;
+	mx->level[ch] = vol;
+	mixerBuild(mx);
+}
+
+void mixMessage(struct mixer *mx,unsigned char *data){
+	unsigned char ch = data[0] & MIDI_CHANNEL_MASK;
+
+	switch(data[0] & MIDI_STATUS_MASK){
+		case MIDI_NOTE_ON:
+			data[2] = mx->velocity[ch][data[2] & MIDI_DATA_MASK];
+			break;
+		case MIDI_CONTROL_CHANGE:
+			if(data[1] == 7 || data[1] == 11)
+				data[2] = mx->volume[ch][data[2] & MIDI_DATA_MASK];
+			break;
+	}
 }
 
 unsigned char * getMidiEvent(){
@@ -141,8 +200,8 @@ BOOL readMidiMessage(unsigned char byte,unsigned char *len){
 }
 
 void sendMidiMessage(int fd,unsigned char num){
-	//if((work_event.event.data[0] & 0xF0) == 0x90)
-		//work_event.event.data[2] *= ( (float)playVolume / 255.00);
+	if(num == 3)
+		mixMessage(&playMixer,work_event.event.data);
 	write(fd,work_event.event.data,num);
 }
 
@@ -211,6 +270,7 @@ void midiFun(int fd,midi_event *ev){
 // 	 Serial.write(pev->data, pev->size);
 	if(ev->data[0] >= 0x80 && ev->data[0] <= 0xe0){
 		ev->data[0] = ev->data[0] | ev->channel;
+		mixMessage(&fileMixer,ev->data);
 		sendMidiBuffer(fd,ev->data,ev->size);
 	}
 	else	
@@ -218,10 +278,10 @@ void midiFun(int fd,midi_event *ev){
 }
 
 void midiFileVolume(unsigned char vol){
-	fileVolume = vol;
+	mixerMaster(&fileMixer,vol);
 }
 
 void midiPlayVolume(unsigned char vol){	
-	playVolume = vol;
+	mixerMaster(&playMixer,vol);
 }
 